@@ -0,0 +1,147 @@
+#ifndef _BOUNDARY_SEARCH_H_
+#define _BOUNDARY_SEARCH_H_
+
+#include <sys/types.h>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define MULTIPART_HAVE_X86_SIMD 1
+#endif
+
+/**
+ * Vectorized search for the "\r\n--boundary" delimiter in part data.
+ *
+ * A kernel looks for the first position p >= from such that the whole
+ * needle is found at buffer + p. Candidates are filtered 16 or 32 bytes at
+ * a time by comparing the first (CR) and the last character of the needle,
+ * and only the survivors are checked with memcmp. If there is no complete
+ * match, the kernel returns len.
+ *
+ * The kernel is picked once, at runtime, according to the CPU. NULL means
+ * no SIMD kernel is usable and the caller must use its scalar skip loop.
+ */
+class BoundarySearch {
+public:
+	typedef size_t (*Kernel)(const char *buffer, size_t from, size_t len,
+		const char *needle, size_t needleSize);
+
+	static Kernel kernel() {
+		static const Kernel selected = selectKernel();
+		return selected;
+	}
+
+	/**
+	 * Find the first position in [from, len) where the needle starts but is
+	 * cut by the end of the buffer, ie. buffer[p, len) is a prefix of the
+	 * needle. Returns len if there is none.
+	 */
+	static size_t findPartial(const char *buffer, size_t from, size_t len,
+		const char *needle, size_t needleSize)
+	{
+		size_t p = len >= needleSize ? len - needleSize + 1 : 0;
+		if (p < from) {
+			p = from;
+		}
+		for (; p < len; p++) {
+			if (buffer[p] == needle[0]
+			 && memcmp(buffer + p, needle, len - p) == 0) {
+				return p;
+			}
+		}
+		return len;
+	}
+
+private:
+	static bool matchesAt(const char *buffer, size_t p, const char *needle,
+		size_t needleSize)
+	{
+		return memcmp(buffer + p + 1, needle + 1, needleSize - 2) == 0;
+	}
+
+	static size_t scanTail(const char *buffer, size_t p, size_t len,
+		const char *needle, size_t needleSize)
+	{
+		const char first = needle[0];
+		const char last  = needle[needleSize - 1];
+
+		for (; p + needleSize <= len; p++) {
+			if (buffer[p] == first && buffer[p + needleSize - 1] == last
+			 && matchesAt(buffer, p, needle, needleSize)) {
+				return p;
+			}
+		}
+		return len;
+	}
+
+#ifdef MULTIPART_HAVE_X86_SIMD
+	__attribute__((target("sse2")))
+	static size_t scanSSE2(const char *buffer, size_t from, size_t len,
+		const char *needle, size_t needleSize)
+	{
+		const __m128i first = _mm_set1_epi8(needle[0]);
+		const __m128i last  = _mm_set1_epi8(needle[needleSize - 1]);
+		size_t p = from;
+
+		while (p + needleSize + 15 <= len) {
+			__m128i blockFirst = _mm_loadu_si128((const __m128i *) (buffer + p));
+			__m128i blockLast  = _mm_loadu_si128((const __m128i *) (buffer + p + needleSize - 1));
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(first, blockFirst),
+				_mm_cmpeq_epi8(last, blockLast)));
+
+			while (mask != 0) {
+				size_t candidate = p + __builtin_ctz(mask);
+				if (matchesAt(buffer, candidate, needle, needleSize)) {
+					return candidate;
+				}
+				mask &= mask - 1;
+			}
+			p += 16;
+		}
+		return scanTail(buffer, p, len, needle, needleSize);
+	}
+
+	__attribute__((target("avx2")))
+	static size_t scanAVX2(const char *buffer, size_t from, size_t len,
+		const char *needle, size_t needleSize)
+	{
+		const __m256i first = _mm256_set1_epi8(needle[0]);
+		const __m256i last  = _mm256_set1_epi8(needle[needleSize - 1]);
+		size_t p = from;
+
+		while (p + needleSize + 31 <= len) {
+			__m256i blockFirst = _mm256_loadu_si256((const __m256i *) (buffer + p));
+			__m256i blockLast  = _mm256_loadu_si256((const __m256i *) (buffer + p + needleSize - 1));
+			unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+				_mm256_cmpeq_epi8(first, blockFirst),
+				_mm256_cmpeq_epi8(last, blockLast)));
+
+			while (mask != 0) {
+				size_t candidate = p + __builtin_ctz(mask);
+				if (matchesAt(buffer, candidate, needle, needleSize)) {
+					return candidate;
+				}
+				mask &= mask - 1;
+			}
+			p += 32;
+		}
+		return scanSSE2(buffer, p, len, needle, needleSize);
+	}
+#endif
+
+	static Kernel selectKernel() {
+		#ifdef MULTIPART_HAVE_X86_SIMD
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2")) {
+				return scanAVX2;
+			}
+			if (__builtin_cpu_supports("sse2")) {
+				return scanSSE2;
+			}
+		#endif
+		return NULL;
+	}
+};
+
+#endif /* _BOUNDARY_SEARCH_H_ */
@@ -0,0 +1,185 @@
+#ifndef _MAPPED_MULTIPART_FILE_H_
+#define _MAPPED_MULTIPART_FILE_H_
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include "MultipartParser.h"
+
+/**
+ * A multipart body spooled to a file, parsed in place.
+ *
+ * The file is mapped read-only and indexed with parseContiguous(), so part
+ * data is never copied into userspace buffers: data(i) is a view of the
+ * mapping, which can be handed directly to write(), a storage client, etc.
+ * Pages are only brought in by the boundary search, sequentially, and can
+ * be dropped again with release() once a part has been dealt with.
+ *
+ * Views are valid until close(), or the destructor.
+ */
+class MappedMultipartFile {
+private:
+	char *mapping;
+	size_t mappingSize;
+	MultipartIndex index;
+	const char *errorReason;
+	int systemError;
+	bool parsed;
+
+	bool fail(const char *message, int error) {
+		close();
+		errorReason = message;
+		systemError = error;
+		return false;
+	}
+
+public:
+	MappedMultipartFile() {
+		mapping = NULL;
+		mappingSize = 0;
+		errorReason = "File not opened.";
+		systemError = 0;
+		parsed = false;
+	}
+
+	MappedMultipartFile(const MappedMultipartFile &) = delete;
+	MappedMultipartFile &operator=(const MappedMultipartFile &) = delete;
+
+	MappedMultipartFile(MappedMultipartFile &&old)
+		: mapping(old.mapping),
+		  mappingSize(old.mappingSize),
+		  index(std::move(old.index)),
+		  errorReason(old.errorReason),
+		  systemError(old.systemError),
+		  parsed(old.parsed)
+	{
+		old.mapping = NULL;
+		old.mappingSize = 0;
+		old.index.clear();
+		old.parsed = false;
+	}
+
+	~MappedMultipartFile() {
+		close();
+	}
+
+	/** Map and parse the file at path. */
+	bool open(const char *path, const std::string &boundary) {
+		int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			return fail("Cannot open file.", errno);
+		}
+		bool result = open(fd, boundary);
+		::close(fd);
+		return result;
+	}
+
+	/** Map and parse an open file. The descriptor can be closed afterwards. */
+	bool open(int fd, const std::string &boundary) {
+		struct stat sbuf;
+
+		close();
+		if (fstat(fd, &sbuf) == -1) {
+			return fail("Cannot stat file.", errno);
+		}
+		if (!S_ISREG(sbuf.st_mode)) {
+			return fail("Not a regular file.", 0);
+		}
+		if (sbuf.st_size == 0) {
+			return fail("Malformed. Empty body.", 0);
+		}
+
+		void *addr = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			return fail("Cannot map file.", errno);
+		}
+		mapping = (char *) addr;
+		mappingSize = sbuf.st_size;
+		// the boundary search reads the file front to back, once
+		madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+
+		MultipartParser parser(boundary);
+		if (!parser.parseContiguous(contents(), index)) {
+			errorReason = index.getErrorMessage();
+			return false;
+		}
+		errorReason = "No error.";
+		parsed = true;
+		return true;
+	}
+
+	void close() {
+		if (mapping != NULL) {
+			munmap(mapping, mappingSize);
+			mapping = NULL;
+			mappingSize = 0;
+		}
+		index.clear();
+		errorReason = "File not opened.";
+		systemError = 0;
+		parsed = false;
+	}
+
+	/** Whole mapped body. */
+	std::string_view contents() const {
+		return std::string_view(mapping, mappingSize);
+	}
+
+	const MultipartIndex &parts() const {
+		return index;
+	}
+
+	size_t size() const {
+		return index.size();
+	}
+
+	std::string_view headers(size_t i) const {
+		return index.headers(i);
+	}
+
+	std::string_view header(size_t i, std::string_view name) const {
+		return index.header(i, name);
+	}
+
+	std::string_view data(size_t i) const {
+		return index.data(i);
+	}
+
+	std::string_view field(std::string_view fieldName) const {
+		return index.field(fieldName);
+	}
+
+	/**
+	 * Tell the kernel the data of the i-th part will not be read again, so
+	 * its pages can be reclaimed right away. Views of it stay valid, reading
+	 * them again just faults the pages back in.
+	 */
+	void release(size_t i) {
+		long pageSize = sysconf(_SC_PAGESIZE);
+		size_t begin = (index[i].dataBegin + pageSize - 1) / pageSize * pageSize;
+		size_t end = index[i].dataEnd / pageSize * pageSize;
+		if (begin < end) {
+			madvise(mapping + begin, end - begin, MADV_DONTNEED);
+		}
+	}
+
+	bool succeeded() const {
+		return parsed;
+	}
+
+	const char *getErrorMessage() const {
+		return errorReason;
+	}
+
+	/** errno of the failed system call, 0 if the error is not one. */
+	int getSystemError() const {
+		return systemError;
+	}
+};
+
+#endif /* _MAPPED_MULTIPART_FILE_H_ */
@@ -0,0 +1,597 @@
+#ifndef _MULTIPART_ASYNC_DRIVER_H_
+#define _MULTIPART_ASYNC_DRIVER_H_
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+// Buffer rings came with Linux 5.19 and have no macro of their own;
+// IORING_SETUP_SINGLE_ISSUER was added right after them.
+#ifndef MULTIPART_HAVE_IO_URING
+	#if defined(__has_include)
+		#if __has_include(<linux/io_uring.h>)
+			#include <linux/io_uring.h>
+			#ifdef IORING_SETUP_SINGLE_ISSUER
+				#define MULTIPART_HAVE_IO_URING 1
+			#endif
+		#endif
+	#endif
+#endif
+#ifndef MULTIPART_HAVE_IO_URING
+	#define MULTIPART_HAVE_IO_URING 0
+#endif
+
+/**
+ * Feeds many parsers from many descriptors, on one thread.
+ *
+ * Each descriptor added with add() is read until end of file, and what is
+ * read is fed to its parser (a MultipartParser, a MultipartReader, or
+ * anything with feed(const char *, size_t) and stopped()). onDone is called
+ * once the descriptor reached end of file, its parser stopped, or reading
+ * failed; the descriptor is not closed by the driver.
+ *
+ * With io_uring, reads for all the descriptors are submitted and reaped
+ * with a single io_uring_enter() per round. They pick a buffer from a ring
+ * registered with the kernel, and the buffer goes back to the ring as soon
+ * as feed() returns, so only bufferCount buffers are ever needed, whatever
+ * the number of descriptors. A read that finds the ring empty waits for
+ * the next buffer fed and given back before it is submitted again.
+ * Descriptors should be left blocking; io_uring does not block the thread
+ * on them.
+ *
+ * Without io_uring (or buffer rings), the driver falls back to epoll and
+ * read() into a single buffer. Descriptors epoll cannot watch, like regular
+ * files, are always considered ready.
+ *
+ * syscalls and bytesRead tell how well it does.
+ */
+template<typename Parser>
+class MultipartAsyncDriver {
+public:
+	enum Backend {
+		AUTO,
+		IO_URING,
+		EPOLL
+	};
+
+	typedef void (*DoneCallback)(int fd, Parser &parser, int error, void *userData);
+
+	DoneCallback onDone;
+	size_t syscalls;
+	size_t bytesRead;
+
+private:
+	static const unsigned RING_ENTRIES = 256;
+	static const unsigned BUFFER_GROUP = 0;
+	static const size_t MAX_EVENTS = 64;
+
+	struct Stream {
+		int fd;
+		Parser *parser;
+		void *userData;
+		bool active;
+		bool pollable;
+	};
+
+	Backend backendInUse;
+	size_t bufferCount;
+	size_t bufferSize;
+	char *buffers;
+	size_t buffersSize;
+	std::vector<Stream> streams;
+	std::vector<size_t> freeStreams;
+	// streams to read from: waiting for a submission slot with io_uring,
+	// or not watched by epoll
+	std::vector<size_t> readQueue;
+	std::vector<size_t> readScratch;
+	// io_uring streams whose read found no buffer: read again once one is
+	// given back, not at once, or the ring would only spin on ENOBUFS
+	std::vector<size_t> starvedReads;
+	size_t readsInFlight;
+	size_t activeStreams;
+	const char *errorReason;
+	int systemError;
+
+	int epollFd;
+
+	#if MULTIPART_HAVE_IO_URING
+		int ringFd;
+		void *sqRing;
+		size_t sqRingSize;
+		void *cqRing;
+		size_t cqRingSize;
+		struct io_uring_sqe *sqes;
+		size_t sqesSize;
+		unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+		unsigned sqEntries;
+		unsigned *cqHead, *cqTail, *cqMask;
+		struct io_uring_cqe *cqes;
+		// struct io_uring_buf_ring, seen as the array of buffers it is:
+		// its flexible array member is misplaced when compiled as C++
+		struct io_uring_buf *bufRing;
+		size_t bufRingSize;
+		unsigned short bufTail;
+	#endif
+
+	bool fail(const char *message, int error) {
+		errorReason = message;
+		systemError = error;
+		return false;
+	}
+
+	static void *mapAnonymous(size_t size) {
+		void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return addr == MAP_FAILED ? NULL : addr;
+	}
+
+	/** Feed data to the parser of a stream, false once it stopped. */
+	bool deliver(size_t id, const char *data, size_t len) {
+		Parser *parser = streams[id].parser;
+		size_t fed = 0;
+
+		bytesRead += len;
+		while (fed < len && !parser->stopped()) {
+			fed += parser->feed(data + fed, len - fed);
+		}
+		return !parser->stopped();
+	}
+
+	void finish(size_t id, int error) {
+		Stream stream = streams[id];
+
+		if (backendInUse == EPOLL && stream.pollable) {
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, stream.fd, NULL);
+			syscalls++;
+		}
+		streams[id].active = false;
+		freeStreams.push_back(id);
+		activeStreams--;
+		// the callback may add another stream, possibly reusing this slot
+		if (onDone != NULL) {
+			onDone(stream.fd, *stream.parser, error, stream.userData);
+		}
+	}
+
+	#if MULTIPART_HAVE_IO_URING
+		void provideBuffer(unsigned short bid) {
+			struct io_uring_buf *buf = &bufRing[bufTail & (bufferCount - 1)];
+			buf->addr = (unsigned long long) (buffers + bid * bufferSize);
+			buf->len  = bufferSize;
+			buf->bid  = bid;
+			bufTail++;
+			// the tail of the ring overlays the reserved field of the first entry
+			__atomic_store_n(&bufRing[0].resv, bufTail, __ATOMIC_RELEASE);
+		}
+
+		/** Give a buffer back once fed, and let a starved read retry with it. */
+		void recycleBuffer(unsigned short bid) {
+			provideBuffer(bid);
+			if (!starvedReads.empty()) {
+				readQueue.push_back(starvedReads.back());
+				starvedReads.pop_back();
+			}
+		}
+
+		bool openUring() {
+			struct io_uring_params params;
+
+			memset(&params, 0, sizeof(params));
+			ringFd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+			if (ringFd == -1) {
+				return fail("Cannot set up io_uring.", errno);
+			}
+
+			sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+			if (params.features & IORING_FEAT_SINGLE_MMAP) {
+				if (cqRingSize > sqRingSize) {
+					sqRingSize = cqRingSize;
+				}
+				cqRingSize = sqRingSize;
+			}
+			sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ringFd, IORING_OFF_SQ_RING);
+			if (sqRing == MAP_FAILED) {
+				sqRing = NULL;
+				return fail("Cannot map io_uring.", errno);
+			}
+			if (params.features & IORING_FEAT_SINGLE_MMAP) {
+				cqRing = sqRing;
+			} else {
+				cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ringFd, IORING_OFF_CQ_RING);
+				if (cqRing == MAP_FAILED) {
+					cqRing = NULL;
+					return fail("Cannot map io_uring.", errno);
+				}
+			}
+			sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+			void *addr = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ringFd, IORING_OFF_SQES);
+			if (addr == MAP_FAILED) {
+				return fail("Cannot map io_uring.", errno);
+			}
+			sqes = (struct io_uring_sqe *) addr;
+
+			char *sq = (char *) sqRing;
+			char *cq = (char *) cqRing;
+			sqHead    = (unsigned *) (sq + params.sq_off.head);
+			sqTail    = (unsigned *) (sq + params.sq_off.tail);
+			sqMask    = (unsigned *) (sq + params.sq_off.ring_mask);
+			sqArray   = (unsigned *) (sq + params.sq_off.array);
+			sqEntries = params.sq_entries;
+			cqHead    = (unsigned *) (cq + params.cq_off.head);
+			cqTail    = (unsigned *) (cq + params.cq_off.tail);
+			cqMask    = (unsigned *) (cq + params.cq_off.ring_mask);
+			cqes      = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+			bufRingSize = bufferCount * sizeof(struct io_uring_buf);
+			bufRing = (struct io_uring_buf *) mapAnonymous(bufRingSize);
+			if (bufRing == NULL) {
+				return fail("Cannot allocate buffer ring.", errno);
+			}
+			struct io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.ring_addr    = (unsigned long long) bufRing;
+			reg.ring_entries = bufferCount;
+			reg.bgid         = BUFFER_GROUP;
+			if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+				return fail("Cannot register buffer ring.", errno);
+			}
+			bufTail = 0;
+			for (size_t i = 0; i < bufferCount; i++) {
+				provideBuffer(i);
+			}
+			return true;
+		}
+
+		void closeUring() {
+			if (bufRing != NULL) {
+				munmap(bufRing, bufRingSize);
+				bufRing = NULL;
+			}
+			if (sqes != NULL) {
+				munmap(sqes, sqesSize);
+				sqes = NULL;
+			}
+			if (cqRing != NULL && cqRing != sqRing) {
+				munmap(cqRing, cqRingSize);
+			}
+			cqRing = NULL;
+			if (sqRing != NULL) {
+				munmap(sqRing, sqRingSize);
+				sqRing = NULL;
+			}
+			if (ringFd != -1) {
+				::close(ringFd);
+				ringFd = -1;
+			}
+		}
+
+		/** Queue reads for waiting streams, returns the number not yet submitted. */
+		unsigned prepareReads() {
+			unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+			unsigned tail = *sqTail;
+			size_t taken = 0;
+
+			while (taken < readQueue.size() && tail - head < sqEntries) {
+				size_t id = readQueue[taken++];
+				unsigned slot = tail & *sqMask;
+				struct io_uring_sqe *sqe = &sqes[slot];
+
+				memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode    = IORING_OP_READ;
+				sqe->fd        = streams[id].fd;
+				sqe->off       = (unsigned long long) -1;  // current file position
+				sqe->len       = bufferSize;
+				sqe->flags     = IOSQE_BUFFER_SELECT;
+				sqe->buf_group = BUFFER_GROUP;
+				sqe->user_data = id;
+				sqArray[slot] = slot;
+				tail++;
+			}
+			readQueue.erase(readQueue.begin(), readQueue.begin() + taken);
+			readsInFlight += taken;
+			__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+			return tail - head;
+		}
+
+		void completeRead(size_t id, int res, unsigned flags) {
+			bool hasBuffer = (flags & IORING_CQE_F_BUFFER) != 0;
+			unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+			readsInFlight--;
+			if (res < 0) {
+				if (res == -ENOBUFS) {
+					starvedReads.push_back(id);
+				} else if (res == -EINTR || res == -EAGAIN) {
+					readQueue.push_back(id);
+				} else {
+					finish(id, -res);
+				}
+			} else if (res == 0) {
+				if (hasBuffer) {
+					recycleBuffer(bid);
+				}
+				finish(id, 0);
+			} else {
+				bool more = deliver(id, buffers + bid * bufferSize, res);
+				recycleBuffer(bid);
+				if (more) {
+					readQueue.push_back(id);
+				} else {
+					finish(id, 0);
+				}
+			}
+		}
+
+		bool stepUring() {
+			unsigned toSubmit = prepareReads();
+			int ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS,
+				NULL, 0);
+			syscalls++;
+			if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				return fail("Cannot submit reads.", errno);
+			}
+
+			unsigned head = *cqHead;
+			unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			while (head != tail) {
+				struct io_uring_cqe cqe = cqes[head & *cqMask];
+				head++;
+				__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+				completeRead(cqe.user_data, cqe.res, cqe.flags);
+			}
+			// nothing in flight holds a buffer anymore, so they are all back
+			if (readsInFlight == 0 && readQueue.empty() && !starvedReads.empty()) {
+				readQueue.swap(starvedReads);
+			}
+			return true;
+		}
+	#endif
+
+	void readStream(size_t id) {
+		if (!streams[id].active) {
+			return;
+		}
+		ssize_t len = read(streams[id].fd, buffers, bufferSize);
+		syscalls++;
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				if (!streams[id].pollable) {
+					readQueue.push_back(id);
+				}
+			} else {
+				finish(id, errno);
+			}
+		} else if (len == 0 || !deliver(id, buffers, len)) {
+			finish(id, 0);
+		} else if (!streams[id].pollable) {
+			readQueue.push_back(id);
+		}
+	}
+
+	bool stepEpoll() {
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(epollFd, events, MAX_EVENTS, readQueue.empty() ? -1 : 0);
+
+		syscalls++;
+		if (n == -1) {
+			if (errno == EINTR) {
+				return true;
+			}
+			return fail("Cannot wait for input.", errno);
+		}
+		for (int i = 0; i < n; i++) {
+			readStream(events[i].data.u64);
+		}
+		readScratch.swap(readQueue);
+		for (size_t i = 0; i < readScratch.size(); i++) {
+			readStream(readScratch[i]);
+		}
+		readScratch.clear();
+		return true;
+	}
+
+public:
+	MultipartAsyncDriver() {
+		onDone    = NULL;
+		syscalls  = 0;
+		bytesRead = 0;
+		backendInUse = AUTO;
+		bufferCount  = 0;
+		bufferSize   = 0;
+		buffers      = NULL;
+		buffersSize  = 0;
+		activeStreams = 0;
+		readsInFlight = 0;
+		errorReason  = "Driver not opened.";
+		systemError  = 0;
+		epollFd      = -1;
+		#if MULTIPART_HAVE_IO_URING
+			ringFd  = -1;
+			sqRing  = NULL;
+			cqRing  = NULL;
+			sqes    = NULL;
+			bufRing = NULL;
+		#endif
+	}
+
+	MultipartAsyncDriver(const MultipartAsyncDriver &) = delete;
+	MultipartAsyncDriver &operator=(const MultipartAsyncDriver &) = delete;
+
+	~MultipartAsyncDriver() {
+		close();
+	}
+
+	/**
+	 * Set up the driver. count, rounded up to a power of two, is the number
+	 * of read buffers, each of size bytes.
+	 */
+	bool open(Backend backend = AUTO, size_t count = 64, size_t size = 64 * 1024) {
+		close();
+		bufferCount = 1;
+		while (bufferCount < count && bufferCount < 32768) {
+			bufferCount *= 2;
+		}
+		bufferSize = size;
+
+		#if MULTIPART_HAVE_IO_URING
+			if (backend != EPOLL) {
+				buffersSize = bufferCount * bufferSize;
+				buffers = (char *) mapAnonymous(buffersSize);
+				if (buffers == NULL) {
+					return fail("Cannot allocate buffers.", errno);
+				}
+				if (openUring()) {
+					backendInUse = IO_URING;
+					errorReason = "No error.";
+					return true;
+				}
+				int error = systemError;
+				const char *reason = errorReason;
+				close();
+				if (backend == IO_URING) {
+					return fail(reason, error);
+				}
+			}
+		#else
+			if (backend == IO_URING) {
+				return fail("io_uring not supported.", 0);
+			}
+		#endif
+
+		// a single buffer is enough: it is free again once feed() returns
+		buffersSize = bufferSize;
+		buffers = (char *) mapAnonymous(buffersSize);
+		if (buffers == NULL) {
+			return fail("Cannot allocate buffers.", errno);
+		}
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (epollFd == -1) {
+			int error = errno;
+			close();
+			return fail("Cannot create epoll instance.", error);
+		}
+		backendInUse = EPOLL;
+		errorReason = "No error.";
+		return true;
+	}
+
+	/** Release everything. Streams still being read are dropped silently. */
+	void close() {
+		#if MULTIPART_HAVE_IO_URING
+			closeUring();
+		#endif
+		if (epollFd != -1) {
+			::close(epollFd);
+			epollFd = -1;
+		}
+		if (buffers != NULL) {
+			munmap(buffers, buffersSize);
+			buffers = NULL;
+		}
+		streams.clear();
+		freeStreams.clear();
+		readQueue.clear();
+		starvedReads.clear();
+		readsInFlight = 0;
+		activeStreams = 0;
+		backendInUse = AUTO;
+	}
+
+	/** Start reading fd into parser. May be called from callbacks. */
+	bool add(int fd, Parser &parser, void *userData = NULL) {
+		Stream stream;
+		size_t id;
+
+		if (backendInUse == AUTO) {
+			return fail("Driver not opened.", 0);
+		}
+		stream.fd       = fd;
+		stream.parser   = &parser;
+		stream.userData = userData;
+		stream.active   = true;
+		stream.pollable = false;
+
+		if (freeStreams.empty()) {
+			id = streams.size();
+			streams.push_back(stream);
+		} else {
+			id = freeStreams.back();
+			freeStreams.pop_back();
+			streams[id] = stream;
+		}
+
+		if (backendInUse == EPOLL) {
+			struct epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events   = EPOLLIN;
+			event.data.u64 = id;
+			syscalls++;
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0) {
+				streams[id].pollable = true;
+			} else if (errno != EPERM) {
+				streams[id].active = false;
+				freeStreams.push_back(id);
+				return fail("Cannot watch descriptor.", errno);
+			}
+		}
+		if (!streams[id].pollable) {
+			readQueue.push_back(id);
+		}
+		activeStreams++;
+		return true;
+	}
+
+	/**
+	 * Wait for input on any stream and feed it. Returns false if the driver
+	 * itself failed.
+	 */
+	bool step() {
+		#if MULTIPART_HAVE_IO_URING
+			if (backendInUse == IO_URING) {
+				return stepUring();
+			}
+		#endif
+		if (backendInUse == EPOLL) {
+			return stepEpoll();
+		}
+		return fail("Driver not opened.", 0);
+	}
+
+	/** step() until every stream is done. */
+	bool run() {
+		while (activeStreams > 0) {
+			if (!step()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Number of streams still being read. */
+	size_t pending() const {
+		return activeStreams;
+	}
+
+	Backend backend() const {
+		return backendInUse;
+	}
+
+	const char *getErrorMessage() const {
+		return errorReason;
+	}
+
+	/** errno of the failed system call, 0 if the error is not one. */
+	int getSystemError() const {
+		return systemError;
+	}
+};
+
+#endif /* _MULTIPART_ASYNC_DRIVER_H_ */
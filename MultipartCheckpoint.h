@@ -0,0 +1,96 @@
+#ifndef _MULTIPART_CHECKPOINT_H_
+#define _MULTIPART_CHECKPOINT_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+/**
+ * Encoding of parser checkpoints, see MultipartParser::serialize().
+ *
+ * A checkpoint is a sequence of unsigned integers, written as little
+ * endian base 128 varints, and of byte strings prefixed with their size.
+ * It does not depend on the platform or on compile time options, so it
+ * can be restored by another process, or another machine.
+ */
+class MultipartCheckpoint {
+public:
+	// first field of every checkpoint: "MPC" and a format version
+	static const uint64_t MAGIC = 0x4d504302;
+
+	class Writer {
+	private:
+		std::string &out;
+
+	public:
+		Writer(std::string &out): out(out) { }
+
+		void number(uint64_t value) {
+			while (value >= 0x80) {
+				out += (char) (value | 0x80);
+				value >>= 7;
+			}
+			out += (char) value;
+		}
+
+		void bytes(std::string_view data) {
+			number(data.size());
+			out.append(data.data(), data.size());
+		}
+	};
+
+	/**
+	 * Reads back what a Writer wrote. Once anything is missing or
+	 * malformed, failed() is set and every read returns 0 or an empty
+	 * view, so fields can be read unconditionally and checked once.
+	 */
+	class Reader {
+	private:
+		std::string_view data;
+		size_t pos;
+		bool error;
+
+	public:
+		Reader(std::string_view data): data(data), pos(0), error(false) { }
+
+		uint64_t number() {
+			uint64_t value = 0;
+			for (unsigned shift = 0; shift < 64 && !error; shift += 7) {
+				if (pos == data.size()) {
+					break;
+				}
+				unsigned char c = data[pos++];
+				value |= (uint64_t) (c & 0x7f) << shift;
+				if (!(c & 0x80)) {
+					return value;
+				}
+			}
+			error = true;
+			return 0;
+		}
+
+		/** A view of the checkpoint, valid as long as it is. */
+		std::string_view bytes() {
+			uint64_t size = number();
+			if (error || size > data.size() - pos) {
+				error = true;
+				return std::string_view();
+			}
+			std::string_view result = data.substr(pos, size);
+			pos += size;
+			return result;
+		}
+
+		bool failed() const {
+			return error;
+		}
+
+		/** Number of bytes read so far. */
+		size_t position() const {
+			return pos;
+		}
+	};
+};
+
+#endif /* _MULTIPART_CHECKPOINT_H_ */
@@ -0,0 +1,408 @@
+#ifndef _MULTIPART_CO_READER_H_
+#define _MULTIPART_CO_READER_H_
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "MultipartReader.h"
+
+/**
+ * Pull interface to MultipartReader for C++20 coroutines:
+ *
+ *   while (const MultipartHeaders *headers = co_await reader.nextPart()) {
+ *       std::string_view chunk;
+ *       while (co_await reader.nextChunk(chunk)) {
+ *           co_await backend.write(chunk);
+ *       }
+ *   }
+ *   if (!reader.succeeded()) ...
+ *
+ * The body is pushed by the producer side, either a coroutine with
+ *
+ *   co_await reader.write(buffer, len);
+ *
+ * which completes once the consumer is done with the buffer, or plain code
+ * with feed(), which returns true when it is. Either way, the buffer must
+ * stay valid until then: chunks are views of it. Nothing is copied but the
+ * headers, and the few bytes the parser holds back at the end of a buffer
+ * when they might begin a boundary. After the last buffer, close() tells the consumer there will be
+ * no more input, in case the body is truncated.
+ *
+ * The consumer is resumed from write() or feed() once there is something
+ * for it, and suspends when the buffer is exhausted, so input is read
+ * exactly as fast as it is consumed. It may await anything else in between;
+ * a producer awaiting write() is then resumed when the consumer asks for
+ * more.
+ *
+ * nextPart() skips whatever is left of the current part. The headers it
+ * returns are valid until the next call; NULL means the body ended, or
+ * failed. nextChunk() returns false at the end of the part.
+ *
+ * Only available when compiled as C++20.
+ */
+class MultipartCoReader {
+private:
+	enum Want {
+		WANT_PART,
+		WANT_CHUNK
+	};
+
+	struct Event {
+		enum Kind {
+			PART_BEGIN,
+			PART_DATA,
+			PART_END,
+			END
+		};
+		Kind kind;
+		std::string_view data;
+		size_t spilled;  // offset in spill of copied PART_DATA, or NONE
+		size_t headers;  // slot of PART_BEGIN
+	};
+
+	static const size_t NONE = (size_t) -1;
+
+	MultipartReader reader;
+	// events not consumed yet, and the headers of the parts they begin
+	std::vector<Event> events;
+	size_t nextEvent;
+	// PART_DATA events among them, which are views of the current buffer
+	size_t pendingData;
+	// the last chunk taken is a view of it too, until the consumer asks
+	// for more
+	bool holdingChunk;
+	const char *buffer;
+	size_t bufferSize;
+	// data the parser held back at the end of the previous buffer, in case
+	// it was the beginning of a boundary
+	std::string spill;
+	std::vector<MultipartHeaders> headerSlots;
+	size_t usedSlots;
+	MultipartHeaders currentHeaders;
+	bool inPart;
+	bool closed;
+	Want want;
+	std::coroutine_handle<> consumer;
+	std::coroutine_handle<> producer;
+
+	void pushEvent(Event::Kind kind, std::string_view data = std::string_view(),
+		size_t headers = 0)
+	{
+		Event event;
+		event.kind = kind;
+		event.data = data;
+		event.spilled = NONE;
+		event.headers = headers;
+		events.push_back(event);
+	}
+
+	static void cbPartBegin(const MultipartHeaders &headers, void *userData) {
+		MultipartCoReader *self = (MultipartCoReader *) userData;
+		if (self->usedSlots == self->headerSlots.size()) {
+			self->headerSlots.push_back(headers);
+		} else {
+			self->headerSlots[self->usedSlots] = headers;
+		}
+		self->pushEvent(Event::PART_BEGIN, std::string_view(), self->usedSlots++);
+	}
+
+	static void cbPartData(const char *buffer, size_t size, void *userData) {
+		MultipartCoReader *self = (MultipartCoReader *) userData;
+		if (size == 0) {
+			return;
+		}
+		self->pushEvent(Event::PART_DATA, std::string_view(buffer, size));
+		self->pendingData++;
+		if (buffer < self->buffer || buffer + size > self->buffer + self->bufferSize) {
+			// held back by the parser, only valid during this call
+			self->events.back().spilled = self->spill.size();
+			self->spill.append(buffer, size);
+		}
+	}
+
+	static void cbPartEnd(void *userData) {
+		((MultipartCoReader *) userData)->pushEvent(Event::PART_END);
+	}
+
+	static void cbEnd(void *userData) {
+		((MultipartCoReader *) userData)->pushEvent(Event::END);
+	}
+
+	/**
+	 * Skip the events the consumer is not interested in, true if the next
+	 * one is for it, or if there will be none.
+	 */
+	bool advance() {
+		while (nextEvent < events.size()) {
+			const Event &event = events[nextEvent];
+			if (want == WANT_CHUNK && !inPart) {
+				return true;
+			}
+			if (event.kind == Event::END
+			 || (want == WANT_PART && event.kind == Event::PART_BEGIN)
+			 || (want == WANT_CHUNK && event.kind != Event::PART_BEGIN))
+			{
+				return true;
+			}
+			if (event.kind == Event::PART_END) {
+				inPart = false;
+			} else if (event.kind == Event::PART_DATA) {
+				pendingData--;
+			}
+			nextEvent++;
+		}
+		return (want == WANT_CHUNK && !inPart) || closed || reader.stopped();
+	}
+
+	/**
+	 * Whether the consumer can go on without suspending. Once it is done
+	 * with the buffer, a producer waiting in write() gets to run first:
+	 * asking for more is how the consumer tells it is done with the
+	 * last chunk.
+	 */
+	bool ready(Want what) {
+		want = what;
+		holdingChunk = false;
+		bool result = advance();
+		return result && !(producer && isBufferFree());
+	}
+
+	const MultipartHeaders *takePart() {
+		if (nextEvent < events.size() && events[nextEvent].kind == Event::PART_BEGIN) {
+			std::swap(currentHeaders, headerSlots[events[nextEvent].headers]);
+			nextEvent++;
+			inPart = true;
+			return &currentHeaders;
+		}
+		inPart = false;
+		return NULL;
+	}
+
+	bool takeChunk(std::string_view &chunk) {
+		if (inPart && nextEvent < events.size()) {
+			const Event &event = events[nextEvent];
+			if (event.kind == Event::PART_DATA) {
+				chunk = event.data;
+				if (event.spilled != NONE) {
+					chunk = std::string_view(spill.data() + event.spilled, event.data.size());
+				}
+				nextEvent++;
+				pendingData--;
+				holdingChunk = true;
+				return true;
+			}
+			if (event.kind == Event::PART_END) {
+				nextEvent++;
+			}
+		}
+		inPart = false;
+		chunk = std::string_view();
+		return false;
+	}
+
+	std::coroutine_handle<> suspendConsumer(std::coroutine_handle<> handle) {
+		consumer = handle;
+		if (producer) {
+			std::coroutine_handle<> next = producer;
+			producer = nullptr;
+			return next;
+		}
+		return std::noop_coroutine();
+	}
+
+	/** Resume the consumer if it has something to do, true if the buffer is free. */
+	bool dispatch() {
+		if (consumer && advance()) {
+			std::coroutine_handle<> next = consumer;
+			consumer = nullptr;
+			next.resume();
+		}
+		return isBufferFree();
+	}
+	
+	bool isBufferFree() const {
+		return pendingData == 0 && !holdingChunk;
+	}
+
+	void clearEvents() {
+		events.clear();
+		nextEvent = 0;
+		pendingData = 0;
+		holdingChunk = false;
+		buffer = NULL;
+		bufferSize = 0;
+		spill.clear();
+		usedSlots = 0;
+		currentHeaders.clear();
+		inPart = false;
+		closed = false;
+		want = WANT_PART;
+		consumer = nullptr;
+		producer = nullptr;
+	}
+
+	void setReaderCallbacks() {
+		reader.onPartBegin = cbPartBegin;
+		reader.onPartData  = cbPartData;
+		reader.onPartEnd   = cbPartEnd;
+		reader.onEnd       = cbEnd;
+		reader.userData    = this;
+	}
+
+public:
+	class PartAwaiter {
+	private:
+		MultipartCoReader *reader;
+
+	public:
+		PartAwaiter(MultipartCoReader *reader): reader(reader) { }
+
+		bool await_ready() {
+			return reader->ready(WANT_PART);
+		}
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle) {
+			return reader->suspendConsumer(handle);
+		}
+
+		const MultipartHeaders *await_resume() {
+			return reader->takePart();
+		}
+	};
+
+	class ChunkAwaiter {
+	private:
+		MultipartCoReader *reader;
+		std::string_view *chunk;
+
+	public:
+		ChunkAwaiter(MultipartCoReader *reader, std::string_view *chunk)
+			: reader(reader), chunk(chunk) { }
+
+		bool await_ready() {
+			return reader->ready(WANT_CHUNK);
+		}
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle) {
+			return reader->suspendConsumer(handle);
+		}
+
+		bool await_resume() {
+			return reader->takeChunk(*chunk);
+		}
+	};
+
+	class WriteAwaiter {
+	private:
+		MultipartCoReader *reader;
+		const char *buffer;
+		size_t len;
+
+	public:
+		WriteAwaiter(MultipartCoReader *reader, const char *buffer, size_t len)
+			: reader(reader), buffer(buffer), len(len) { }
+
+		bool await_ready() {
+			return reader->feed(buffer, len);
+		}
+
+		void await_suspend(std::coroutine_handle<> handle) {
+			reader->producer = handle;
+		}
+
+		void await_resume() { }
+	};
+
+	MultipartCoReader() {
+		setReaderCallbacks();
+		clearEvents();
+	}
+
+	MultipartCoReader(const std::string &boundary): reader(boundary) {
+		setReaderCallbacks();
+		clearEvents();
+	}
+
+	MultipartCoReader(const MultipartCoReader &) = delete;
+	MultipartCoReader &operator=(const MultipartCoReader &) = delete;
+
+	/** Forget the body and boundary. Suspended coroutines are not resumed. */
+	void reset() {
+		reader.reset();
+		clearEvents();
+	}
+
+	void setBoundary(const std::string &boundary) {
+		reader.setBoundary(boundary);
+		clearEvents();
+	}
+
+	PartAwaiter nextPart() {
+		return PartAwaiter(this);
+	}
+
+	ChunkAwaiter nextChunk(std::string_view &chunk) {
+		return ChunkAwaiter(this, &chunk);
+	}
+
+	WriteAwaiter write(const char *buffer, size_t len) {
+		return WriteAwaiter(this, buffer, len);
+	}
+
+	/**
+	 * Parse the next buffer and resume the consumer. Returns true if the
+	 * consumer is done with it, otherwise it must be kept until
+	 * needsInput().
+	 */
+	bool feed(const char *buffer, size_t len) {
+		size_t fed = 0;
+
+		// the part boundaries of the previous buffer may still be pending
+		events.erase(events.begin(), events.begin() + nextEvent);
+		nextEvent = 0;
+		if (events.empty()) {
+			usedSlots = 0;
+		}
+		spill.clear();
+		this->buffer = buffer;
+		bufferSize = len;
+		while (fed < len && !reader.stopped()) {
+			fed += reader.feed(buffer + fed, len - fed);
+		}
+		return dispatch();
+	}
+
+	/** No more input: let the consumer see the end of the body. */
+	void close() {
+		closed = true;
+		dispatch();
+	}
+
+	/** True when the last buffer is no longer used and another can be fed. */
+	bool needsInput() const {
+		return isBufferFree() && !reader.stopped() && !closed;
+	}
+
+	bool succeeded() const {
+		return reader.succeeded();
+	}
+
+	bool hasError() const {
+		return reader.hasError();
+	}
+
+	bool stopped() const {
+		return reader.stopped();
+	}
+
+	const char *getErrorMessage() const {
+		return reader.getErrorMessage();
+	}
+};
+
+#endif /* C++20 */
+
+#endif /* _MULTIPART_CO_READER_H_ */
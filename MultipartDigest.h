@@ -0,0 +1,512 @@
+#ifndef _MULTIPART_DIGEST_H_
+#define _MULTIPART_DIGEST_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "MultipartCheckpoint.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define MULTIPART_HAVE_X86_SIMD 1
+#endif
+
+/**
+ * Streaming digest of part data: CRC32C, SHA-256 or XXH64, fed span by
+ * span as the data is parsed, while it is still in cache.
+ *
+ * CRC32C uses the SSE 4.2 crc32 instruction and SHA-256 the SHA
+ * extensions when the CPU has them, picked once at runtime; otherwise
+ * they fall back to portable code. XXH64 is portable code only, being
+ * made of plain 64 bit multiplications and rotations.
+ *
+ * Once finish() is called, the digest is available as bytes, in the
+ * canonical big endian order of each algorithm, or as a number for the
+ * checksums.
+ */
+class MultipartDigest {
+public:
+	enum Algorithm {
+		NONE,
+		CRC32C,
+		SHA256,
+		XXH64
+	};
+
+	static const size_t MAX_SIZE = 32;
+
+private:
+	typedef uint32_t (*CrcKernel)(uint32_t crc, const unsigned char *data, size_t len);
+	typedef void (*ShaKernel)(uint32_t state[8], const unsigned char *data, size_t blocks);
+
+	static const uint64_t PRIME64_1 = 0x9e3779b185ebca87ULL;
+	static const uint64_t PRIME64_2 = 0xc2b2ae3d27d4eb4fULL;
+	static const uint64_t PRIME64_3 = 0x165667b19e3779f9ULL;
+	static const uint64_t PRIME64_4 = 0x85ebca77c2b2ae63ULL;
+	static const uint64_t PRIME64_5 = 0x27d4eb2f165667c5ULL;
+
+	struct Kernels {
+		CrcKernel crc;
+		ShaKernel sha;
+	};
+
+	static const uint32_t *shaConstants() {
+		static const uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+		return k;
+	}
+
+	struct CrcTable {
+		uint32_t values[256];
+	};
+
+	static CrcTable buildCrcTable() {
+		CrcTable table;
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; bit++) {
+				crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+			}
+			table.values[i] = crc;
+		}
+		return table;
+	}
+
+	static uint32_t crcPortable(uint32_t crc, const unsigned char *data, size_t len) {
+		static const CrcTable table = buildCrcTable();
+		for (size_t i = 0; i < len; i++) {
+			crc = table.values[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		}
+		return crc;
+	}
+
+	static uint32_t rotr32(uint32_t x, int n) {
+		return (x >> n) | (x << (32 - n));
+	}
+
+	static uint64_t rotl64(uint64_t x, int n) {
+		return (x << n) | (x >> (64 - n));
+	}
+
+	static uint32_t load32be(const unsigned char *p) {
+		return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+	}
+
+	static uint64_t load64le(const unsigned char *p) {
+		uint64_t value;
+		memcpy(&value, p, 8);
+		#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			value = __builtin_bswap64(value);
+		#endif
+		return value;
+	}
+
+	static uint32_t load32le(const unsigned char *p) {
+		return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+	}
+
+	static void shaPortable(uint32_t state[8], const unsigned char *data, size_t blocks) {
+		const uint32_t *k = shaConstants();
+		uint32_t w[64];
+
+		for (; blocks > 0; blocks--, data += 64) {
+			for (int i = 0; i < 16; i++) {
+				w[i] = load32be(data + 4 * i);
+			}
+			for (int i = 16; i < 64; i++) {
+				uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+			uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+			uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+			for (int i = 0; i < 64; i++) {
+				uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+				uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + k[i] + w[i];
+				uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+				uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+			state[5] += f;
+			state[6] += g;
+			state[7] += h;
+		}
+	}
+
+#ifdef MULTIPART_HAVE_X86_SIMD
+	__attribute__((target("sse4.2")))
+	static uint32_t crcSSE42(uint32_t crc, const unsigned char *data, size_t len) {
+		size_t i = 0;
+		#ifdef __x86_64__
+			uint64_t crc64 = crc;
+			for (; i + 8 <= len; i += 8) {
+				uint64_t word;
+				memcpy(&word, data + i, 8);
+				crc64 = _mm_crc32_u64(crc64, word);
+			}
+			crc = (uint32_t) crc64;
+		#endif
+		for (; i < len; i++) {
+			crc = _mm_crc32_u8(crc, data[i]);
+		}
+		return crc;
+	}
+
+	/*
+	 * Four rounds per step: the message schedule for the next steps is
+	 * computed along, in the four vectors of msg, by sha256msg1/msg2.
+	 */
+	__attribute__((target("sha,sse4.1")))
+	static void shaNI(uint32_t state[8], const unsigned char *data, size_t blocks) {
+		const uint32_t *k = shaConstants();
+		const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+		__m128i msg[4];
+
+		// state as ABEF and CDGH, the layout sha256rnds2 expects
+		__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xb1);
+		__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1b);
+		__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+		state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+		for (; blocks > 0; blocks--, data += 64) {
+			__m128i saved0 = state0, saved1 = state1;
+
+			for (int step = 0; step < 16; step++) {
+				__m128i &current = msg[step & 3];
+				if (step < 4) {
+					current = _mm_shuffle_epi8(
+						_mm_loadu_si128((const __m128i *) (data + 16 * step)), byteSwap);
+				}
+				__m128i words = _mm_add_epi32(current,
+					_mm_loadu_si128((const __m128i *) (k + 4 * step)));
+				state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+				if (step >= 3 && step < 15) {
+					__m128i &next = msg[(step + 1) & 3];
+					next = _mm_add_epi32(next, _mm_alignr_epi8(current, msg[(step + 3) & 3], 4));
+					next = _mm_sha256msg2_epu32(next, current);
+				}
+				state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(words, 0x0e));
+				if (step >= 1 && step <= 12) {
+					__m128i &previous = msg[(step + 3) & 3];
+					previous = _mm_sha256msg1_epu32(previous, current);
+				}
+			}
+			state0 = _mm_add_epi32(state0, saved0);
+			state1 = _mm_add_epi32(state1, saved1);
+		}
+
+		tmp = _mm_shuffle_epi32(state0, 0x1b);
+		state1 = _mm_shuffle_epi32(state1, 0xb1);
+		_mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+		_mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(state1, tmp, 8));
+	}
+#endif
+
+	static Kernels selectKernels() {
+		Kernels kernels = { crcPortable, shaPortable };
+		#ifdef MULTIPART_HAVE_X86_SIMD
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("sse4.2")) {
+				kernels.crc = crcSSE42;
+			}
+			// no __builtin_cpu_supports("sha") in older compilers
+			unsigned eax, ebx, ecx, edx;
+			__asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+			if (eax >= 7) {
+				__asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+				if ((ebx & (1 << 29)) && __builtin_cpu_supports("sse4.1")) {
+					kernels.sha = shaNI;
+				}
+			}
+		#endif
+		return kernels;
+	}
+
+	static const Kernels &kernels() {
+		static const Kernels selected = selectKernels();
+		return selected;
+	}
+
+	static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+		acc += input * PRIME64_2;
+		acc = rotl64(acc, 31);
+		return acc * PRIME64_1;
+	}
+
+	static uint64_t xxhMerge(uint64_t acc, uint64_t value) {
+		acc ^= xxhRound(0, value);
+		return acc * PRIME64_1 + PRIME64_4;
+	}
+
+	Algorithm algorithm;
+	bool finished;
+	uint64_t total;            // bytes fed
+	uint32_t crc;
+	uint32_t sha[8];
+	uint64_t xxh[4];
+	// SHA-256 and XXH64 work on blocks of 64 and 32 bytes, the bytes of
+	// the incomplete one wait here
+	unsigned char block[64];
+	size_t blockSize;
+	unsigned char result[MAX_SIZE];
+
+	size_t blockLength() const {
+		return algorithm == SHA256 ? 64 : 32;
+	}
+
+	// whole blocks of data, for SHA256 and XXH64
+	void consume(const unsigned char *data, size_t blocks) {
+		if (algorithm == SHA256) {
+			kernels().sha(sha, data, blocks);
+			return;
+		}
+		for (; blocks > 0; blocks--, data += 32) {
+			xxh[0] = xxhRound(xxh[0], load64le(data));
+			xxh[1] = xxhRound(xxh[1], load64le(data + 8));
+			xxh[2] = xxhRound(xxh[2], load64le(data + 16));
+			xxh[3] = xxhRound(xxh[3], load64le(data + 24));
+		}
+	}
+
+	void finishSha() {
+		uint64_t bits = total * 8;
+		unsigned char padding[128] = { 0x80 };
+		size_t padSize = (blockSize < 56 ? 56 : 120) - blockSize;
+		for (int i = 0; i < 8; i++) {
+			padding[padSize + i] = (unsigned char) (bits >> (56 - 8 * i));
+		}
+		uint64_t saved = total;
+		update((const char *) padding, padSize + 8);
+		total = saved;
+		for (int i = 0; i < 8; i++) {
+			result[4 * i]     = (unsigned char) (sha[i] >> 24);
+			result[4 * i + 1] = (unsigned char) (sha[i] >> 16);
+			result[4 * i + 2] = (unsigned char) (sha[i] >> 8);
+			result[4 * i + 3] = (unsigned char) sha[i];
+		}
+	}
+
+	void finishXxh() {
+		uint64_t h;
+		if (total >= 32) {
+			h = rotl64(xxh[0], 1) + rotl64(xxh[1], 7) + rotl64(xxh[2], 12) + rotl64(xxh[3], 18);
+			for (int i = 0; i < 4; i++) {
+				h = xxhMerge(h, xxh[i]);
+			}
+		} else {
+			h = xxh[2] + PRIME64_5;
+		}
+		h += total;
+
+		const unsigned char *p = block, *end = block + blockSize;
+		for (; p + 8 <= end; p += 8) {
+			h ^= xxhRound(0, load64le(p));
+			h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		}
+		if (p + 4 <= end) {
+			h ^= (uint64_t) load32le(p) * PRIME64_1;
+			h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+			p += 4;
+		}
+		for (; p < end; p++) {
+			h ^= *p * PRIME64_5;
+			h = rotl64(h, 11) * PRIME64_1;
+		}
+		h ^= h >> 33;
+		h *= PRIME64_2;
+		h ^= h >> 29;
+		h *= PRIME64_3;
+		h ^= h >> 32;
+		for (int i = 0; i < 8; i++) {
+			result[i] = (unsigned char) (h >> (56 - 8 * i));
+		}
+	}
+
+public:
+	MultipartDigest() {
+		reset(NONE);
+	}
+
+	/** Start over, for the data of a new part. */
+	void reset(Algorithm algorithm) {
+		static const uint32_t shaInit[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+		};
+		this->algorithm = algorithm;
+		finished = false;
+		total = 0;
+		crc = 0xffffffff;
+		memcpy(sha, shaInit, sizeof(sha));
+		xxh[0] = PRIME64_1 + PRIME64_2;
+		xxh[1] = PRIME64_2;
+		xxh[2] = 0;
+		xxh[3] = 0 - PRIME64_1;
+		blockSize = 0;
+		memset(result, 0, sizeof(result));
+	}
+
+	void update(const char *data, size_t len) {
+		const unsigned char *p = (const unsigned char *) data;
+
+		total += len;
+		if (algorithm == CRC32C) {
+			crc = kernels().crc(crc, p, len);
+			return;
+		}
+		if (algorithm == NONE) {
+			return;
+		}
+
+		size_t blockLen = blockLength();
+		if (blockSize > 0) {
+			size_t n = std::min(len, blockLen - blockSize);
+			memcpy(block + blockSize, p, n);
+			blockSize += n;
+			p += n;
+			len -= n;
+			if (blockSize < blockLen) {
+				return;
+			}
+			consume(block, 1);
+			blockSize = 0;
+		}
+		consume(p, len / blockLen);
+		p += len / blockLen * blockLen;
+		blockSize = len % blockLen;
+		memcpy(block, p, blockSize);
+	}
+
+	/** Complete the digest, after the last update(). */
+	void finish() {
+		if (finished) {
+			return;
+		}
+		switch (algorithm) {
+		case CRC32C: {
+			uint32_t value = ~crc;
+			for (int i = 0; i < 4; i++) {
+				result[i] = (unsigned char) (value >> (24 - 8 * i));
+			}
+			break;
+		}
+		case SHA256:
+			finishSha();
+			break;
+		case XXH64:
+			finishXxh();
+			break;
+		default:
+			break;
+		}
+		finished = true;
+	}
+
+	Algorithm getAlgorithm() const {
+		return algorithm;
+	}
+
+	/** Number of bytes fed. */
+	uint64_t length() const {
+		return total;
+	}
+
+	/** Digest bytes, valid after finish(). */
+	const unsigned char *data() const {
+		return result;
+	}
+
+	/** 4 for CRC32C, 32 for SHA-256, 8 for XXH64, 0 for NONE. */
+	size_t size() const {
+		switch (algorithm) {
+		case CRC32C: return 4;
+		case SHA256: return 32;
+		case XXH64:  return 8;
+		default:     return 0;
+		}
+	}
+
+	/** The checksum as a number, for CRC32C and XXH64. */
+	uint64_t value() const {
+		uint64_t value = 0;
+		for (size_t i = 0; i < size() && i < 8; i++) {
+			value = (value << 8) | result[i];
+		}
+		return value;
+	}
+
+	/** The digest as lowercase hexadecimal. */
+	std::string hex() const {
+		static const char digits[] = "0123456789abcdef";
+		std::string out;
+		out.reserve(2 * size());
+		for (size_t i = 0; i < size(); i++) {
+			out += digits[result[i] >> 4];
+			out += digits[result[i] & 15];
+		}
+		return out;
+	}
+
+	void serialize(MultipartCheckpoint::Writer &writer) const {
+		writer.number(algorithm);
+		writer.number(total);
+		writer.number(crc);
+		for (int i = 0; i < 8; i++) {
+			writer.number(sha[i]);
+		}
+		for (int i = 0; i < 4; i++) {
+			writer.number(xxh[i]);
+		}
+		writer.bytes(std::string_view((const char *) block, blockSize));
+	}
+
+	bool deserialize(MultipartCheckpoint::Reader &reader) {
+		uint64_t savedAlgorithm = reader.number();
+		if (savedAlgorithm > XXH64) {
+			return false;
+		}
+		reset((Algorithm) savedAlgorithm);
+		total = reader.number();
+		crc = reader.number();
+		for (int i = 0; i < 8; i++) {
+			sha[i] = reader.number();
+		}
+		for (int i = 0; i < 4; i++) {
+			xxh[i] = reader.number();
+		}
+		std::string_view savedBlock = reader.bytes();
+		if (reader.failed() || savedBlock.size() >= sizeof(block)
+		 || (algorithm != NONE && algorithm != CRC32C && savedBlock.size() >= blockLength()))
+		{
+			return false;
+		}
+		blockSize = savedBlock.size();
+		memcpy(block, savedBlock.data(), blockSize);
+		return true;
+	}
+};
+
+#endif /* _MULTIPART_DIGEST_H_ */
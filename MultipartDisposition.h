@@ -0,0 +1,251 @@
+#ifndef _MULTIPART_DISPOSITION_H_
+#define _MULTIPART_DISPOSITION_H_
+
+#include <sys/types.h>
+#include <string_view>
+
+/**
+ * Single pass scanner for a Content-Disposition header value, like
+ *
+ *   form-data; name="field"; filename="a \"b\".txt"
+ *   attachment; filename*=UTF-8''%e2%82%ac%20rates.txt
+ *
+ * Parameters are returned as views into the scanned value. A view may still
+ * be encoded: quoted-strings may contain backslash escapes and RFC 5987
+ * extended values (name*=, filename*=) are percent-encoded. When that is
+ * the case the corresponding Encoding tells how to decode() it; the decoded
+ * form is never longer than the raw one. Extended values are preferred over
+ * plain ones. Their bytes are returned as sent, in the given charset, which
+ * is UTF-8 in practice (RFC 7578).
+ *
+ * Content-Type has the same syntax: scanning it gives the media type, and
+ * the boundary parameter of multipart types.
+ */
+class MultipartDisposition {
+public:
+	enum Encoding {
+		PLAIN,    // use as is
+		QUOTED,   // quoted-string with backslash escapes
+		EXTENDED  // RFC 5987 percent-encoding
+	};
+
+	std::string_view type;
+	std::string_view name;
+	std::string_view filename;
+	std::string_view boundary;
+	Encoding nameEncoding;
+	Encoding filenameEncoding;
+	Encoding boundaryEncoding;
+	bool hasName;
+	bool hasFilename;
+	bool hasBoundary;
+
+private:
+	static const char SPACE      = 32;
+	static const char HTAB       = 9;
+	static const char SEMICOLON  = 59;
+	static const char EQUAL      = 61;
+	static const char QUOTE      = 34;
+	static const char BACKSLASH  = 92;
+	static const char APOSTROPHE = 39;
+	static const char PERCENT    = 37;
+
+	static bool isSpace(char c) {
+		return c == SPACE || c == HTAB;
+	}
+
+	static bool equalsIgnoreCase(std::string_view a, const char *b, size_t len) {
+		if (a.size() != len) {
+			return false;
+		}
+		for (size_t i = 0; i < len; i++) {
+			if ((a[i] | 0x20) != b[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static int hexValue(char c) {
+		if (c >= '0' && c <= '9') {
+			return c - '0';
+		}
+		c |= 0x20;
+		if (c >= 'a' && c <= 'f') {
+			return c - 'a' + 10;
+		}
+		return -1;
+	}
+
+	// strip charset'language' from an extended value
+	static std::string_view extendedValue(std::string_view raw) {
+		size_t first = raw.find(APOSTROPHE);
+		if (first == std::string_view::npos) {
+			return raw;
+		}
+		size_t second = raw.find(APOSTROPHE, first + 1);
+		if (second == std::string_view::npos) {
+			return raw;
+		}
+		return raw.substr(second + 1);
+	}
+
+public:
+	MultipartDisposition() {
+		clear();
+	}
+
+	void clear() {
+		type = std::string_view();
+		name = std::string_view();
+		filename = std::string_view();
+		boundary = std::string_view();
+		nameEncoding = PLAIN;
+		filenameEncoding = PLAIN;
+		boundaryEncoding = PLAIN;
+		hasName = false;
+		hasFilename = false;
+		hasBoundary = false;
+	}
+
+	/**
+	 * Scan a header value. Returns false when there is not even a
+	 * disposition type; parameters that cannot be understood are skipped.
+	 */
+	bool parse(std::string_view value) {
+		const char *p   = value.data();
+		const char *end = p + value.size();
+		bool extendedName = false, extendedFilename = false;
+
+		clear();
+
+		while (p < end && isSpace(*p)) {
+			p++;
+		}
+		const char *mark = p;
+		while (p < end && *p != SEMICOLON && !isSpace(*p)) {
+			p++;
+		}
+		type = std::string_view(mark, p - mark);
+
+		while (p < end) {
+			// skip up to the next parameter
+			while (p < end && *p != SEMICOLON) {
+				p++;
+			}
+			if (p == end) {
+				break;
+			}
+			p++;
+			while (p < end && isSpace(*p)) {
+				p++;
+			}
+
+			mark = p;
+			while (p < end && *p != EQUAL && *p != SEMICOLON && !isSpace(*p)) {
+				p++;
+			}
+			std::string_view param(mark, p - mark);
+			while (p < end && isSpace(*p)) {
+				p++;
+			}
+			if (p == end || *p != EQUAL) {
+				continue;
+			}
+			p++;
+			while (p < end && isSpace(*p)) {
+				p++;
+			}
+
+			std::string_view raw;
+			Encoding encoding = PLAIN;
+			if (p < end && *p == QUOTE) {
+				mark = ++p;
+				while (p < end && *p != QUOTE) {
+					if (*p == BACKSLASH && p + 1 < end) {
+						encoding = QUOTED;
+						p++;
+					}
+					p++;
+				}
+				raw = std::string_view(mark, p - mark);
+				if (p < end) {
+					p++;
+				}
+			} else {
+				mark = p;
+				while (p < end && *p != SEMICOLON && !isSpace(*p)) {
+					p++;
+				}
+				raw = std::string_view(mark, p - mark);
+			}
+
+			bool extended = !param.empty() && param.back() == '*';
+			if (extended) {
+				param.remove_suffix(1);
+				raw = extendedValue(raw);
+				encoding = raw.find(PERCENT) == std::string_view::npos ? PLAIN : EXTENDED;
+			}
+
+			if (equalsIgnoreCase(param, "name", 4) && (extended || !extendedName)) {
+				name = raw;
+				nameEncoding = encoding;
+				hasName = true;
+				extendedName = extended;
+			} else if (equalsIgnoreCase(param, "filename", 8) && (extended || !extendedFilename)) {
+				filename = raw;
+				filenameEncoding = encoding;
+				hasFilename = true;
+				extendedFilename = extended;
+			} else if (equalsIgnoreCase(param, "boundary", 8) && !extended) {
+				boundary = raw;
+				boundaryEncoding = encoding;
+				hasBoundary = true;
+			}
+		}
+
+		return !type.empty();
+	}
+
+	/**
+	 * Decode a raw parameter into out, which must have room for raw.size()
+	 * characters. Returns the decoded size. out may be raw.data().
+	 */
+	static size_t decode(std::string_view raw, Encoding encoding, char *out) {
+		const char *p   = raw.data();
+		const char *end = p + raw.size();
+		char *o = out;
+
+		switch (encoding) {
+		case QUOTED:
+			while (p < end) {
+				if (*p == BACKSLASH && p + 1 < end) {
+					p++;
+				}
+				*o++ = *p++;
+			}
+			break;
+		case EXTENDED:
+			while (p < end) {
+				int high, low;
+				if (*p == PERCENT && end - p >= 3
+				 && (high = hexValue(p[1])) >= 0 && (low = hexValue(p[2])) >= 0)
+				{
+					*o++ = (char) (high * 16 + low);
+					p += 3;
+				} else {
+					*o++ = *p++;
+				}
+			}
+			break;
+		default:
+			while (p < end) {
+				*o++ = *p++;
+			}
+			break;
+		}
+		return o - out;
+	}
+};
+
+#endif /* _MULTIPART_DISPOSITION_H_ */
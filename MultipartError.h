@@ -0,0 +1,162 @@
+#ifndef _MULTIPART_ERROR_H_
+#define _MULTIPART_ERROR_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+#include "MultipartLimits.h"
+#include "MultipartTrace.h"
+
+/**
+ * Why and where parsing failed, see MultipartParser::getError(). Errors
+ * are classified by code, without comparing messages; the message is the
+ * one getErrorMessage() returns.
+ *
+ * offset is that of the byte the error was found at, counted from the
+ * start of the body, across every feed(). context holds the input around
+ * that byte, as far as it was in the buffer being fed, for logs.
+ */
+struct MultipartError {
+	enum Code {
+		NONE,
+		UNINITIALIZED,
+		BOUNDARY_TOO_LONG,
+		BAD_CHECKPOINT,
+		// malformed body
+		BOUNDARY_MISMATCH,
+		BOUNDARY_CR_EXPECTED,
+		BOUNDARY_LF_EXPECTED,
+		EMPTY_HEADER_NAME,
+		BAD_HEADER_NAME,
+		HEADER_LF_EXPECTED,
+		HEADERS_LF_EXPECTED,
+		// see MultipartLimits
+		HEADER_LINE_LIMIT,
+		HEADERS_LIMIT,
+		PARTS_LIMIT,
+		PART_SIZE_LIMIT,
+		BODY_SIZE_LIMIT,
+		// found by MultipartReader
+		NESTED_BOUNDARY_TOO_LONG,
+		NESTED_BODY_UNTERMINATED,
+		BAD_TRANSFER_ENCODING,
+		// a bug of the parser
+		INTERNAL
+	};
+
+	static const size_t CONTEXT_SIZE = 32;
+
+	Code code;
+	const char *message;
+	uint64_t offset;
+	int state;                    // parser state the byte was read in
+	char context[CONTEXT_SIZE];
+	size_t contextSize;
+	size_t contextOffset;         // position of the offending byte in context
+
+	MultipartError() {
+		clear(UNINITIALIZED);
+	}
+
+	/** Forget the error, setting code and its default message. */
+	void clear(Code code) noexcept {
+		this->code = code;
+		message = describe(code);
+		offset = 0;
+		state = 0;
+		contextSize = 0;
+		contextOffset = 0;
+	}
+
+	/**
+	 * Keep the bytes of buffer around position i as context: up to half of
+	 * CONTEXT_SIZE before it, the rest from it on.
+	 */
+	void setContext(std::string_view buffer, size_t i) noexcept {
+		if (i > buffer.size()) {
+			i = buffer.size();
+		}
+		size_t from = i > CONTEXT_SIZE / 2 ? i - CONTEXT_SIZE / 2 : 0;
+		size_t to = std::min(buffer.size(), from + CONTEXT_SIZE);
+		memcpy(context, buffer.data() + from, to - from);
+		contextSize = to - from;
+		contextOffset = i - from;
+	}
+
+	const char *stateName() const noexcept {
+		return MultipartTraceEvent::stateName(state);
+	}
+
+	/** The limit the body went beyond, NONE for other errors. */
+	MultipartLimits::Kind limit() const noexcept {
+		switch (code) {
+		case HEADER_LINE_LIMIT: return MultipartLimits::HEADER_LINE;
+		case HEADERS_LIMIT:     return MultipartLimits::HEADERS;
+		case PARTS_LIMIT:       return MultipartLimits::PARTS;
+		case PART_SIZE_LIMIT:   return MultipartLimits::PART_SIZE;
+		case BODY_SIZE_LIMIT:   return MultipartLimits::BODY_SIZE;
+		default:                return MultipartLimits::NONE;
+		}
+	}
+
+	static const char *describe(Code code) noexcept {
+		switch (code) {
+		case NONE:                     return "No error.";
+		case UNINITIALIZED:            return "Parser uninitialized.";
+		case BOUNDARY_TOO_LONG:        return "Boundary is longer than 70 characters.";
+		case BAD_CHECKPOINT:           return "Malformed checkpoint.";
+		case BOUNDARY_MISMATCH:        return "Malformed. Found different boundary data than the given one.";
+		case BOUNDARY_CR_EXPECTED:     return "Malformed. Expected CR after boundary.";
+		case BOUNDARY_LF_EXPECTED:     return "Malformed. Expected LF after boundary CR.";
+		case EMPTY_HEADER_NAME:        return "Malformed first header name character.";
+		case BAD_HEADER_NAME:          return "Malformed header name.";
+		case HEADER_LF_EXPECTED:       return "Malformed header value: LF expected after CR";
+		case HEADERS_LF_EXPECTED:      return "Malformed header ending: LF expected after CR";
+		case HEADER_LINE_LIMIT:        return "Limit exceeded. Header line is too long.";
+		case HEADERS_LIMIT:            return "Limit exceeded. Too many headers in part.";
+		case PARTS_LIMIT:              return "Limit exceeded. Too many parts in body.";
+		case PART_SIZE_LIMIT:          return "Limit exceeded. Part data is too large.";
+		case BODY_SIZE_LIMIT:          return "Limit exceeded. Body is too large.";
+		case NESTED_BOUNDARY_TOO_LONG: return "Nested multipart boundary is longer than 70 characters.";
+		case NESTED_BODY_UNTERMINATED:
+			return "Malformed. Nested multipart body is not terminated by its last boundary.";
+		case BAD_TRANSFER_ENCODING:    return "Malformed transfer encoded data.";
+		case INTERNAL:
+			return "Parser bug: index overflows lookbehind buffer. "
+				"Please send bug report with input file attached.";
+		}
+		return "?";
+	}
+
+	/** One line: offset, state, message, and the context, escaped. */
+	void print(FILE *f) const {
+		fprintf(f, "%llu  %s: %s", (unsigned long long) offset, stateName(), message);
+		if (contextSize > 0) {
+			fputs("  \"", f);
+			for (size_t i = 0; i < contextSize; i++) {
+				if (i == contextOffset) {
+					fputs(">>", f);
+				}
+				unsigned char c = context[i];
+				if (c == '\r') {
+					fputs("\\r", f);
+				} else if (c == '\n') {
+					fputs("\\n", f);
+				} else if (c == '"' || c == '\\') {
+					fprintf(f, "\\%c", c);
+				} else if (c < 32 || c >= 127) {
+					fprintf(f, "\\x%02x", c);
+				} else {
+					fputc(c, f);
+				}
+			}
+			fputc('"', f);
+		}
+		fputc('\n', f);
+	}
+};
+
+#endif /* _MULTIPART_ERROR_H_ */
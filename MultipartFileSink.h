@@ -0,0 +1,282 @@
+#ifndef _MULTIPART_FILE_SINK_H_
+#define _MULTIPART_FILE_SINK_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <string>
+#include "MappedMultipartFile.h"
+#include "MultipartReader.h"
+
+/**
+ * Writes the data of each part of a multipart body to its own descriptor.
+ *
+ * onPartOpen is called with the headers of every part and returns the
+ * descriptor the data of that part goes to, or -1 to skip the part.
+ * onPartClose is called once all of it has been written, or as soon as
+ * writing it failed: every descriptor onPartOpen returned is passed to
+ * onPartClose, and no part is opened after a failure.
+ *
+ * When the input is a regular file (a spooled body), it is mapped and
+ * indexed in place, and part data is moved by the kernel: with
+ * copy_file_range() to files (which filesystems may turn into a reflink),
+ * with sendfile() to sockets and pipes, and with write() from the mapping
+ * only if neither is supported. Nothing but the boundary search touches the
+ * data from userspace.
+ *
+ * Other inputs (sockets, pipes) must be read to find the boundaries, so
+ * they are read into a buffer, fed to a MultipartReader, and part data is
+ * written from that buffer.
+ *
+ * Descriptors returned by onPartOpen may be non-blocking: when one is
+ * full, the sink waits for it to become writable with poll().
+ */
+class MultipartFileSink {
+public:
+	typedef int (*PartOpenCallback)(const MultipartHeaders &headers, void *userData);
+	typedef void (*PartCloseCallback)(int fd, void *userData);
+
+	PartOpenCallback onPartOpen;
+	PartCloseCallback onPartClose;
+	void *userData;
+
+	// how the data was moved, for the curious
+	size_t bytesCopiedByKernel;
+	size_t bytesCopiedByUser;
+
+private:
+	static const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+	const char *errorReason;
+	int systemError;
+	bool failed;
+	int currentFd;
+	MultipartReader *reader;
+	MultipartHeaders headers;
+
+	bool fail(const char *message, int error) {
+		errorReason = message;
+		systemError = error;
+		failed = true;
+		return false;
+	}
+
+	/** Wait until fd, non-blocking and full, can take more data. */
+	bool waitWritable(int fd) {
+		struct pollfd pfd = { fd, POLLOUT, 0 };
+		while (poll(&pfd, 1, -1) == -1) {
+			if (errno != EINTR) {
+				return fail("Cannot wait for output.", errno);
+			}
+		}
+		return true;
+	}
+	
+	static bool wouldBlock(int error) {
+		return error == EAGAIN || error == EWOULDBLOCK;
+	}
+	
+	bool writeAll(int fd, const char *data, size_t size) {
+		while (size > 0) {
+			ssize_t ret = write(fd, data, size);
+			if (ret == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (wouldBlock(errno)) {
+					if (!waitWritable(fd)) {
+						return false;
+					}
+					continue;
+				}
+				return fail("Cannot write part data.", errno);
+			}
+			data += ret;
+			size -= ret;
+			bytesCopiedByUser += ret;
+		}
+		return true;
+	}
+
+	/** Move size bytes at offset of the mapped input to out. */
+	bool copyRange(int in, const char *mapping, off_t offset, int out, size_t size) {
+		bool tryCopyFileRange = true, trySendfile = true;
+
+		while (size > 0) {
+			ssize_t ret = -1;
+			loff_t inOffset = offset;
+
+			if (tryCopyFileRange) {
+				ret = copy_file_range(in, &inOffset, out, NULL, size, 0);
+				if (ret == -1 && errno != EINTR && !wouldBlock(errno)) {
+					// not supported between these descriptors
+					tryCopyFileRange = false;
+					continue;
+				}
+			} else if (trySendfile) {
+				off_t sendOffset = offset;
+				ret = sendfile(out, in, &sendOffset, size);
+				if (ret == -1 && errno != EINTR && !wouldBlock(errno)) {
+					trySendfile = false;
+					continue;
+				}
+			} else {
+				return writeAll(out, mapping + offset, size);
+			}
+
+			if (ret == -1) {
+				// out is full: wait rather than spin
+				if (errno != EINTR && !waitWritable(out)) {
+					return false;
+				}
+				continue;
+			}
+			if (ret == 0) {
+				return fail("Input file shrank while being copied.", 0);
+			}
+			offset += ret;
+			size -= ret;
+			bytesCopiedByKernel += ret;
+		}
+		return true;
+	}
+
+	bool runMapped(int fd, const std::string &boundary) {
+		MappedMultipartFile file;
+
+		if (!file.open(fd, boundary)) {
+			return fail(file.getErrorMessage(), file.getSystemError());
+		}
+		for (size_t i = 0; i < file.size(); i++) {
+			headers.assign(file.headers(i));
+			int out = onPartOpen != NULL ? onPartOpen(headers, userData) : -1;
+			if (out == -1) {
+				continue;
+			}
+			const MultipartIndex::Part &part = file.parts()[i];
+			bool ok = copyRange(fd, file.contents().data(), part.dataBegin, out,
+				part.dataEnd - part.dataBegin);
+			if (onPartClose != NULL) {
+				onPartClose(out, userData);
+			}
+			if (!ok) {
+				return false;
+			}
+			file.release(i);
+		}
+		errorReason = "No error.";
+		return true;
+	}
+
+	static void cbPartBegin(const MultipartHeaders &headers, void *userData) {
+		MultipartFileSink *self = (MultipartFileSink *) userData;
+		if (self->onPartOpen != NULL) {
+			self->currentFd = self->onPartOpen(headers, self->userData);
+		}
+	}
+
+	static void cbPartData(const char *buffer, size_t size, void *userData) {
+		MultipartFileSink *self = (MultipartFileSink *) userData;
+		if (self->currentFd != -1 && !self->failed
+		 && !self->writeAll(self->currentFd, buffer, size))
+		{
+			// nothing more is read, nor opened, once a write failed
+			self->reader->pause();
+		}
+	}
+
+	static void cbPartEnd(void *userData) {
+		MultipartFileSink *self = (MultipartFileSink *) userData;
+		if (self->currentFd != -1 && self->onPartClose != NULL) {
+			self->onPartClose(self->currentFd, self->userData);
+		}
+		self->currentFd = -1;
+	}
+
+	bool runStreaming(int fd, const std::string &boundary) {
+		MultipartReader reader(boundary);
+		std::string buffer(READ_BUFFER_SIZE, '\0');
+
+		reader.onPartBegin = cbPartBegin;
+		reader.onPartData  = cbPartData;
+		reader.onPartEnd   = cbPartEnd;
+		reader.userData    = this;
+		this->reader = &reader;
+		currentFd = -1;
+
+		while (!reader.stopped() && !failed) {
+			ssize_t len = read(fd, &buffer[0], buffer.size());
+			if (len == -1) {
+				if (errno != EINTR) {
+					fail("Cannot read input.", errno);
+				}
+				continue;
+			}
+			if (len == 0) {
+				break;
+			}
+			reader.feed(buffer.data(), len);
+		}
+		// the part being written is closed whatever happened
+		if (currentFd != -1) {
+			cbPartEnd(this);
+		}
+		this->reader = NULL;
+		if (failed) {
+			return false;
+		}
+		if (!reader.succeeded()) {
+			return fail(reader.hasError() ? reader.getErrorMessage()
+				: "Malformed. Input ended before the last boundary.", 0);
+		}
+		errorReason = "No error.";
+		return true;
+	}
+
+public:
+	MultipartFileSink() {
+		onPartOpen  = NULL;
+		onPartClose = NULL;
+		userData    = NULL;
+		bytesCopiedByKernel = 0;
+		bytesCopiedByUser   = 0;
+		errorReason = "Nothing written.";
+		systemError = 0;
+		failed      = false;
+		currentFd   = -1;
+		reader      = NULL;
+	}
+
+	/**
+	 * Split the multipart body read from fd. A regular file is read from
+	 * offset 0, anything else from its current position to end of file.
+	 */
+	bool run(int fd, const std::string &boundary) {
+		struct stat sbuf;
+
+		systemError = 0;
+		failed = false;
+		if (fstat(fd, &sbuf) == -1) {
+			return fail("Cannot stat input.", errno);
+		}
+		if (S_ISREG(sbuf.st_mode)) {
+			return runMapped(fd, boundary);
+		} else {
+			return runStreaming(fd, boundary);
+		}
+	}
+
+	const char *getErrorMessage() const {
+		return errorReason;
+	}
+
+	/** errno of the failed system call, 0 if the error is not one. */
+	int getSystemError() const {
+		return systemError;
+	}
+};
+
+#endif /* _MULTIPART_FILE_SINK_H_ */
@@ -0,0 +1,202 @@
+#ifndef _MULTIPART_HANDLER_H_
+#define _MULTIPART_HANDLER_H_
+
+#include <sys/types.h>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Events emitted by the parser.
+ */
+class MultipartEvent {
+public:
+	enum Type {
+		PART_BEGIN,
+		HEADER_FIELD,
+		HEADER_VALUE,
+		HEADER_END,
+		HEADERS_END,
+		PART_DATA,
+		PART_END,
+		END
+	};
+
+	static const char *name(Type event) {
+		static const char *names[] = {
+			"onPartBegin",
+			"onHeaderField",
+			"onHeaderValue",
+			"onHeaderEnd",
+			"onHeadersEnd",
+			"onPartData",
+			"onPartEnd",
+			"onEnd"
+		};
+		return names[event];
+	}
+};
+
+/**
+ * The classic function pointer callbacks, each one receiving the whole
+ * buffer with the start and end of the data inside it. Events without data
+ * are given an empty buffer, with start and end set to (size_t) -1.
+ */
+class MultipartCallbacks {
+public:
+	// typedef Callback to define our callbacks
+	typedef void (*Callback)(std::string_view buffer, size_t start, size_t end, void *userData);
+
+	// Callbacks
+	Callback onPartBegin;
+	Callback onHeaderField;
+	Callback onHeaderValue;
+	Callback onHeaderEnd;
+	Callback onHeadersEnd;
+	Callback onPartData;
+	Callback onPartEnd;
+	Callback onEnd;
+
+	// given as is to every callback
+	void *userData;
+
+	MultipartCallbacks() {
+		onPartBegin   = NULL;
+		onHeaderField = NULL;
+		onHeaderValue = NULL;
+		onHeaderEnd   = NULL;
+		onHeadersEnd  = NULL;
+		onPartData    = NULL;
+		onPartEnd     = NULL;
+		onEnd         = NULL;
+		userData      = NULL;
+	}
+};
+
+/*
+ * Compile time detection of the members a handler provides. A handler is
+ * any type with some of these members:
+ *
+ *   void onPartBegin();
+ *   void onHeaderField(std::string_view data);
+ *   void onHeaderValue(std::string_view data);
+ *   void onHeaderEnd();
+ *   void onHeadersEnd();
+ *   void onPartData(std::string_view data);
+ *   void onPartEnd();
+ *   void onEnd();
+ *
+ * Events the handler has no member for are skipped entirely. Any of them
+ * may return bool instead, false pausing the parser.
+ */
+#define MULTIPART_DETECT_MEMBER(trait, member, ...) \
+	template<typename H, typename = void> \
+	struct trait: std::false_type { }; \
+	template<typename H> \
+	struct trait<H, std::void_t<decltype(std::declval<H &>().member(__VA_ARGS__))> >: std::true_type { };
+
+MULTIPART_DETECT_MEMBER(MultipartHasOnPartBegin, onPartBegin)
+MULTIPART_DETECT_MEMBER(MultipartHasOnHeaderField, onHeaderField, std::string_view())
+MULTIPART_DETECT_MEMBER(MultipartHasOnHeaderValue, onHeaderValue, std::string_view())
+MULTIPART_DETECT_MEMBER(MultipartHasOnHeaderEnd, onHeaderEnd)
+MULTIPART_DETECT_MEMBER(MultipartHasOnHeadersEnd, onHeadersEnd)
+MULTIPART_DETECT_MEMBER(MultipartHasOnPartData, onPartData, std::string_view())
+MULTIPART_DETECT_MEMBER(MultipartHasOnPartEnd, onPartEnd)
+MULTIPART_DETECT_MEMBER(MultipartHasOnEnd, onEnd)
+
+#undef MULTIPART_DETECT_MEMBER
+
+/**
+ * Delivers an event to a handler. The call is resolved at compile time, so
+ * the handler's members can be inlined into the parser.
+ *
+ * Members may return bool instead of void: false pauses the parser, which
+ * is what call() returns.
+ */
+template<typename Handler>
+class MultipartDispatch {
+private:
+	template<typename Member>
+	static bool proceed(Member member) {
+		if constexpr (std::is_same<decltype(member()), bool>::value) {
+			return member();
+		} else {
+			member();
+			return true;
+		}
+	}
+
+public:
+	template<MultipartEvent::Type event>
+	static bool call(Handler &handler, std::string_view buffer, size_t start, size_t end) {
+		if constexpr (event == MultipartEvent::PART_BEGIN) {
+			if constexpr (MultipartHasOnPartBegin<Handler>::value) {
+				return proceed([&] { return handler.onPartBegin(); });
+			}
+		} else if constexpr (event == MultipartEvent::HEADER_FIELD) {
+			if constexpr (MultipartHasOnHeaderField<Handler>::value) {
+				return proceed([&] {
+					return handler.onHeaderField(std::string_view(buffer.data() + start, end - start));
+				});
+			}
+		} else if constexpr (event == MultipartEvent::HEADER_VALUE) {
+			if constexpr (MultipartHasOnHeaderValue<Handler>::value) {
+				return proceed([&] {
+					return handler.onHeaderValue(std::string_view(buffer.data() + start, end - start));
+				});
+			}
+		} else if constexpr (event == MultipartEvent::HEADER_END) {
+			if constexpr (MultipartHasOnHeaderEnd<Handler>::value) {
+				return proceed([&] { return handler.onHeaderEnd(); });
+			}
+		} else if constexpr (event == MultipartEvent::HEADERS_END) {
+			if constexpr (MultipartHasOnHeadersEnd<Handler>::value) {
+				return proceed([&] { return handler.onHeadersEnd(); });
+			}
+		} else if constexpr (event == MultipartEvent::PART_DATA) {
+			if constexpr (MultipartHasOnPartData<Handler>::value) {
+				return proceed([&] {
+					return handler.onPartData(std::string_view(buffer.data() + start, end - start));
+				});
+			}
+		} else if constexpr (event == MultipartEvent::PART_END) {
+			if constexpr (MultipartHasOnPartEnd<Handler>::value) {
+				return proceed([&] { return handler.onPartEnd(); });
+			}
+		} else if constexpr (event == MultipartEvent::END) {
+			if constexpr (MultipartHasOnEnd<Handler>::value) {
+				return proceed([&] { return handler.onEnd(); });
+			}
+		}
+		return true;
+	}
+};
+
+template<>
+class MultipartDispatch<MultipartCallbacks> {
+public:
+	template<MultipartEvent::Type event>
+	static bool call(MultipartCallbacks &callbacks, std::string_view buffer, size_t start,
+		size_t end)
+	{
+		MultipartCallbacks::Callback callback = NULL;
+
+		switch (event) {
+		case MultipartEvent::PART_BEGIN:   callback = callbacks.onPartBegin;   break;
+		case MultipartEvent::HEADER_FIELD: callback = callbacks.onHeaderField; break;
+		case MultipartEvent::HEADER_VALUE: callback = callbacks.onHeaderValue; break;
+		case MultipartEvent::HEADER_END:   callback = callbacks.onHeaderEnd;   break;
+		case MultipartEvent::HEADERS_END:  callback = callbacks.onHeadersEnd;  break;
+		case MultipartEvent::PART_DATA:    callback = callbacks.onPartData;    break;
+		case MultipartEvent::PART_END:     callback = callbacks.onPartEnd;     break;
+		case MultipartEvent::END:          callback = callbacks.onEnd;         break;
+		}
+		if (callback != NULL) {
+			callback(buffer, start, end, callbacks.userData);
+		}
+		// function pointers pause with MultipartParser::pause()
+		return true;
+	}
+};
+
+#endif /* _MULTIPART_HANDLER_H_ */
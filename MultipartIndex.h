@@ -0,0 +1,163 @@
+#ifndef _MULTIPART_INDEX_H_
+#define _MULTIPART_INDEX_H_
+
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "MultipartDisposition.h"
+
+/**
+ * Layout of a multipart body that is entirely in memory, as built by
+ * parseContiguous() on a parser. Nothing of the body is copied: each part is
+ * described by offsets into it, so the body must outlive the index.
+ *
+ * Header lines are not looked at while indexing; they are scanned only when
+ * a header, or a field by its name, is asked for.
+ */
+class MultipartIndex {
+public:
+	struct Part {
+		size_t headersBegin;  // first header line
+		size_t headersEnd;    // after the CR LF of the last header line
+		size_t dataBegin;
+		size_t dataEnd;       // CR LF before the next boundary
+	};
+
+	static const size_t NONE = (size_t) -1;
+
+private:
+	static const char CR    = 13;
+	static const char LF    = 10;
+	static const char SPACE = 32;
+	static const char HTAB  = 9;
+	static const char COLON = 58;
+
+	std::string_view body;
+	std::vector<Part> parts;
+	const char *errorReason;
+
+	static char lower(char c) {
+		return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+	}
+
+	static bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+		if (a.size() != b.size()) {
+			return false;
+		}
+		for (size_t i = 0; i < a.size(); i++) {
+			if (lower(a[i]) != lower(b[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	template<typename Handler> friend class BasicMultipartParser;
+
+public:
+	MultipartIndex() {
+		errorReason = "Index empty.";
+	}
+
+	void clear() {
+		body = std::string_view();
+		parts.clear();
+		errorReason = "Index empty.";
+	}
+
+	/** The indexed body. */
+	std::string_view input() const {
+		return body;
+	}
+
+	size_t size() const {
+		return parts.size();
+	}
+
+	bool empty() const {
+		return parts.empty();
+	}
+
+	const Part &operator[](size_t i) const {
+		return parts[i];
+	}
+
+	const char *getErrorMessage() const {
+		return errorReason;
+	}
+
+	/** Header lines of the i-th part, each one ending with CR LF. */
+	std::string_view headers(size_t i) const {
+		return body.substr(parts[i].headersBegin, parts[i].headersEnd - parts[i].headersBegin);
+	}
+
+	/** Data of the i-th part. */
+	std::string_view data(size_t i) const {
+		return body.substr(parts[i].dataBegin, parts[i].dataEnd - parts[i].dataBegin);
+	}
+
+	/** Value of a header of the i-th part, ignoring case, empty if none. */
+	std::string_view header(size_t i, std::string_view name) const {
+		std::string_view block = headers(i);
+		size_t pos = 0;
+
+		while (pos < block.size()) {
+			size_t eol = block.find(CR, pos);
+			if (eol == std::string_view::npos) {
+				eol = block.size();
+			}
+			std::string_view line = block.substr(pos, eol - pos);
+			size_t colon = line.find(COLON);
+			if (colon != std::string_view::npos
+			 && equalsIgnoreCase(line.substr(0, colon), name))
+			{
+				size_t value = colon + 1;
+				while (value < line.size() && (line[value] == SPACE || line[value] == HTAB)) {
+					value++;
+				}
+				return line.substr(value);
+			}
+			pos = eol + 2;
+		}
+		return std::string_view();
+	}
+
+	/**
+	 * Index of the first part whose Content-Disposition name is the given
+	 * one, or NONE.
+	 */
+	size_t find(std::string_view fieldName) const {
+		MultipartDisposition disposition;
+		std::string decoded;
+
+		for (size_t i = 0; i < parts.size(); i++) {
+			disposition.parse(header(i, "Content-Disposition"));
+			if (!disposition.hasName) {
+				continue;
+			}
+			std::string_view name = disposition.name;
+			if (disposition.nameEncoding != MultipartDisposition::PLAIN) {
+				decoded.resize(name.size());
+				decoded.resize(MultipartDisposition::decode(name,
+					disposition.nameEncoding, &decoded[0]));
+				name = decoded;
+			}
+			if (name == fieldName) {
+				return i;
+			}
+		}
+		return NONE;
+	}
+
+	/** Data of the first part with the given field name, empty if none. */
+	std::string_view field(std::string_view fieldName) const {
+		size_t i = find(fieldName);
+		if (i == NONE) {
+			return std::string_view();
+		}
+		return data(i);
+	}
+};
+
+#endif /* _MULTIPART_INDEX_H_ */
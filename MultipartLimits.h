@@ -0,0 +1,53 @@
+#ifndef _MULTIPART_LIMITS_H_
+#define _MULTIPART_LIMITS_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/**
+ * Bounds on what a body may contain, see MultipartParser::setLimits().
+ * They are checked by the state machine as it goes, so an abusive body is
+ * rejected at the byte that goes beyond a limit, before anything larger
+ * than the limit is handed to callbacks. Every limit is off by default.
+ *
+ *   MultipartLimits limits;
+ *   limits.maxHeaderLineSize = 8 * 1024;
+ *   limits.maxHeadersPerPart = 32;
+ *   limits.maxParts = 1000;
+ *   limits.maxBodySize = 100 * 1024 * 1024;
+ *   parser.setLimits(limits);
+ *
+ * Header lines are bounded by maxHeaderLineSize and their number by
+ * maxHeadersPerPart, which bounds what MultipartReader keeps of the
+ * headers of a part. A parser stopped by a limit has the MultipartError
+ * code of that limit, see getLimitExceeded().
+ */
+struct MultipartLimits {
+	static const uint64_t UNLIMITED = (uint64_t) -1;
+
+	/** Which limit stopped the parser. */
+	enum Kind {
+		NONE,
+		HEADER_LINE,
+		HEADERS,
+		PARTS,
+		PART_SIZE,
+		BODY_SIZE
+	};
+
+	uint64_t maxHeaderLineSize;  // bytes of a header line, CR LF excluded
+	uint64_t maxHeadersPerPart;
+	uint64_t maxParts;           // parts per body
+	uint64_t maxPartSize;        // bytes of data of a part, as sent
+	uint64_t maxBodySize;        // bytes of body, preamble and boundaries included
+
+	MultipartLimits() {
+		maxHeaderLineSize = UNLIMITED;
+		maxHeadersPerPart = UNLIMITED;
+		maxParts = UNLIMITED;
+		maxPartSize = UNLIMITED;
+		maxBodySize = UNLIMITED;
+	}
+};
+
+#endif /* _MULTIPART_LIMITS_H_ */
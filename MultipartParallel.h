@@ -0,0 +1,161 @@
+#ifndef _MULTIPART_PARALLEL_H_
+#define _MULTIPART_PARALLEL_H_
+
+#include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "MultipartParser.h"
+
+/**
+ * Multi-threaded parseContiguous(), for large bodies that are already in
+ * memory (or mapped, see MappedMultipartFile.h).
+ *
+ * The body is cut into chunks, and the boundary search, which is where the
+ * time goes, runs on one thread per chunk. Each thread lists the positions
+ * of the boundary in its chunk, reading past the end of it by the size of
+ * the boundary so that one straddling two chunks is found by the first one.
+ * The lists are then concatenated, in order, and walked sequentially to
+ * build the exact same index parseContiguous() would; this part only
+ * touches the headers and the few bytes following each candidate.
+ *
+ * Once the layout is known, parts are independent: forEachPart() hands
+ * them out to worker threads.
+ */
+class MultipartParallel {
+public:
+	typedef void (*PartCallback)(const MultipartIndex &index, size_t part, void *userData);
+
+	// below this, a chunk is not worth a thread
+	static const size_t MIN_CHUNK_SIZE = 1024 * 1024;
+
+private:
+	static unsigned threadCount(unsigned threads, size_t jobs) {
+		if (threads == 0) {
+			threads = std::thread::hardware_concurrency();
+		}
+		if (threads == 0) {
+			threads = 1;
+		}
+		if (threads > jobs) {
+			threads = jobs;
+		}
+		return threads;
+	}
+
+	template<typename Handler>
+	static void scanChunk(const BasicMultipartParser<Handler> &parser, const char *data,
+		size_t begin, size_t end, size_t len, std::vector<size_t> &candidates)
+	{
+		// a boundary starting in this chunk may end in the next one
+		size_t limit = std::min(len, end + parser.boundarySize - 1);
+		size_t i = begin;
+
+		while (true) {
+			i = parser.findBoundary(data, i, limit);
+			if (i >= end) {
+				break;
+			}
+			candidates.push_back(i);
+			i++;
+		}
+	}
+
+	struct PartJob {
+		const MultipartIndex *index;
+		PartCallback callback;
+		void *userData;
+		std::atomic<size_t> next;
+	};
+
+	static void runParts(PartJob *job) {
+		size_t i;
+		while ((i = job->next.fetch_add(1, std::memory_order_relaxed)) < job->index->size()) {
+			job->callback(*job->index, i, job->userData);
+		}
+	}
+
+public:
+	/**
+	 * Index body like parser.parseContiguous(body, index), using up to
+	 * threads threads, or one per core if 0. The parser is only read from,
+	 * so it can be shared by concurrent calls.
+	 */
+	template<typename Handler>
+	static bool parseContiguous(const BasicMultipartParser<Handler> &parser,
+		std::string_view body, MultipartIndex &index, unsigned threads = 0)
+	{
+		const char *data = body.data();
+		size_t len = body.size();
+		size_t chunks = threadCount(threads, len / MIN_CHUNK_SIZE);
+
+		if (chunks <= 1 || parser.boundarySize == 0) {
+			return parser.parseContiguous(body, index);
+		}
+
+		size_t chunkSize = (len + chunks - 1) / chunks;
+		std::vector<std::vector<size_t> > found(chunks);
+		std::vector<std::thread> workers;
+
+		workers.reserve(chunks - 1);
+		for (size_t c = 1; c < chunks; c++) {
+			workers.emplace_back(scanChunk<Handler>, std::cref(parser), data,
+				c * chunkSize, std::min(len, (c + 1) * chunkSize), len, std::ref(found[c]));
+		}
+		scanChunk(parser, data, 0, std::min(len, chunkSize), len, found[0]);
+		for (size_t c = 0; c < workers.size(); c++) {
+			workers[c].join();
+		}
+
+		std::vector<size_t> candidates;
+		size_t total = 0;
+		for (size_t c = 0; c < chunks; c++) {
+			total += found[c].size();
+		}
+		candidates.reserve(total);
+		for (size_t c = 0; c < chunks; c++) {
+			candidates.insert(candidates.end(), found[c].begin(), found[c].end());
+		}
+
+		// positions asked for only grow, so the cursor never moves back
+		size_t cursor = 0;
+		return parser.indexParts(body, index, [&](const char *, size_t from, size_t len) {
+			while (cursor < candidates.size() && candidates[cursor] < from) {
+				cursor++;
+			}
+			return cursor < candidates.size() ? candidates[cursor] : len;
+		});
+	}
+
+	/**
+	 * Call callback once for every part of index, from up to threads
+	 * threads (one per core if 0), including the calling one. Parts are
+	 * taken in order, but callbacks run concurrently and may complete in
+	 * any order. Returns once all of them have.
+	 */
+	static void forEachPart(const MultipartIndex &index, PartCallback callback,
+		void *userData, unsigned threads = 0)
+	{
+		PartJob job;
+		job.index    = &index;
+		job.callback = callback;
+		job.userData = userData;
+		job.next     = 0;
+
+		size_t count = threadCount(threads, index.size());
+		std::vector<std::thread> workers;
+
+		workers.reserve(count > 0 ? count - 1 : 0);
+		for (size_t t = 1; t < count; t++) {
+			workers.emplace_back(runParts, &job);
+		}
+		runParts(&job);
+		for (size_t t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+	}
+};
+
+#endif /* _MULTIPART_PARALLEL_H_ */
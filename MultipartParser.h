@@ -2,27 +2,37 @@
 #define _MULTIPART_PARSER_H_
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <string>
-#include <stdexcept>
 #include <cstring>
-#include <iostream>
+#include <algorithm>
+#include <type_traits>
+#include "BoundarySearch.h"
+#include "MultipartHandler.h"
+#include "MultipartIndex.h"
+#include "MultipartTrace.h"
+#include "MultipartStats.h"
+#include "MultipartCheckpoint.h"
+#include "MultipartLimits.h"
+#include "MultipartError.h"
 
-#define LOG(x) std::cout << x << std::endl;
-//#define LOG(x) ;
+#if MULTIPART_STATS > 1
+	#include <chrono>
+#endif
 
-class MultipartParser {
+/**
+ * Parser delivering its events to a Handler, see MultipartHandler.h. The
+ * parser derives from its handler, so the handler's members are accessible
+ * on the parser itself.
+ *
+ * MultipartParser is the parser with the classic function pointer
+ * callbacks; use BasicMultipartParser directly with your own handler type
+ * to have the callbacks resolved, and inlined, at compile time.
+ */
+template<typename Handler>
+class BasicMultipartParser: public Handler {
 public:
-	// typedef Callback to define our callbacks
-	typedef void (*Callback)(std::string_view buffer, size_t start, size_t end, void *userData);
-	
-private:
-	static const char CR     = 13;
-	static const char LF     = 10;
-	static const char SPACE  = 32;
-	static const char HYPHEN = 45;
-	static const char COLON  = 58;
-	static const size_t UNMARKED = (size_t) -1;
-	
+	// where the parser is in the body, see MultipartError::state
 	enum State {
 		ERROR,
 		START,
@@ -39,71 +49,114 @@ private:
 		END
 	};
 	
+private:
+	static const char CR     = 13;
+	static const char LF     = 10;
+	static const char SPACE  = 32;
+	static const char HYPHEN = 45;
+	static const char COLON  = 58;
+	static const size_t UNMARKED = (size_t) -1;
+	
 	enum Flags {
 		PART_BOUNDARY = 1,
 		LAST_BOUNDARY = 2
 	};
 	
-	void resetCallbacks() {
-		onPartBegin   = NULL;
-		onHeaderField = NULL;
-		onHeaderValue = NULL;
-		onHeaderEnd   = NULL;
-		onHeadersEnd  = NULL;
-		onPartData    = NULL;
-		onPartEnd     = NULL;
-		onEnd         = NULL;
-		userData      = NULL;
+	void resetTraceSink() {
+		#if MULTIPART_TRACE_LEVEL > 0
+			onTrace       = NULL;
+			traceUserData = NULL;
+		#endif
 	}
 	
 	/**
-	 * Used to implement the Boyer-moore algo, substring search (boundary)
+	 * Build the Boyer-Moore-Horspool bad character table: when the last
+	 * character of the window is c, the window can be moved boundaryShift[c]
+	 * characters to the right without missing an occurrence of the boundary.
 	 */
 	void indexBoundary() {
-		const char *current;
-		const char *end = boundaryData + boundarySize;
+		size_t k;
 		
-		memset(boundaryIndex, 0, sizeof(boundaryIndex));
-		
-		for (current = boundaryData; current < end; current++) {
-			boundaryIndex[(unsigned char) *current] = true;
+		for (k = 0; k < 256; k++) {
+			boundaryShift[k] = boundarySize;
+		}
+		for (k = 0; k + 1 < boundarySize; k++) {
+			boundaryShift[(unsigned char) boundary[k]] = boundarySize - 1 - k;
 		}
 	}
 	
-	void callback(Callback callback, std::string_view buffer = NULL, size_t start = UNMARKED,
+	template<MultipartEvent::Type event>
+	void callback(std::string_view buffer = std::string_view(), size_t start = UNMARKED,
 		size_t end = UNMARKED, bool allowEmpty = false)
 	{
-		LOG("BREAKPOINT 2.3.callback.1")
 		if (start != UNMARKED && start == end && !allowEmpty) {
-		LOG("BREAKPOINT 2.3.callback.2")
 			return;
 		}
-		if (callback != NULL) {
-			LOG("BREAKPOINT 2.3.callback.3")
-			callback(buffer, start, end, userData);
+		if (minDataChunk > 0 && event == MultipartEvent::PART_DATA) {
+			// top up what was gathered so far first
+			if (!coalesced.empty()) {
+				size_t take = std::min(end - start, minDataChunk - coalesced.size());
+				coalesced.append(buffer.data() + start, take);
+				start += take;
+				if (coalesced.size() < minDataChunk) {
+					return;
+				}
+				flushCoalesced();
+			}
+			if (end - start < minDataChunk) {
+				coalesced.append(buffer.data() + start, end - start);
+				return;
+			}
+		} else if (event == MultipartEvent::PART_END) {
+			flushCoalesced();
+		}
+		deliver<event>(buffer, start, end);
+	}
+	
+	template<MultipartEvent::Type event>
+	void deliver(std::string_view buffer, size_t start, size_t end) {
+		#if MULTIPART_TRACE_LEVEL > 1
+			traceCallback(event, buffer, start, end);
+		#endif
+		#if MULTIPART_STATS > 0
+			stats.callbacks[event]++;
+			if (event == MultipartEvent::PART_END) {
+				stats.parts++;
+			}
+		#endif
+		#if MULTIPART_STATS > 1
+			std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		#endif
+		if (!MultipartDispatch<Handler>::template call<event>(handler(), buffer, start, end)) {
+			paused = true;
 		}
+		#if MULTIPART_STATS > 1
+			stats.callbackNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - begin).count();
+		#endif
 	}
 	
-	void dataCallback(Callback cb, size_t &mark, std::string_view buffer, size_t i, size_t bufferLen,
+	void flushCoalesced() {
+		if (!coalesced.empty()) {
+			deliver<MultipartEvent::PART_DATA>(coalesced, 0, coalesced.size());
+			coalesced.clear();
+		}
+	}
+	
+	template<MultipartEvent::Type event>
+	void dataCallback(size_t &mark, std::string_view buffer, size_t i, size_t bufferLen,
 		bool clear, bool allowEmpty = false)
 	{
-		LOG("BREAKPOINT 2.3.1")
 		if (mark == UNMARKED) {
-			LOG("BREAKPOINT 2.3.1.1 UNMARKED")
 			return;
 		}
 		
-		LOG("BREAKPOINT 2.3.2")
 		if (!clear) {
-			LOG("BREAKPOINT 2.3.3")
-			callback(cb, buffer, mark, bufferLen, allowEmpty);
+			callback<event>(buffer, mark, bufferLen, allowEmpty);
 			mark = 0;
 		} else {
-			LOG("BREAKPOINT 2.3.4")
-			callback(cb, buffer, mark, i, allowEmpty);
-			LOG("BREAKPOINT 2.3.4.1")
+			callback<event>(buffer, mark, i, allowEmpty);
 			mark = UNMARKED;
-			LOG("BREAKPOINT 2.3.4.2")
 		}
 	}
 	
@@ -111,8 +164,18 @@ private:
 		return c | 0x20;
 	}
 	
-	inline bool isBoundaryChar(char c) const {
-		return boundaryIndex[(unsigned char) c];
+	/**
+	 * Find the first position >= i where the boundary starts, either fully
+	 * or cut by the end of the buffer. Returns len if there is none.
+	 */
+	size_t findBoundaryCandidate(const char *buffer, size_t i, size_t len) const noexcept {
+		size_t from = i;
+		size_t found = findBoundary(buffer, i, len);
+		
+		if (found == len) {
+			found = BoundarySearch::findPartial(buffer, from, len, boundary, boundarySize);
+		}
+		return found;
 	}
 	
 	bool isHeaderFieldCharacter(char c) const {
@@ -121,26 +184,115 @@ private:
 			|| c == HYPHEN;
 	}
 	
-	void setError(const char *message) {
+	/**
+	 * Whether index, and flags, can be those of a parser in state: a
+	 * checkpoint is untrusted input, and index is used to read boundary.
+	 */
+	bool isValidIndex(State state, uint64_t index, uint64_t flags) const noexcept {
+		switch (state) {
+		case START:
+		case PART_DATA_START:
+			return index == 0;
+		case START_BOUNDARY:
+			return index < boundarySize;
+		case HEADER_FIELD_START:
+		case HEADER_FIELD:
+		case HEADER_VALUE_START:
+		case HEADER_VALUE:
+		case HEADER_VALUE_ALMOST_DONE:
+		case HEADERS_ALMOST_DONE:
+			return index <= limits.maxHeaderLineSize;
+		case PART_DATA:
+			// flags tell the kind of a boundary matched up to CR or HYPHEN
+			if (index <= boundarySize) {
+				return flags == 0;
+			} else if (index == boundarySize + 1) {
+				return flags == PART_BOUNDARY || flags == LAST_BOUNDARY;
+			} else {
+				return index <= boundarySize + 3 && flags == LAST_BOUNDARY;
+			}
+		default:
+			return index <= boundarySize + 3;
+		}
+	}
+	
+	size_t failCheckpoint() noexcept {
+		reset();
+		error.clear(MultipartError::BAD_CHECKPOINT);
+		return 0;
+	}
+	
+	/** Stop at byte i of buffer, read in state at. */
+	void setError(MultipartError::Code code, const char *buffer, size_t len, size_t i,
+		State at) noexcept
+	{
 		state = ERROR;
-		errorReason = message;
+		error.clear(code);
+		error.offset = bodyOffset + i;
+		error.state = at;
+		error.setContext(std::string_view(buffer, len), i);
+		#if MULTIPART_TRACE_LEVEL > 0
+			trace(MultipartTraceEvent::ERROR, ERROR, ERROR, error.message, error.offset, 0);
+		#endif
 	}
 	
+	#if MULTIPART_TRACE_LEVEL > 0
+		void trace(MultipartTraceEvent::Kind kind, State from, State to, const char *name,
+			size_t offset, size_t length)
+		{
+			if (onTrace != NULL) {
+				MultipartTraceEvent event = { kind, from, to, name, offset, length };
+				onTrace(event, traceUserData);
+			}
+		}
+		
+		void traceTransition(State &traced, State state) {
+			if (state != traced) {
+				trace(MultipartTraceEvent::STATE, traced, state, NULL, traceCursor, 0);
+				traced = state;
+			}
+		}
+	#endif
+	
+	#if MULTIPART_TRACE_LEVEL > 1
+		void traceCallback(MultipartEvent::Type event, std::string_view buffer, size_t start,
+			size_t end)
+		{
+			size_t offset = traceCursor;
+			size_t length = 0;
+			if (start != UNMARKED) {
+				length = end - start;
+				// spans of the lookbehind buffer have no position in the input
+				if (buffer.data() == traceBuffer) {
+					offset = bodyOffset + start;
+				}
+			}
+			trace(MultipartTraceEvent::CALLBACK, state, state, MultipartEvent::name(event),
+				offset, length);
+		}
+	#endif
+	
 	void processPartData(size_t &prevIndex, size_t &index, std::string_view buffer,
-		size_t len, size_t boundaryEnd, size_t &i, char c, State &state, int &flags)
+		size_t len, size_t &i, char c, State &state, int &flags)
 	{
-		LOG("BREAK processPartData")
 		prevIndex = index;
 		
 		if (index == 0) {
-			// boyer-moore derived algorithm to safely skip non-boundary data
-			LOG("BREAK ppd 1")
-			while (i + boundarySize <= len) {
-				if (isBoundaryChar(buffer[i + boundaryEnd])) {
-					break;
-				}
-				
-				i += boundarySize;
+			// skip everything up to the next boundary candidate, the skipped
+			// span is handed to onPartData in one go once the candidate is
+			// reached (or at the end of the buffer)
+			#if MULTIPART_STATS > 0
+				size_t from = i;
+			#endif
+			i = findBoundaryCandidate(buffer.data(), i, len);
+			#if MULTIPART_STATS > 0
+				stats.bytesSkipped += i - from;
+			#endif
+			if (bodyOffset + i - partDataStart > limits.maxPartSize) {
+				i = partDataStart + limits.maxPartSize - bodyOffset;
+				setError(MultipartError::PART_SIZE_LIMIT, buffer.data(), len, i, state);
+				state = ERROR;
+				return;
 			}
 			if (i == len) {
 				return;
@@ -149,17 +301,18 @@ private:
 		}
 		
 		if (index < boundarySize) {
-			LOG("BREAK ppd 2")
 			if (boundary[index] == c) {
 				if (index == 0) {
-					dataCallback(onPartData, partDataMark, buffer, i, len, true);
+					dataCallback<MultipartEvent::PART_DATA>(partDataMark, buffer, i, len, true);
+					#if MULTIPART_STATS > 0
+						stats.candidates++;
+					#endif
 				}
 				index++;
 			} else {
 				index = 0;
 			}
 		} else if (index == boundarySize) {
-			LOG("BREAK ppd 3")
 			index++;
 			if (c == CR) {
 				// CR = part boundary
@@ -171,22 +324,25 @@ private:
 				index = 0;
 			}
 		} else if (index - 1 == boundarySize) {
-			LOG("BREAK ppd 4")
-			std::cout << "BREAK POINT " << std::endl;
 			if (flags & PART_BOUNDARY) {
 				index = 0;
 				if (c == LF) {
 					// unset the PART_BOUNDARY flag
 					flags &= ~PART_BOUNDARY;
-					callback(onPartEnd);
-					callback(onPartBegin);
+					callback<MultipartEvent::PART_END>();
+					if (++partCount > limits.maxParts) {
+						setError(MultipartError::PARTS_LIMIT, buffer.data(), len, i, state);
+						state = ERROR;
+						return;
+					}
+					callback<MultipartEvent::PART_BEGIN>();
 					state = HEADER_FIELD_START;
 					return;
 				}
 			} else if (flags & LAST_BOUNDARY) {
 				if (c == HYPHEN) {
-                    callback(onPartEnd);
-                    callback(onEnd);
+                    callback<MultipartEvent::PART_END>();
+                    callback<MultipartEvent::END>();
                     state = END;
 				} else {
 					index = 0;
@@ -195,44 +351,64 @@ private:
 				index = 0;
 			}
 		} else if (index - 2 == boundarySize) {
-			LOG("BREAK ppd 5")
 			if (c == CR) {
 				index++;
 			} else {
 				index = 0;
 			}
 		} else if (index - boundarySize == 3) {
-			LOG("BREAK ppd 6")
 			index = 0;
 			if (c == LF) {
-				callback(onPartEnd);
-				callback(onEnd);
+				callback<MultipartEvent::PART_END>();
+				callback<MultipartEvent::END>();
 				state = END;
 				return;
 			}
 		}
 		
+		if (index == 0) {
+			// a candidate that failed after CR or HYPHEN leaves no flag
+			// behind, it would be taken for the kind of the next one
+			flags = 0;
+		}
 		if (index > 0) {
-			LOG("BREAK ppd 7")
 			// when matching a possible boundary, keep a lookbehind reference
 			// in case it turns out to be a false lead
 			if (index - 1 >= lookbehindSize) {
-				setError("Parser bug: index overflows lookbehind buffer. "
-					"Please send bug report with input file attached.");
-				throw std::out_of_range("index overflows lookbehind buffer");
-			} else if (index - 1 < 0) {
-				setError("Parser bug: index underflows lookbehind buffer. "
-					"Please send bug report with input file attached.");
-				throw std::out_of_range("index underflows lookbehind buffer");
+				setError(MultipartError::INTERNAL, buffer.data(), len, i, state);
+				state = ERROR;
+				return;
 			}
-			LOG("BREAK ppd 7.1")
 			lookbehind[index - 1] = c;
-			LOG("BREAK ppd 7.2")
 		} else if (prevIndex > 0) {
-			LOG("BREAK ppd 8")
 			// if our boundary turned out to be rubbish, the captured lookbehind
 			// belongs to partData
-			callback(onPartData, lookbehind, 0, prevIndex);
+			#if MULTIPART_STATS > 0
+				stats.falseCandidates++;
+				stats.lookbehindBytes += prevIndex;
+				if (i < prevIndex) {
+					// it began in a previous buffer
+					stats.lookbehindFlushes++;
+				}
+			#endif
+			if (bodyOffset + i - partDataStart > limits.maxPartSize) {
+				// known to be data only now that the candidate failed; the
+				// byte beyond the limit is in the candidate, possibly in
+				// the lookbehind only
+				uint64_t beyond = partDataStart + limits.maxPartSize;
+				if (beyond >= bodyOffset) {
+					setError(MultipartError::PART_SIZE_LIMIT, buffer.data(), len,
+						beyond - bodyOffset, state);
+				} else {
+					uint64_t candidate = bodyOffset + i - prevIndex;
+					setError(MultipartError::PART_SIZE_LIMIT, lookbehind, prevIndex,
+						beyond - candidate, state);
+					error.offset = beyond;
+				}
+				state = ERROR;
+				return;
+			}
+			callback<MultipartEvent::PART_DATA>(std::string_view(lookbehind, prevIndex), 0, prevIndex);
 			prevIndex = 0;
 			partDataMark = i;
 			
@@ -244,37 +420,31 @@ private:
 	
 public:
 
+	// RFC 2046 limits boundaries to 70 characters
+	static const size_t MAX_BOUNDARY_SIZE = 70;
 
-	// Callbacks
-	Callback onPartBegin;
-	Callback onHeaderField;
-	Callback onHeaderValue;
-	Callback onHeaderEnd;
-	Callback onHeadersEnd;
-	Callback onPartData;
-	Callback onPartEnd;
-	Callback onEnd;
-
-	// ??? shouldn't it be Callback instead of void*
-	void *userData;
-
-	std::string boundary;
-
-	// c string of boundary, why ? idk
-	const char *boundaryData;
+	// "\r\n--" and the boundary, null terminated; stored inline so that
+	// setting up a parser for a request does not allocate
+	char boundary[MAX_BOUNDARY_SIZE + 5];
 	// ... and its size
 	size_t boundarySize;
 
-	// useful for finding the boundary (using the Boyer-Moore algo)
-	bool boundaryIndex[256];
+	// bad character shift table, for finding the boundary (using the
+	// Boyer-Moore-Horspool algo) when there is no SIMD kernel; shifts are
+	// at most boundarySize, so a byte each keeps the parser small to copy
+	uint8_t boundaryShift[256];
+
+	// SIMD boundary search picked for this CPU, NULL if none
+	BoundarySearch::Kernel scanKernel;
 
 	// when matching a possible boundary, keep a lookbehind reference
 	// in case it turns out to be a false lead
-	char *lookbehind;
+	char lookbehind[MAX_BOUNDARY_SIZE + 4 + 8];
 	size_t lookbehindSize;
 
 	State state; // to remember what data the parser is parsing (header, data...)
 	int flags; // to know if part or last boundary
+	bool paused; // set by pause(), feed() returns after the current character
 
 	size_t index; // position of current character on the line ?
 
@@ -282,195 +452,133 @@ public:
 	size_t headerValueMark; // start of header value
 	size_t partDataMark; // start of part data
 
-	const char *errorReason;
+	// part data smaller than minDataChunk is gathered in coalesced, see
+	// setMinDataChunk()
+	size_t minDataChunk;
+	std::string coalesced;
+
+	// see getError()
+	MultipartError error;
+	
+	// see setLimits(); the limits are kept by reset(), the counts are not
+	MultipartLimits limits;
+	uint64_t bodyOffset;     // bytes of body consumed before the current buffer
+	uint64_t partCount;      // parts begun
+	uint64_t headerCount;    // headers of the current part
+	uint64_t partDataStart;  // offset in the body of the data of the current part
+	
+	#if MULTIPART_TRACE_LEVEL > 0
+		typedef void (*TraceCallback)(const MultipartTraceEvent &event, void *userData);
+		
+		// trace sink, see MultipartTrace.h
+		TraceCallback onTrace;
+		void *traceUserData;
+		
+		size_t traceCursor;        // absolute offset of the current byte
+		const char *traceBuffer;   // current buffer
+	#endif
 	
+	#if MULTIPART_STATS > 0
+		// see MultipartStats.h, cleared by reset()
+		MultipartStats stats;
+	#endif
 	
-	MultipartParser() {
-		lookbehind = NULL;
-		resetCallbacks();
+	
+	BasicMultipartParser() {
+		minDataChunk = 0;
+		resetTraceSink();
 		reset();
 	}
 	
-	MultipartParser(const std::string &boundary) {
-		lookbehind = NULL;
-		resetCallbacks();
+	BasicMultipartParser(std::string_view boundary) {
+		minDataChunk = 0;
+		resetTraceSink();
 		setBoundary(boundary);
 	}
-
-	// move assignement operator
-	MultipartParser& operator=(MultipartParser&& old) {
-
-		if ( this == &old )
-			return *this;
-
-		onPartBegin = old.onPartBegin;
-		onHeaderField = old.onHeaderField;
-		onHeaderValue = old.onHeaderValue;
-		onHeaderEnd = old.onHeaderEnd;
-		onHeadersEnd = old.onHeadersEnd;
-		onPartData = old.onPartData;
-		onPartEnd = old.onPartEnd;
-		onEnd = old.onEnd;
-	  	boundary = old.boundary;
-		boundarySize = old.boundarySize;
-		
-		lookbehindSize = old.lookbehindSize;
-		state = old.state;
-		flags = old.flags;
-		index = old.index;
-		headerFieldMark = old.headerFieldMark;
-		headerValueMark = old.headerValueMark;
-		partDataMark = old.partDataMark;
-
-		std::copy_n(old.boundaryIndex, 256, boundaryIndex);
-		errorReason = std::move(old.errorReason);
-		boundaryData = std::move(old.boundaryData);
-		lookbehind = old.lookbehind;
-
-		// invalidate old
-		//old.boundary = NULL;
-		old.onPartBegin = nullptr;
-		old.onHeaderField = nullptr;
-		old.onHeaderValue = nullptr;
-		old.onHeaderEnd = nullptr;
-		old.onHeadersEnd = nullptr;
-		old.onPartData = nullptr;
-		old.onPartEnd = nullptr;
-		old.onEnd = nullptr;
-		old.userData = nullptr;
-		old.boundaryData = nullptr;
-		old.boundarySize = NULL;
-		//old.boundaryIndex = nullptr;
-		old.lookbehind = nullptr;
-		old.lookbehindSize = NULL;
-		//old.state = NULL;
-		old.flags = NULL;
-		old.index = NULL;
-		old.headerFieldMark = NULL;
-		old.headerValueMark = NULL;
-		old.partDataMark = NULL;
-		old.errorReason = nullptr;
-		return *this;
-
+	
+	BasicMultipartParser(std::string_view boundary, const Handler &handler)
+		: Handler(handler)
+	{
+		minDataChunk = 0;
+		resetTraceSink();
+		setBoundary(boundary);
 	}
-	// TODO move constructor
-
-	MultipartParser(MultipartParser&& old) {
-
-		LOG("move constructor")
-		onPartBegin = old.onPartBegin;
-		onHeaderField = old.onHeaderField;
-		onHeaderValue = old.onHeaderValue;
-		onHeaderEnd = old.onHeaderEnd;
-		onHeadersEnd = old.onHeadersEnd;
-		onPartData = old.onPartData;
-		onPartEnd = old.onPartEnd;
-		onEnd = old.onEnd;
-	        boundary = old.boundary;
-		boundarySize = old.boundarySize;
-		
-		lookbehindSize = old.lookbehindSize;
-		state = old.state;
-		flags = old.flags;
-		index = old.index;
-		headerFieldMark = old.headerFieldMark;
-		headerValueMark = old.headerValueMark;
-		partDataMark = old.partDataMark;
-
-		std::copy_n(old.boundaryIndex, 256, boundaryIndex);
-		errorReason = std::move(old.errorReason);
-		boundaryData = std::move(old.boundaryData);
-		lookbehind = old.lookbehind;
 
-		// invalidate old
-		//old.boundary = NULL;
-		old.onPartBegin = nullptr;
-		old.onHeaderField = nullptr;
-		old.onHeaderValue = nullptr;
-		old.onHeaderEnd = nullptr;
-		old.onHeadersEnd = nullptr;
-		old.onPartData = nullptr;
-		old.onPartEnd = nullptr;
-		old.onEnd = nullptr;
-		old.userData = nullptr;
-		old.boundaryData = nullptr;
-		old.boundarySize = NULL;
-		//old.boundaryIndex = nullptr;
-		old.lookbehind = nullptr;
-		old.lookbehindSize = NULL;
-		//old.state = NULL;
-		old.flags = NULL;
-		old.index = NULL;
-		old.headerFieldMark = NULL;
-		old.headerValueMark = NULL;
-		old.partDataMark = NULL;
-		old.errorReason = nullptr;
-
-	}
-/* 	
-	MultipartParser(MultipartParser const& mp) {
-		if ( mp.getlookbehind != NULL ) {
-			lookbehind = new char[mp.get]
-		}
-	boundaryData;
-	boundarySize;
-	bool boundaryIndex[256];
-	char *lookbehind;
-	size_t lookbehindSize;
-	State state;
-	int flags;
-	size_t index;
-	size_t headerFieldMark;
-	size_t headerValueMark;
-	size_t partDataMark;
-	const char *errorReason;
-	}
-	*/
-	~MultipartParser() {
-		LOG("DESTROYED")
-		if ( lookbehind != nullptr ) {
-			delete[] lookbehind;
-			lookbehind = nullptr;
-		}
-	}
+	/*
+	 * All state is held by value, boundary and lookbehind included, so the
+	 * parser is a regular value type: copies are snapshots that can carry
+	 * on independently, and moves are noexcept and do not allocate (part
+	 * data being coalesced, if any, is moved along).
+	 */
+	BasicMultipartParser(const BasicMultipartParser &) = default;
+	BasicMultipartParser(BasicMultipartParser &&) = default;
+	BasicMultipartParser &operator=(const BasicMultipartParser &) = default;
+	BasicMultipartParser &operator=(BasicMultipartParser &&) = default;
 	
-	void reset() {
-		delete[] lookbehind;
+	/**
+	 * Forget the body and the boundary. Nothing is freed, so a parser can be
+	 * reused for request after request without allocating.
+	 */
+	void reset() noexcept {
 		state = ERROR;
-		boundary.clear();
-		boundaryData = boundary.c_str();
+		boundary[0] = '\0';
 		boundarySize = 0;
-		lookbehind = NULL;
+		scanKernel = NULL;
 		lookbehindSize = 0;
 		flags = 0;
+		paused = false;
 		index = 0;
 		headerFieldMark = UNMARKED;
 		headerValueMark = UNMARKED;
 		partDataMark    = UNMARKED;
-		errorReason     = "Parser uninitialized.";
+		coalesced.clear();
+		error.clear(MultipartError::UNINITIALIZED);
+		bodyOffset    = 0;
+		partCount     = 0;
+		headerCount   = 0;
+		partDataStart = 0;
+		#if MULTIPART_TRACE_LEVEL > 0
+			traceCursor = 0;
+			traceBuffer = NULL;
+		#endif
+		#if MULTIPART_STATS > 0
+			stats.clear();
+		#endif
 	}
 	
-	void setBoundary(const std::string &boundary) {
+	/**
+	 * Get ready for a new body. A boundary longer than MAX_BOUNDARY_SIZE is
+	 * an error.
+	 */
+	void setBoundary(std::string_view boundary) noexcept {
 		reset();
-		//this->boundary = boundary;
-		this->boundary = "\r\n--" + boundary;
-		LOG(this->boundary << "setboundary")
-		boundaryData = this->boundary.c_str();
-		LOG(this->boundary << "setboundary c_str")
-		boundarySize = this->boundary.size();
+		if (boundary.size() > MAX_BOUNDARY_SIZE) {
+			error.clear(MultipartError::BOUNDARY_TOO_LONG);
+			return;
+		}
+		memcpy(this->boundary, "\r\n--", 4);
+		memcpy(this->boundary + 4, boundary.data(), boundary.size());
+		boundarySize = boundary.size() + 4;
+		this->boundary[boundarySize] = '\0';
 		indexBoundary();
-		lookbehind = new char[boundarySize + 8];
+		scanKernel = BoundarySearch::kernel();
 		lookbehindSize = boundarySize + 8;
 		state = START;
-		errorReason = "No error.";
+		error.clear(MultipartError::NONE);
 	}
 	
 	/** Process a small part (buffer) of the body of the request
 	 * @param buffer part of the HTTP multi-form body
 	 * @param len the length of the buffer
+	 * @return the number of bytes consumed: len, unless the parser stopped
+	 * or was paused, in which case the rest must be fed again to resume.
+	 * It is 0 when paused on data held back from the previous buffer,
+	 * before any of this one was consumed: isPaused() tells it from an
+	 * error, and the same bytes are fed again after resume().
 	*/
 	size_t feed(std::string_view buffer, size_t len) {
 
+		paused = false;
 		if (state == ERROR || len == 0) {
 			return 0;
 		}
@@ -479,13 +587,31 @@ public:
 		int flags           = this->flags;
 		size_t prevIndex    = this->index;
 		size_t index        = this->index;
-		size_t boundaryEnd  = boundarySize;
+		size_t fedLen       = len;
 		size_t i;
 		char c, cl;
-		LOG(boundary << "feed")
+		
+		// parse no further than maxBodySize, fail there if the body goes on
+		uint64_t allowed = limits.maxBodySize - std::min(bodyOffset, limits.maxBodySize);
+		if (len > allowed) {
+			len = allowed;
+		}
+		#if MULTIPART_TRACE_LEVEL > 0
+			State traced = state;
+			traceBuffer = buffer.data();
+		#endif
 		// go through each char of in the buffer
 		for (i = 0; i < len; i++) {
 			c = buffer[i];
+			#if MULTIPART_TRACE_LEVEL > 0
+				traceCursor = bodyOffset + i;
+			#endif
+			#if MULTIPART_STATS > 0
+				stats.bytesStepped++;
+				if (state >= HEADER_FIELD_START && state <= HEADERS_ALMOST_DONE) {
+					stats.headerBytes++;
+				}
+			#endif
 			
 			switch (state) {
 
@@ -498,156 +624,493 @@ public:
 
 			case START_BOUNDARY:
 
-				// this->boundary has 2 more character (at the beginning CR LF)
-				// than what we are currently reading, so the index of the last
-				// char of the part boundary is not size-1 but size-3, and the
-				// char before the last: size-4
-				if (index == boundarySize - 4) {
+				// this->boundary starts with CR LF, which the first boundary
+				// lacks, so the whole "--boundary" has been read once index
+				// reaches size-2; it must be followed by CR LF
+				if (index == boundarySize - 2) {
 					if (c != CR) {
-						setError("Malformed. Expected CR after boundary.");
+						setError(MultipartError::BOUNDARY_CR_EXPECTED, buffer.data(), len, i, state);
 						return i;
 					}
 					index++;
 					break;
-				} else if (index == boundarySize - 3) {
+				} else if (index == boundarySize - 1) {
 					if (c != LF) {
-						setError("Malformed. Expected LF after boundary CR.");
+						setError(MultipartError::BOUNDARY_LF_EXPECTED, buffer.data(), len, i, state);
 						return i;
 					}
 					index = 0;
-					callback(onPartBegin);
+					if (++partCount > limits.maxParts) {
+						setError(MultipartError::PARTS_LIMIT, buffer.data(), len, i, state);
+						return i;
+					}
+					callback<MultipartEvent::PART_BEGIN>();
 					state = HEADER_FIELD_START;
 					break;
 				}
 				if (c != boundary[index + 2]) {
-					LOG("oijaeifj paoijepofgi japoeigjp aejpgoi japogiej aioejg  HERE")
-					LOG(int(c) << " vs " << int(boundary[index+2]))
-					LOG(c << " vs " << boundary[index+2])
-					setError("Malformed. Found different boundary data than the given one.");
+					setError(MultipartError::BOUNDARY_MISMATCH, buffer.data(), len, i, state);
 					return i;
 				}
 				index++;
 				break;
 			case HEADER_FIELD_START:
-				LOG("BREAKPOINT 1")
+				if (c != CR && ++headerCount > limits.maxHeadersPerPart) {
+					setError(MultipartError::HEADERS_LIMIT, buffer.data(), len, i, state);
+					return i;
+				}
 				state = HEADER_FIELD;
 				headerFieldMark = i;
 				index = 0;
 			case HEADER_FIELD:
-				LOG("BREAKPOINT 2")
 				if (c == CR) {
-					LOG("BREAKPOINT 2.1")
 					headerFieldMark = UNMARKED;
 					state = HEADERS_ALMOST_DONE;
 					break;
 				}
 
-				index++;
+				// index counts the bytes of the header line, for
+				// maxHeaderLineSize
+				if (++index > limits.maxHeaderLineSize) {
+					setError(MultipartError::HEADER_LINE_LIMIT, buffer.data(), len, i, state);
+					return i;
+				}
 				if (c == HYPHEN) {
-					LOG("BREAKPOINT 2.2")
 					break;
 				}
 
 				if (c == COLON) {
-					LOG("BREAKPOINT 2.3")
 					if (index == 1) {
 						// empty header field
-						setError("Malformed first header name character.");
+						setError(MultipartError::EMPTY_HEADER_NAME, buffer.data(), len, i, state);
 						return i;
 					}
-					dataCallback(onHeaderField, headerFieldMark, buffer, i, len, true);
+					dataCallback<MultipartEvent::HEADER_FIELD>(headerFieldMark, buffer, i, len, true);
 					state = HEADER_VALUE_START;
 					break;
 				}
 
-				LOG("BREAKPOINT 3")
 				cl = lower(c);
 				if (cl < 'a' || cl > 'z') {
-					setError("Malformed header name.");;
+					setError(MultipartError::BAD_HEADER_NAME, buffer.data(), len, i, state);
 					return i;
 				}
 				break;
 			case HEADER_VALUE_START:
-				LOG("BREAKPOINT 4")
 				if (c == SPACE) {
+					if (++index > limits.maxHeaderLineSize) {
+						setError(MultipartError::HEADER_LINE_LIMIT, buffer.data(), len, i, state);
+						return i;
+					}
 					break;
 				}
 				
 				headerValueMark = i; // mark start of header value in the buffer
 				state = HEADER_VALUE;
 			case HEADER_VALUE:
-				LOG("BREAKPOINT 5")
 				if (c == CR) {
 					//             callback   , start          , buffer,  end  , clean, allowEmpty
-					dataCallback(onHeaderValue, headerValueMark, buffer, i, len, true, true);
-					callback(onHeaderEnd);
+					dataCallback<MultipartEvent::HEADER_VALUE>(headerValueMark, buffer, i, len, true, true);
+					callback<MultipartEvent::HEADER_END>();
 					state = HEADER_VALUE_ALMOST_DONE;
+				} else if (++index > limits.maxHeaderLineSize) {
+					setError(MultipartError::HEADER_LINE_LIMIT, buffer.data(), len, i, state);
+					return i;
 				}
 				break;
 			case HEADER_VALUE_ALMOST_DONE:
-				LOG("BREAKPOINT 6")
 				if (c != LF) {
-					setError("Malformed header value: LF expected after CR");
+					setError(MultipartError::HEADER_LF_EXPECTED, buffer.data(), len, i, state);
 					return i;
 				}
 				
 				state = HEADER_FIELD_START;
 				break;
 			case HEADERS_ALMOST_DONE:
-				LOG("BREAKPOINT 7")
 				if (c != LF) {
-					setError("Malformed header ending: LF expected after CR");
+					setError(MultipartError::HEADERS_LF_EXPECTED, buffer.data(), len, i, state);
 					return i;
 				}
 				
-				callback(onHeadersEnd);
+				// known before onHeadersEnd, for the errors found there
+				partDataStart = bodyOffset + i + 1;
+				callback<MultipartEvent::HEADERS_END>();
+				headerCount = 0;
+				index = 0;
 				state = PART_DATA_START;
 				break;
 			case PART_DATA_START:
-				LOG("BREAKPOINT 8")
 				state = PART_DATA;
 				partDataMark = i;
 			case PART_DATA:
-				LOG("BREAKPOINT 9")
 				// part data requires more processing
 				// will modify i, index, prevIndex, state and flags
-				processPartData(prevIndex, index, buffer, len, boundaryEnd, i, c, state, flags);
+				processPartData(prevIndex, index, buffer, len, i, c, state, flags);
+				if (state == ERROR) {
+					return i;
+				}
 				break;
+			case END:
+				// remember we are done, trailing data (epilogue) is ignored
+				this->state = state;
+				bodyOffset += i;
+				return i;
 			default:
 				return i;
 			}
+			#if MULTIPART_TRACE_LEVEL > 0
+				traceTransition(traced, state);
+			#endif
+			if (paused) {
+				// the current character is dealt with, consider the buffer
+				// ends right after it; boundary matching state is kept, so
+				// parsing resumes exactly here
+				len = i + 1;
+				break;
+			}
 		}
 		
-		LOG("BREAKPOINT 10")
-		dataCallback(onHeaderField, headerFieldMark, buffer, i, len, false);
-		LOG("BREAKPOINT 11")
-		dataCallback(onHeaderValue, headerValueMark, buffer, i, len, false);
-		LOG("BREAKPOINT 12")
-		dataCallback(onPartData, partDataMark, buffer, i, len, false);
+		if (len < fedLen && !paused && state != END) {
+			// the body goes on beyond maxBodySize
+			setError(MultipartError::BODY_SIZE_LIMIT, buffer.data(), fedLen, len, state);
+			return len;
+		}
+		
+		dataCallback<MultipartEvent::HEADER_FIELD>(headerFieldMark, buffer, i, len, false);
+		dataCallback<MultipartEvent::HEADER_VALUE>(headerValueMark, buffer, i, len, false);
+		dataCallback<MultipartEvent::PART_DATA>(partDataMark, buffer, i, len, false);
 		
 		this->index = index;
 		this->state = state;
 		this->flags = flags;
+		bodyOffset += len;
 		
 		return len;
 	}
 	
-	bool succeeded() const {
+	/**
+	 * feed() for a plain buffer, which may not be null terminated.
+	 */
+	size_t feed(const char *buffer, size_t len) {
+		return feed(std::string_view(buffer, len), len);
+	}
+	
+	/**
+	 * Index a body that is entirely in memory, in a single pass over it and
+	 * without any callback or copy: the part layout is found with the same
+	 * boundary search as feed(), skipping the state machine. Only the
+	 * boundary of the parser is used, its state is left untouched.
+	 *
+	 * Returns false if the body is malformed, index.getErrorMessage() then
+	 * tells why.
+	 */
+	bool parseContiguous(std::string_view body, MultipartIndex &index) const {
+		return indexParts(body, index, [this](const char *data, size_t from, size_t len) {
+			return findBoundary(data, from, len);
+		});
+	}
+	
+	/**
+	 * parseContiguous() with a custom boundary search: nextBoundary(data,
+	 * from, len) must return the first position >= from where the boundary
+	 * is, or len. It is called with increasing values of from, which lets it
+	 * walk a list of candidates found beforehand (see MultipartParallel.h).
+	 */
+	template<typename NextBoundary>
+	bool indexParts(std::string_view body, MultipartIndex &index, NextBoundary nextBoundary) const {
+		const char *data = body.data();
+		size_t len = body.size();
+		size_t pos;
+		
+		index.clear();
+		index.body = body;
+		
+		if (boundarySize == 0) {
+			index.errorReason = "Parser uninitialized.";
+			return false;
+		}
+		
+		// the first boundary lacks the leading CR LF
+		if (len < boundarySize || memcmp(data, boundary + 2, boundarySize - 2) != 0) {
+			index.errorReason = "Malformed. Found different boundary data than the given one.";
+			return false;
+		}
+		pos = boundarySize - 2;
+		if (data[pos] != CR || data[pos + 1] != LF) {
+			index.errorReason = "Malformed. Expected CR LF after boundary.";
+			return false;
+		}
+		pos += 2;
+		
+		while (true) {
+			MultipartIndex::Part part;
+			
+			part.headersBegin = pos;
+			if (pos + 2 <= len && data[pos] == CR && data[pos + 1] == LF) {
+				part.headersEnd = pos;
+			} else {
+				size_t end = body.find("\r\n\r\n", pos);
+				if (end == std::string_view::npos) {
+					index.errorReason = "Malformed. Headers are not followed by an empty line.";
+					return false;
+				}
+				part.headersEnd = end + 2;
+			}
+			part.dataBegin = part.headersEnd + 2;
+			
+			// a boundary not followed by CR LF or "--" is part of the data
+			size_t found = part.dataBegin;
+			while (true) {
+				found = nextBoundary(data, found, len);
+				if (found == len) {
+					index.errorReason = "Malformed. Part data is not terminated by a boundary.";
+					return false;
+				}
+				
+				size_t after = found + boundarySize;
+				if (after + 2 > len) {
+					found++;
+				} else if (data[after] == CR && data[after + 1] == LF) {
+					part.dataEnd = found;
+					index.parts.push_back(part);
+					pos = after + 2;
+					break;
+				} else if (data[after] == HYPHEN && data[after + 1] == HYPHEN) {
+					part.dataEnd = found;
+					index.parts.push_back(part);
+					index.errorReason = "No error.";
+					return true;
+				} else {
+					found++;
+				}
+			}
+		}
+	}
+	
+	MultipartIndex parseContiguous(std::string_view body) const {
+		MultipartIndex index;
+		parseContiguous(body, index);
+		return index;
+	}
+	
+	/**
+	 * Find the first position >= i in buffer where the whole boundary, with
+	 * its leading CR LF, is. Returns len if there is none.
+	 */
+	size_t findBoundary(const char *buffer, size_t i, size_t len) const noexcept {
+		size_t found = len;
+		
+		if (scanKernel != NULL) {
+			found = scanKernel(buffer, i, len, boundary, boundarySize);
+		} else {
+			// boyer-moore-horspool search, skip according to the last
+			// character of the window
+			const char last = boundary[boundarySize - 1];
+			while (i + boundarySize <= len) {
+				char c = buffer[i + boundarySize - 1];
+				if (c == last && memcmp(buffer + i, boundary, boundarySize - 1) == 0) {
+					found = i;
+					break;
+				}
+				i += boundaryShift[(unsigned char) c];
+			}
+		}
+		return found;
+	}
+	
+	
+	Handler &handler() {
+		return *this;
+	}
+	
+	const Handler &handler() const {
+		return *this;
+	}
+	
+	bool succeeded() const noexcept {
 		return state == END;
 	}
 	
-	bool hasError() const {
+	bool hasError() const noexcept {
 		return state == ERROR;
 	}
 	
-	bool stopped() const {
+	bool stopped() const noexcept {
 		return state == ERROR || state == END;
 	}
 	
-	const char *getErrorMessage() const {
-		return errorReason;
+	/**
+	 * Called from a callback, make feed() return once the current character
+	 * is processed. What was not consumed is fed again to resume. Handler
+	 * members can also return false to pause.
+	 */
+	void pause() noexcept {
+		paused = true;
+	}
+	
+	/**
+	 * Clear a pause once the caller is ready for more events, so that
+	 * isPaused() is false until a callback pauses again. feed() resumes
+	 * anyway, this is for callers that keep the paused state around.
+	 */
+	void resume() noexcept {
+		paused = false;
+	}
+	
+	/**
+	 * Deliver part data in chunks of at least size bytes, except for the
+	 * last one of a part. Smaller spans (false boundary candidates, ends of
+	 * buffers) are copied and gathered until there is enough; spans that
+	 * are large enough on their own are still delivered from the input
+	 * buffer. 0, the default, delivers data as soon as it is parsed.
+	 */
+	void setMinDataChunk(size_t size) {
+		flushCoalesced();
+		minDataChunk = size;
+		coalesced.reserve(size);
+	}
+	
+	/**
+	 * Bound what the body may contain, see MultipartLimits.h. Limits are
+	 * kept by reset(), and apply to the whole body even if changed while
+	 * feeding it.
+	 */
+	void setLimits(const MultipartLimits &limits) {
+		this->limits = limits;
+	}
+	
+	const MultipartLimits &getLimits() const {
+		return limits;
+	}
+	
+	/** The limit the body went beyond, NONE unless that stopped the parser. */
+	MultipartLimits::Kind getLimitExceeded() const noexcept {
+		return error.limit();
+	}
+	
+	/**
+	 * Append the state of the parser to out, so that parsing can go on
+	 * with deserialize(), possibly in another process, from the first byte
+	 * not fed yet. This is the boundary, the position in the syntax, the
+	 * few bytes held back while matching a possible boundary, and part data
+	 * being coalesced: tens of bytes, rarely more. The handler, trace sink,
+	 * limits and stats are not included, the counts limits are checked
+	 * against are. Returns false, appending nothing, if the
+	 * parser has failed or has no boundary.
+	 */
+	bool serialize(std::string &out) const {
+		if (state == ERROR) {
+			return false;
+		}
+		
+		MultipartCheckpoint::Writer writer(out);
+		std::string_view held;
+		if (state == PART_DATA) {
+			// the candidate boundary matched so far
+			held = std::string_view(lookbehind, index);
+		}
+		writer.number(MultipartCheckpoint::MAGIC);
+		writer.bytes(std::string_view(boundary + 4, boundarySize - 4));
+		writer.number(state);
+		writer.number(flags);
+		writer.number(index);
+		writer.bytes(held);
+		// marks are either unset or at the start of the next buffer
+		writer.number((headerFieldMark != UNMARKED)
+			| (headerValueMark != UNMARKED) << 1
+			| (partDataMark != UNMARKED) << 2);
+		writer.number(minDataChunk);
+		writer.bytes(coalesced);
+		writer.number(bodyOffset);
+		writer.number(partCount);
+		writer.number(headerCount);
+		writer.number(partDataStart);
+		return true;
+	}
+	
+	/**
+	 * Restore a parser saved by serialize(): it then expects the input
+	 * that followed. Returns the number of bytes of data used, or 0 if it
+	 * is not a valid checkpoint, which leaves the parser in error.
+	 */
+	size_t deserialize(std::string_view data) {
+		MultipartCheckpoint::Reader reader(data);
+		
+		if (reader.number() != MultipartCheckpoint::MAGIC) {
+			return failCheckpoint();
+		}
+		std::string_view savedBoundary = reader.bytes();
+		if (reader.failed()) {
+			return failCheckpoint();
+		}
+		setBoundary(savedBoundary);
+		if (state == ERROR) {
+			return failCheckpoint();
+		}
+		
+		uint64_t savedState = reader.number();
+		uint64_t savedFlags = reader.number();
+		uint64_t savedIndex = reader.number();
+		std::string_view held = reader.bytes();
+		uint64_t marks = reader.number();
+		uint64_t savedMinDataChunk = reader.number();
+		std::string_view savedCoalesced = reader.bytes();
+		uint64_t savedBodyOffset = reader.number();
+		uint64_t savedPartCount = reader.number();
+		uint64_t savedHeaderCount = reader.number();
+		uint64_t savedPartDataStart = reader.number();
+		if (reader.failed()
+		 || savedState == ERROR || savedState > END
+		 || savedFlags > (PART_BOUNDARY | LAST_BOUNDARY)
+		 || !isValidIndex((State) savedState, savedIndex, savedFlags)
+		 || held.size() != (savedState == PART_DATA ? savedIndex : 0)
+		 || held.size() > lookbehindSize
+		 || marks > 7
+		 || savedPartDataStart > savedBodyOffset)
+		{
+			return failCheckpoint();
+		}
+		
+		state = (State) savedState;
+		flags = savedFlags;
+		index = savedIndex;
+		memcpy(lookbehind, held.data(), held.size());
+		headerFieldMark = (marks & 1) ? 0 : UNMARKED;
+		headerValueMark = (marks & 2) ? 0 : UNMARKED;
+		partDataMark    = (marks & 4) ? 0 : UNMARKED;
+		minDataChunk = savedMinDataChunk;
+		coalesced.assign(savedCoalesced.data(), savedCoalesced.size());
+		bodyOffset = savedBodyOffset;
+		partCount = savedPartCount;
+		headerCount = savedHeaderCount;
+		partDataStart = savedPartDataStart;
+		return reader.position();
+	}
+	
+	/** Whether the last feed() stopped because of pause(). */
+	bool isPaused() const noexcept {
+		return paused && !stopped();
+	}
+	
+	const char *getErrorMessage() const noexcept {
+		return error.message;
+	}
+	
+	/**
+	 * What went wrong, code and position, once hasError(). The parser
+	 * throws nothing, so a stream of malformed bodies is rejected at the
+	 * cost of a few stores each; only callbacks, and the allocation of
+	 * setMinDataChunk(), may throw out of feed().
+	 */
+	const MultipartError &getError() const noexcept {
+		return error;
 	}
 };
 
+typedef BasicMultipartParser<MultipartCallbacks> MultipartParser;
+
+static_assert(std::is_nothrow_move_constructible<MultipartParser>::value
+	&& std::is_nothrow_move_assignable<MultipartParser>::value,
+	"MultipartParser must be cheap to relocate");
 
 #endif /* _MULTIPART_PARSER_H_ */
@@ -1,18 +1,452 @@
 #ifndef _MULTIPART_READER_H_
 #define _MULTIPART_READER_H_
 
-#include <map>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
 #include <utility>
 #include "MultipartParser.h"
+#include "MultipartDisposition.h"
+#include "MultipartTransferDecoder.h"
+#include "MultipartDigest.h"
 
-class MultipartHeaders: public std::multimap<std::string, std::string> {
+/**
+ * Headers of one part.
+ *
+ * Names and values are stored back to back in a bump arena, and indexed by
+ * a flat vector in the order they were received. Both are cleared, not
+ * freed, between parts, so once they have grown to the size of a typical
+ * header block, reading the headers of a part costs no allocation.
+ *
+ * Names and values are exposed as std::string_view into the arena, they
+ * are valid until the next part begins. Header names are case-insensitive.
+ *
+ * The common Content-* headers are recognized while their name is being
+ * received, using a perfect hash generated at compile time, and can be
+ * looked up in constant time by their Id.
+ *
+ * Once all headers are received, Content-Disposition is scanned for the
+ * name and filename parameters, see MultipartDisposition.h. They are
+ * unescaped into the arena only when needed, otherwise they are views of
+ * the header value.
+ */
+class MultipartHeaders {
+public:
+	typedef std::pair<std::string_view, std::string_view> value_type;
+	
+	enum Id {
+		CONTENT_DISPOSITION,
+		CONTENT_TYPE,
+		CONTENT_TRANSFER_ENCODING,
+		CONTENT_LENGTH,
+		CONTENT_ID,
+		UNKNOWN
+	};
+	
+	/** Canonical name of a well-known header. */
+	static constexpr std::string_view canonicalName(Id id) {
+		switch (id) {
+		case CONTENT_DISPOSITION:       return "Content-Disposition";
+		case CONTENT_TYPE:              return "Content-Type";
+		case CONTENT_TRANSFER_ENCODING: return "Content-Transfer-Encoding";
+		case CONTENT_LENGTH:            return "Content-Length";
+		case CONTENT_ID:                return "Content-ID";
+		default:                        return std::string_view();
+		}
+	}
+	
 private:
-	std::string empty;
+	static const uint32_t HASH_SEED  = 2166136261u;
+	static const size_t   HASH_SLOTS = 16;
+	static const size_t   NONE       = (size_t) -1;
+	
+	struct Entry {
+		size_t nameOffset;
+		size_t nameSize;
+		size_t valueOffset;
+		size_t valueSize;
+		uint32_t nameHash;
+	};
+	
+	struct Span {
+		size_t offset;
+		size_t size;
+	};
+	
+	struct HashTable {
+		unsigned char slots[HASH_SLOTS];
+		bool perfect;
+	};
+	
+	std::string arena;
+	std::vector<Entry> entries;
+	Entry current;
+	
+	// index in entries of the first header of each well-known kind
+	size_t known[UNKNOWN];
+	
+	// Content-Disposition parameters
+	Span dispositionType, partName, partFilename;
+	bool hasPartName, hasPartFilename;
+	
+	static constexpr char lower(char c) {
+		return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+	}
+	
+	// case-insensitive FNV-1a, fed one character at a time
+	static constexpr uint32_t hashStep(uint32_t hash, char c) {
+		return (hash ^ (unsigned char) lower(c)) * 16777619u;
+	}
+	
+	static constexpr uint32_t hashName(std::string_view name) {
+		uint32_t hash = HASH_SEED;
+		for (size_t i = 0; i < name.size(); i++) {
+			hash = hashStep(hash, name[i]);
+		}
+		return hash;
+	}
+	
+	static constexpr HashTable buildHashTable() {
+		HashTable table = { { 0 }, true };
+		for (size_t slot = 0; slot < HASH_SLOTS; slot++) {
+			table.slots[slot] = UNKNOWN;
+		}
+		for (int id = 0; id < UNKNOWN; id++) {
+			size_t slot = hashName(canonicalName((Id) id)) % HASH_SLOTS;
+			if (table.slots[slot] != UNKNOWN) {
+				table.perfect = false;
+			}
+			table.slots[slot] = id;
+		}
+		return table;
+	}
+	
+	static bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+		if (a.size() != b.size()) {
+			return false;
+		}
+		for (size_t i = 0; i < a.size(); i++) {
+			if (lower(a[i]) != lower(b[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	/** Id of the header with the given name and hash. */
+	static Id recognize(uint32_t hash, std::string_view name) {
+		static constexpr HashTable table = buildHashTable();
+		static_assert(table.perfect, "well-known header names collide, change HASH_SLOTS");
+		
+		Id id = (Id) table.slots[hash % HASH_SLOTS];
+		if (id != UNKNOWN && equalsIgnoreCase(name, canonicalName(id))) {
+			return id;
+		}
+		return UNKNOWN;
+	}
+	
+	std::string_view view(size_t offset, size_t size) const {
+		return std::string_view(arena.data() + offset, size);
+	}
+	
+	// the header being received is always at the top of the arena: its
+	// name is appended first, then its value
+	void appendName(std::string_view data) {
+		for (size_t i = 0; i < data.size(); i++) {
+			current.nameHash = hashStep(current.nameHash, data[i]);
+		}
+		arena.append(data);
+		current.nameSize += data.size();
+		current.valueOffset = arena.size();
+	}
+	
+	void appendValue(std::string_view data) {
+		arena.append(data);
+		current.valueSize += data.size();
+	}
+	
+	void beginHeader() {
+		current.nameOffset  = arena.size();
+		current.nameSize    = 0;
+		current.valueOffset = arena.size();
+		current.valueSize   = 0;
+		current.nameHash    = HASH_SEED;
+	}
+	
+	void endHeader() {
+		Id id = recognize(current.nameHash, view(current.nameOffset, current.nameSize));
+		if (id != UNKNOWN && known[id] == NONE) {
+			known[id] = entries.size();
+		}
+		entries.push_back(current);
+		beginHeader();
+	}
+	
+	void forgetKnown() {
+		for (int id = 0; id < UNKNOWN; id++) {
+			known[id] = NONE;
+		}
+		dispositionType.offset = dispositionType.size = 0;
+		partName.offset = partName.size = 0;
+		partFilename.offset = partFilename.size = 0;
+		hasPartName = hasPartFilename = false;
+	}
+	
+	Span spanOf(std::string_view data) const {
+		Span span = { 0, 0 };
+		if (!data.empty()) {
+			span.offset = data.data() - arena.data();
+			span.size   = data.size();
+		}
+		return span;
+	}
+	
+	// decode a parameter at the top of the arena, if it needs to be
+	Span decodeParameter(Span raw, MultipartDisposition::Encoding encoding) {
+		if (encoding == MultipartDisposition::PLAIN) {
+			return raw;
+		}
+		Span decoded;
+		decoded.offset = arena.size();
+		arena.resize(decoded.offset + raw.size);
+		decoded.size = MultipartDisposition::decode(view(raw.offset, raw.size),
+			encoding, &arena[decoded.offset]);
+		arena.resize(decoded.offset + decoded.size);
+		return decoded;
+	}
+	
+	void parseDisposition() {
+		if (known[CONTENT_DISPOSITION] == NONE) {
+			return;
+		}
+		
+		const Entry &entry = entries[known[CONTENT_DISPOSITION]];
+		MultipartDisposition disposition;
+		disposition.parse(view(entry.valueOffset, entry.valueSize));
+		
+		// remember offsets only, decoding may move the arena
+		dispositionType = spanOf(disposition.type);
+		partName        = spanOf(disposition.name);
+		partFilename    = spanOf(disposition.filename);
+		hasPartName     = disposition.hasName;
+		hasPartFilename = disposition.hasFilename;
+		
+		partName     = decodeParameter(partName, disposition.nameEncoding);
+		partFilename = decodeParameter(partFilename, disposition.filenameEncoding);
+	}
+	
+	// headers received so far, the last one possibly incomplete; they are
+	// restored by receiving them again
+	void serialize(MultipartCheckpoint::Writer &writer) const {
+		writer.number(entries.size());
+		for (size_t i = 0; i < entries.size(); i++) {
+			writer.bytes(view(entries[i].nameOffset, entries[i].nameSize));
+			writer.bytes(view(entries[i].valueOffset, entries[i].valueSize));
+		}
+		writer.bytes(view(current.nameOffset, current.nameSize));
+		writer.bytes(view(current.valueOffset, current.valueSize));
+	}
+	
+	bool deserialize(MultipartCheckpoint::Reader &reader) {
+		clear();
+		uint64_t count = reader.number();
+		for (uint64_t i = 0; i < count && !reader.failed(); i++) {
+			appendName(reader.bytes());
+			appendValue(reader.bytes());
+			endHeader();
+		}
+		appendName(reader.bytes());
+		appendValue(reader.bytes());
+		return !reader.failed();
+	}
+	
+	friend class MultipartReader;
+	
 public:
-	const std::string &operator[](const std::string &key) const {
-		const_iterator it = find(key);
+	class const_iterator {
+	private:
+		const MultipartHeaders *headers;
+		size_t i;
+		
+	public:
+		// operator-> needs something to point to
+		class pointer {
+		private:
+			value_type value;
+		public:
+			pointer(const value_type &value): value(value) { }
+			const value_type *operator->() const { return &value; }
+		};
+		
+		const_iterator()
+			: headers(NULL),
+			  i(0)
+			{ }
+		
+		const_iterator(const MultipartHeaders *headers, size_t i)
+			: headers(headers),
+			  i(i)
+			{ }
+		
+		value_type operator*() const {
+			return headers->at(i);
+		}
+		
+		pointer operator->() const {
+			return pointer(headers->at(i));
+		}
+		
+		const_iterator &operator++() {
+			i++;
+			return *this;
+		}
+		
+		const_iterator operator++(int) {
+			const_iterator old = *this;
+			i++;
+			return old;
+		}
+		
+		bool operator==(const const_iterator &other) const {
+			return i == other.i && headers == other.headers;
+		}
+		
+		bool operator!=(const const_iterator &other) const {
+			return !(*this == other);
+		}
+	};
+	
+	MultipartHeaders() {
+		forgetKnown();
+		beginHeader();
+	}
+	
+	void clear() {
+		arena.clear();
+		entries.clear();
+		forgetKnown();
+		beginHeader();
+	}
+	
+	/**
+	 * Replace the headers with the ones of a raw header block, each line
+	 * ending with CR LF, such as MultipartIndex::headers() returns.
+	 */
+	void assign(std::string_view block) {
+		size_t pos = 0;
+		
+		clear();
+		while (pos < block.size()) {
+			size_t eol = block.find('\r', pos);
+			if (eol == std::string_view::npos) {
+				eol = block.size();
+			}
+			std::string_view line = block.substr(pos, eol - pos);
+			size_t colon = line.find(':');
+			if (colon != std::string_view::npos) {
+				size_t value = colon + 1;
+				while (value < line.size() && line[value] == ' ') {
+					value++;
+				}
+				appendName(line.substr(0, colon));
+				appendValue(line.substr(value));
+				endHeader();
+			}
+			pos = eol + 2;
+		}
+		parseDisposition();
+	}
+	
+	size_t size() const {
+		return entries.size();
+	}
+	
+	bool empty() const {
+		return entries.empty();
+	}
+	
+	/** i-th header, in the order they were received. */
+	value_type at(size_t i) const {
+		const Entry &entry = entries[i];
+		return value_type(view(entry.nameOffset, entry.nameSize),
+			view(entry.valueOffset, entry.valueSize));
+	}
+	
+	const_iterator begin() const {
+		return const_iterator(this, 0);
+	}
+	
+	const_iterator end() const {
+		return const_iterator(this, entries.size());
+	}
+	
+	/** Disposition type, "form-data" for forms, empty if none. */
+	std::string_view disposition() const {
+		return view(dispositionType.offset, dispositionType.size);
+	}
+	
+	/** The name parameter of Content-Disposition, unescaped. */
+	std::string_view name() const {
+		return view(partName.offset, partName.size);
+	}
+	
+	/**
+	 * The filename parameter of Content-Disposition, unescaped. filename*
+	 * is preferred over filename when both are sent.
+	 */
+	std::string_view filename() const {
+		return view(partFilename.offset, partFilename.size);
+	}
+	
+	bool hasName() const {
+		return hasPartName;
+	}
+	
+	/** Whether the part is a file, even when its filename is empty. */
+	bool hasFilename() const {
+		return hasPartFilename;
+	}
+	
+	/** First header of a well-known kind, or end(). */
+	const_iterator find(Id id) const {
+		if (id == UNKNOWN || known[id] == NONE) {
+			return end();
+		}
+		return const_iterator(this, known[id]);
+	}
+	
+	/** First header with the given name, ignoring case, or end(). */
+	const_iterator find(std::string_view name) const {
+		uint32_t hash = hashName(name);
+		Id id = recognize(hash, name);
+		if (id != UNKNOWN) {
+			return find(id);
+		}
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (entries[i].nameHash == hash
+			 && equalsIgnoreCase(view(entries[i].nameOffset, entries[i].nameSize), name))
+			{
+				return const_iterator(this, i);
+			}
+		}
+		return end();
+	}
+	
+	/** Value of the first header of a well-known kind, empty if none. */
+	std::string_view operator[](Id id) const {
+		if (id == UNKNOWN || known[id] == NONE) {
+			return std::string_view();
+		}
+		const Entry &entry = entries[known[id]];
+		return view(entry.valueOffset, entry.valueSize);
+	}
+	
+	/** Value of the first header with the given name, empty if none. */
+	std::string_view operator[](std::string_view name) const {
+		const_iterator it = find(name);
 		if (it == end()) {
-			return empty;
+			return std::string_view();
 		} else {
 			return it->second;
 		}
@@ -26,85 +460,361 @@ public:
 	typedef void (*Callback)(void *userData);
 
 private:
-	MultipartParser parser;
+	// forwards the parser events to the reader, the calls are resolved at
+	// compile time
+	class ParserHandler {
+	public:
+		MultipartReader *reader;
+		size_t depth;  // of the parts this parser finds
+		
+		ParserHandler() {
+			reader = NULL;
+			depth = 0;
+		}
+		
+		void onPartBegin()                        { reader->cbPartBegin(depth); }
+		void onHeaderField(std::string_view data) { reader->cbHeaderField(depth, data); }
+		void onHeaderValue(std::string_view data) { reader->cbHeaderValue(depth, data); }
+		void onHeaderEnd()                        { reader->cbHeaderEnd(depth); }
+		void onHeadersEnd()                       { reader->cbHeadersEnd(depth); }
+		void onPartData(std::string_view data)    { reader->cbPartData(depth, data); }
+		void onPartEnd()                          { reader->cbPartEnd(depth); }
+		void onEnd()                              { reader->cbEnd(depth); }
+	};
+	
+	typedef BasicMultipartParser<ParserHandler> Parser;
+	
+	// parser of the body of a multipart part, and the headers of its parts
+	struct Nested {
+		Parser parser;
+		bool headersProcessed;
+		MultipartHeaders headers;
+		
+		Nested() {
+			headersProcessed = false;
+		}
+	};
+	
+	Parser parser;
 	bool headersProcessed;
 	MultipartHeaders currentHeaders;
-	std::string currentHeaderName, currentHeaderValue;
+	
+	// nested[d] parses the body of the current part at depth d, when it is
+	// itself multipart; openLevels of them are in use
+	std::vector<Nested> nested;
+	size_t openLevels;
+	size_t maxDepth;
+	size_t currentDepth;
+	// set when a nested body, or the encoding of part data, is malformed
+	MultipartError readerError;
+	
+	// decoding of the data of the current part, see setTransferDecoding()
+	static constexpr size_t DECODE_BLOCK = 64 * 1024;
+	bool transferDecoding;
+	MultipartTransferDecoder decoder;
+	std::string decoded;
+	// bytes of data of the current part delivered so far, as sent, to
+	// locate decoding errors
+	uint64_t partDataSize;
+	
+	// digest of the data of the current part, see setDigest()
+	MultipartDigest::Algorithm digestAlgorithm;
+	MultipartDigest digest;
 	
 	void resetReaderCallbacks() {
 		onPartBegin = NULL;
 		onPartData  = NULL;
 		onPartEnd   = NULL;
 		onEnd       = NULL;
-        userData    = NULL;
+		userData    = NULL;
+	}
+	
+	void resetNested() {
+		openLevels   = 0;
+		currentDepth = 0;
+		readerError.clear(MultipartError::NONE);
+		decoder.reset(MultipartTransferDecoder::IDENTITY);
+		partDataSize = 0;
+		digest.reset(MultipartDigest::NONE);
 	}
 	
 	void setParserCallbacks() {
-		parser.onPartBegin   = cbPartBegin;
-		parser.onHeaderField = cbHeaderField;
-		parser.onHeaderValue = cbHeaderValue;
-		parser.onHeaderEnd   = cbHeaderEnd;
-		parser.onHeadersEnd  = cbHeadersEnd;
-		parser.onPartData    = cbPartData;
-		parser.onPartEnd     = cbPartEnd;
-		parser.onEnd         = cbEnd;
-		parser.userData      = this;
+		parser.handler().reader = this;
+		parser.handler().depth = 0;
+		for (size_t i = 0; i < nested.size(); i++) {
+			nested[i].parser.handler().reader = this;
+			nested[i].parser.handler().depth = i + 1;
+		}
+	}
+	
+	MultipartHeaders &headersAt(size_t depth) {
+		return depth == 0 ? currentHeaders : nested[depth - 1].headers;
+	}
+	
+	bool &headersProcessedAt(size_t depth) {
+		return depth == 0 ? headersProcessed : nested[depth - 1].headersProcessed;
+	}
+	
+	static bool isMultipart(std::string_view type) {
+		static const char prefix[] = "multipart/";
+		if (type.size() < sizeof(prefix) - 1) {
+			return false;
+		}
+		for (size_t i = 0; i < sizeof(prefix) - 1; i++) {
+			if ((type[i] | 0x20) != prefix[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	bool failed() const {
+		return readerError.code != MultipartError::NONE;
+	}
+	
+	/**
+	 * Offset in the body of the data of the current part at depth: the
+	 * offsets of the data of the parts holding it, up to the outer body,
+	 * add up.
+	 */
+	uint64_t dataOffset(size_t depth) const {
+		uint64_t offset = parser.partDataStart;
+		for (size_t i = 0; i < depth; i++) {
+			offset += nested[i].parser.partDataStart;
+		}
+		return offset;
+	}
+	
+	/**
+	 * Stop the parser, because of the byte at offset in the body. feed()
+	 * adds the context, if the byte is in the buffer it was given.
+	 */
+	void fail(MultipartError::Code code, uint64_t offset, int state, const char *message = NULL) {
+		if (failed()) {
+			return;
+		}
+		readerError.clear(code);
+		if (message != NULL) {
+			readerError.message = message;
+		}
+		readerError.offset = offset;
+		readerError.state = state;
+		parser.pause();
+	}
+	
+	/** Stop the parser, because the nested body at depth is malformed. */
+	void failNested(size_t depth) {
+		if (failed()) {
+			return;
+		}
+		readerError = nested[depth].parser.getError();
+		readerError.offset += dataOffset(depth);
+		parser.pause();
+	}
+	
+	/**
+	 * Start parsing the body of the part at depth, if it is multipart with
+	 * a boundary, instead of delivering it as data.
+	 */
+	void openNested(size_t depth, const MultipartHeaders &headers) {
+		MultipartDisposition contentType;
+		if (!contentType.parse(headers[MultipartHeaders::CONTENT_TYPE])
+		 || !isMultipart(contentType.type) || !contentType.hasBoundary)
+		{
+			return;
+		}
+		
+		// found at the LF ending the headers
+		uint64_t offset = dataOffset(depth) - 1;
+		char boundary[256];
+		if (contentType.boundary.size() > sizeof(boundary)) {
+			fail(MultipartError::NESTED_BOUNDARY_TOO_LONG, offset, Parser::HEADERS_ALMOST_DONE);
+			return;
+		}
+		size_t size = MultipartDisposition::decode(contentType.boundary,
+			contentType.boundaryEncoding, boundary);
+		
+		Nested &level = nested[depth];
+		level.parser.setBoundary(std::string_view(boundary, size));
+		if (level.parser.hasError()) {
+			fail(MultipartError::NESTED_BOUNDARY_TOO_LONG, offset, Parser::HEADERS_ALMOST_DONE);
+			return;
+		}
+		level.headersProcessed = false;
+		level.headers.clear();
+		openLevels = depth + 1;
+	}
+	
+	void feedNested(size_t depth, std::string_view data) {
+		Nested &level = nested[depth];
+		size_t fed = 0;
+		
+		while (fed < data.size() && !level.parser.stopped()) {
+			fed += level.parser.feed(data.substr(fed), data.size() - fed);
+		}
+		if (level.parser.hasError()) {
+			failNested(depth);
+		}
+	}
+	
+	template<typename Parser>
+	static size_t restoreLevel(Parser &parser, bool &headersProcessed,
+		MultipartHeaders &headers, std::string_view data)
+	{
+		size_t used = parser.deserialize(data);
+		if (used == 0) {
+			return 0;
+		}
+		MultipartCheckpoint::Reader reader(data.substr(used));
+		uint64_t processed = reader.number();
+		if (processed > 1 || !headers.deserialize(reader)) {
+			return 0;
+		}
+		headersProcessed = processed;
+		if (headersProcessed) {
+			headers.parseDisposition();
+		}
+		return used + reader.position();
+	}
+	
+	size_t failCheckpoint() {
+		reset();
+		parser.error.clear(MultipartError::BAD_CHECKPOINT);
+		return 0;
+	}
+	
+	void deliverData(const char *data, size_t size) {
+		if (size == 0) {
+			return;
+		}
+		digest.update(data, size);
+		if (onPartData != NULL) {
+			onPartData(data, size, userData);
+		}
 	}
 	
-	static void cbPartBegin(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		self->headersProcessed = false;
-		self->currentHeaders.clear();
-		self->currentHeaderName.clear();
-		self->currentHeaderValue.clear();
+	void decodeData(size_t depth, std::string_view data) {
+		if (decoded.size() < DECODE_BLOCK + MultipartTransferDecoder::SLACK) {
+			decoded.resize(DECODE_BLOCK + MultipartTransferDecoder::SLACK);
+		}
+		for (size_t p = 0; p < data.size(); p += DECODE_BLOCK) {
+			size_t len = std::min(data.size() - p, DECODE_BLOCK);
+			deliverData(&decoded[0], decoder.decode(data.data() + p, len, &decoded[0]));
+			if (decoder.hasError()) {
+				size_t at = p + decoder.getErrorPosition();
+				fail(MultipartError::BAD_TRANSFER_ENCODING, dataOffset(depth) + partDataSize + at,
+					Parser::PART_DATA, decoder.getErrorMessage());
+				readerError.setContext(data, at);
+				return;
+			}
+		}
 	}
 	
-	static void cbHeaderField(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		self->currentHeaderName.append(buffer + start, end - start);
+	void cbPartBegin(size_t depth) {
+		headersProcessedAt(depth) = false;
+		headersAt(depth).clear();
 	}
 	
-	static void cbHeaderValue(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		self->currentHeaderValue.append(buffer + start, end - start);
+	void cbHeaderField(size_t depth, std::string_view data) {
+		headersAt(depth).appendName(data);
 	}
 	
-	static void cbHeaderEnd(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		self->currentHeaders.insert(std::make_pair(self->currentHeaderName,
-			self->currentHeaderValue));
-		self->currentHeaderName.clear();
-		self->currentHeaderValue.clear();
+	void cbHeaderValue(size_t depth, std::string_view data) {
+		headersAt(depth).appendValue(data);
 	}
 	
-	static void cbHeadersEnd(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		if (self->onPartBegin != NULL) {
-			self->onPartBegin(self->currentHeaders, self->userData);
+	void cbHeaderEnd(size_t depth) {
+		headersAt(depth).endHeader();
+	}
+	
+	void cbHeadersEnd(size_t depth) {
+		MultipartHeaders &headers = headersAt(depth);
+		if (failed()) {
+			return;
+		}
+		headers.parseDisposition();
+		headersProcessedAt(depth) = true;
+		currentDepth = depth;
+		if (onPartBegin != NULL) {
+			onPartBegin(headers, userData);
 		}
-		self->currentHeaders.clear();
-		self->currentHeaderName.clear();
-		self->currentHeaderValue.clear();
+		if (depth < maxDepth) {
+			openNested(depth, headers);
+		}
+		if (depth < openLevels) {
+			// its parts have digests of their own, it has none
+			digest.reset(MultipartDigest::NONE);
+			return;
+		}
+		if (transferDecoding) {
+			decoder.reset(MultipartTransferDecoder::encodingOf(
+				headers[MultipartHeaders::CONTENT_TRANSFER_ENCODING]));
+		}
+		partDataSize = 0;
+		digest.reset(digestAlgorithm);
 	}
 	
-	static void cbPartData(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		if (self->onPartData != NULL) {
-			self->onPartData(buffer + start, end - start, self->userData);
+	void cbPartData(size_t depth, std::string_view data) {
+		if (failed()) {
+			return;
+		}
+		if (depth < openLevels) {
+			feedNested(depth, data);
+			return;
 		}
+		currentDepth = depth;
+		if (decoder.getEncoding() != MultipartTransferDecoder::IDENTITY) {
+			decodeData(depth, data);
+		} else {
+			deliverData(data.data(), data.size());
+		}
+		partDataSize += data.size();
 	}
 	
-	static void cbPartEnd(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		if (self->onPartEnd != NULL) {
-			self->onPartEnd(self->userData);
+	void cbPartEnd(size_t depth) {
+		if (failed()) {
+			return;
+		}
+		if (depth < openLevels) {
+			if (!nested[depth].parser.succeeded()) {
+				// at the end of its data, where its last boundary should be
+				Nested &level = nested[depth];
+				fail(MultipartError::NESTED_BODY_UNTERMINATED,
+					dataOffset(depth) + level.parser.bodyOffset, level.parser.state);
+				return;
+			}
+			openLevels = depth;
+			// not that of its last part
+			digest.reset(MultipartDigest::NONE);
+		} else {
+			if (decoder.getEncoding() != MultipartTransferDecoder::IDENTITY) {
+				char tail[MultipartTransferDecoder::SLACK];
+				currentDepth = depth;
+				deliverData(tail, decoder.finish(tail));
+				if (decoder.hasError()) {
+					// at the end of the data
+					fail(MultipartError::BAD_TRANSFER_ENCODING, dataOffset(depth) + partDataSize,
+						Parser::PART_DATA, decoder.getErrorMessage());
+					return;
+				}
+				decoder.reset(MultipartTransferDecoder::IDENTITY);
+			}
+			digest.finish();
+		}
+		currentDepth = depth;
+		if (onPartEnd != NULL) {
+			onPartEnd(userData);
 		}
 	}
 	
-	static void cbEnd(const char *buffer, size_t start, size_t end, void *userData) {
-		MultipartReader *self = (MultipartReader *) userData;
-		if (self->onEnd != NULL) {
-			self->onEnd(self->userData);
+	void cbEnd(size_t depth) {
+		// the end of a nested body is told by the end of its part
+		if (depth > 0 || failed()) {
+			return;
+		}
+		currentDepth = 0;
+		if (onEnd != NULL) {
+			onEnd(userData);
 		}
 	}
 	
@@ -113,44 +823,317 @@ public:
 	PartDataCallback onPartData;
 	Callback onPartEnd;
 	Callback onEnd;
-    void *userData;
+	void *userData;
 	
 	MultipartReader() {
+		headersProcessed = false;
+		maxDepth = 0;
+		transferDecoding = false;
+		digestAlgorithm = MultipartDigest::NONE;
+		resetNested();
 		resetReaderCallbacks();
 		setParserCallbacks();
 	}
 	
-	MultipartReader(const std::string &boundary): parser(boundary) {
+	MultipartReader(std::string_view boundary): parser(boundary) {
+		headersProcessed = false;
+		maxDepth = 0;
+		transferDecoding = false;
+		digestAlgorithm = MultipartDigest::NONE;
+		resetNested();
 		resetReaderCallbacks();
 		setParserCallbacks();
 	}
 	
+	/*
+	 * Copies and moves are those of the members, except that the parser
+	 * must call back the new reader rather than the one it came from.
+	 * Moves do not allocate, so readers can be kept in containers. A
+	 * reader moved from has a maximum depth of 0, as its nested parsers
+	 * are gone.
+	 */
+	MultipartReader(const MultipartReader &other) {
+		*this = other;
+	}
+	
+	MultipartReader(MultipartReader &&other) noexcept {
+		*this = std::move(other);
+	}
+	
+	MultipartReader &operator=(const MultipartReader &other) {
+		onPartBegin      = other.onPartBegin;
+		onPartData       = other.onPartData;
+		onPartEnd        = other.onPartEnd;
+		onEnd            = other.onEnd;
+		userData         = other.userData;
+		parser           = other.parser;
+		headersProcessed = other.headersProcessed;
+		currentHeaders   = other.currentHeaders;
+		nested           = other.nested;
+		openLevels       = other.openLevels;
+		maxDepth         = other.maxDepth;
+		currentDepth     = other.currentDepth;
+		readerError      = other.readerError;
+		transferDecoding = other.transferDecoding;
+		decoder          = other.decoder;
+		partDataSize     = other.partDataSize;
+		digestAlgorithm  = other.digestAlgorithm;
+		digest           = other.digest;
+		setParserCallbacks();
+		return *this;
+	}
+	
+	MultipartReader &operator=(MultipartReader &&other) noexcept {
+		onPartBegin      = other.onPartBegin;
+		onPartData       = other.onPartData;
+		onPartEnd        = other.onPartEnd;
+		onEnd            = other.onEnd;
+		userData         = other.userData;
+		parser           = std::move(other.parser);
+		headersProcessed = other.headersProcessed;
+		currentHeaders   = std::move(other.currentHeaders);
+		nested           = std::move(other.nested);
+		openLevels       = other.openLevels;
+		maxDepth         = other.maxDepth;
+		currentDepth     = other.currentDepth;
+		readerError      = other.readerError;
+		transferDecoding = other.transferDecoding;
+		decoder          = other.decoder;
+		partDataSize     = other.partDataSize;
+		digestAlgorithm  = other.digestAlgorithm;
+		digest           = other.digest;
+		setParserCallbacks();
+		// the nested parsers went along, other must not descend anymore
+		other.nested.clear();
+		other.openLevels = 0;
+		other.maxDepth = 0;
+		other.currentDepth = 0;
+		return *this;
+	}
+	
+	/** Forget the body and boundary, keeping the memory used for headers. */
 	void reset() {
 		parser.reset();
+		headersProcessed = false;
+		currentHeaders.clear();
+		resetNested();
 	}
 	
-	void setBoundary(const std::string &boundary) {
+	void setBoundary(std::string_view boundary) {
+		reset();
 		parser.setBoundary(boundary);
 	}
 	
 	size_t feed(const char *buffer, size_t len) {
-		return parser.feed(buffer, len);
+		if (failed()) {
+			return 0;
+		}
+		uint64_t start = parser.bodyOffset;
+		size_t fed = parser.feed(std::string_view(buffer, len), len);
+		if (failed() && readerError.contextSize == 0
+		 && readerError.offset >= start && readerError.offset - start < len)
+		{
+			readerError.setContext(std::string_view(buffer, len), readerError.offset - start);
+		}
+		return fed;
 	}
 	
 	bool succeeded() const {
-		return parser.succeeded();
+		return parser.succeeded() && !failed();
 	}
 	
 	bool hasError() const {
-		return parser.hasError();
+		return parser.hasError() || failed();
 	}
 	
 	bool stopped() const {
-		return parser.stopped();
+		return parser.stopped() || failed();
+	}
+	
+	/**
+	 * Descend into parts whose Content-Type is multipart/something with a
+	 * boundary, up to depth levels deep: the body of such a part is not
+	 * given to onPartData, its own parts are reported instead, between its
+	 * onPartBegin and onPartEnd, and depth() tells them apart. The part data
+	 * is parsed as the outer parser delivers it, while it is still in
+	 * cache, so the body is read once. 0, the default, treats every part as
+	 * data. Set it before feeding; it is kept by reset().
+	 *
+	 * Like the outer parser, a nested one expects its body to start with
+	 * the first boundary. pause() from a nested part takes effect once the
+	 * outer parser is done with the data it was delivering.
+	 */
+	void setMaxDepth(size_t depth) {
+		maxDepth = depth;
+		if (nested.size() < depth) {
+			// allocated once, so that headers handed out never move
+			nested.resize(depth);
+			setParserCallbacks();
+			setMinDataChunk(parser.minDataChunk);
+			setLimits(parser.getLimits());
+		}
+	}
+	
+	/**
+	 * Decode the data of parts sent with a Content-Transfer-Encoding of
+	 * base64 or quoted-printable, as it is parsed: onPartData then gets the
+	 * decoded bytes, from a buffer of the reader, in pieces of at most 48 KB
+	 * for base64. Other encodings are delivered as is. Malformed base64
+	 * fails the reader. Off by default; it is kept by reset().
+	 */
+	void setTransferDecoding(bool enabled) {
+		transferDecoding = enabled;
+	}
+	
+	/**
+	 * Compute a digest of the data of each part, as it is delivered:
+	 * getDigest() returns it from onPartEnd. It covers the decoded data
+	 * when transfer decoding is on. A multipart part that is descended
+	 * into has no digest of its own: from its onPartEnd, getDigest() has
+	 * the algorithm NONE. NONE, the default, turns it off; it is kept by
+	 * reset().
+	 */
+	void setDigest(MultipartDigest::Algorithm algorithm) {
+		digestAlgorithm = algorithm;
+	}
+	
+	/**
+	 * Called from onPartEnd, digest of the data of the part ending, see
+	 * setDigest(). From other callbacks, it is not finished yet.
+	 */
+	const MultipartDigest &getDigest() const {
+		return digest;
+	}
+	
+	/**
+	 * Called from a callback, nesting level of the part it is about: 0 for
+	 * the parts of the body, 1 for the parts of a multipart part, etc.
+	 */
+	size_t depth() const {
+		return currentDepth;
+	}
+	
+	/** See MultipartParser::setMinDataChunk(). */
+	void setMinDataChunk(size_t size) {
+		parser.setMinDataChunk(size);
+		for (size_t i = 0; i < nested.size(); i++) {
+			nested[i].parser.setMinDataChunk(size);
+		}
+	}
+	
+	/**
+	 * See MultipartParser::setLimits(). Nested bodies are held to the same
+	 * limits, each on its own, within those of the part holding them.
+	 */
+	void setLimits(const MultipartLimits &limits) {
+		parser.setLimits(limits);
+		for (size_t i = 0; i < nested.size(); i++) {
+			nested[i].parser.setLimits(limits);
+		}
+	}
+	
+	/** See MultipartParser::getLimitExceeded(), nested bodies included. */
+	MultipartLimits::Kind getLimitExceeded() const {
+		return getError().limit();
+	}
+	
+	/** Called from a callback, make feed() return early, see MultipartParser::pause(). */
+	void pause() {
+		parser.pause();
+	}
+	
+	/** See MultipartParser::resume(). */
+	void resume() {
+		parser.resume();
+	}
+	
+	bool isPaused() const {
+		return parser.isPaused() && !failed();
+	}
+	
+	/**
+	 * See MultipartParser::serialize(). The headers of the current part
+	 * are included, even if only partly received, and so are the nested
+	 * bodies being parsed. Callbacks and the maximum depth are not.
+	 */
+	bool serialize(std::string &out) const {
+		if (failed() || !parser.serialize(out)) {
+			return false;
+		}
+		MultipartCheckpoint::Writer writer(out);
+		writer.number(headersProcessed);
+		currentHeaders.serialize(writer);
+		writer.number(openLevels);
+		for (size_t i = 0; i < openLevels; i++) {
+			nested[i].parser.serialize(out);
+			writer.number(nested[i].headersProcessed);
+			nested[i].headers.serialize(writer);
+		}
+		decoder.serialize(writer);
+		writer.number(partDataSize);
+		digest.serialize(writer);
+		return true;
+	}
+	
+	/**
+	 * See MultipartParser::deserialize(). Nested bodies are only restored
+	 * up to the maximum depth set with setMaxDepth().
+	 */
+	size_t deserialize(std::string_view data) {
+		resetNested();
+		size_t used = restoreLevel(parser, headersProcessed, currentHeaders, data);
+		if (used == 0) {
+			return failCheckpoint();
+		}
+		MultipartCheckpoint::Reader reader(data.substr(used));
+		uint64_t levels = reader.number();
+		if (reader.failed() || levels > maxDepth) {
+			return failCheckpoint();
+		}
+		used += reader.position();
+		for (size_t i = 0; i < levels; i++) {
+			size_t size = restoreLevel(nested[i].parser, nested[i].headersProcessed,
+				nested[i].headers, data.substr(used));
+			if (size == 0) {
+				return failCheckpoint();
+			}
+			used += size;
+		}
+		MultipartCheckpoint::Reader tail(data.substr(used));
+		if (!decoder.deserialize(tail)) {
+			return failCheckpoint();
+		}
+		partDataSize = tail.number();
+		if (tail.failed() || !digest.deserialize(tail)) {
+			return failCheckpoint();
+		}
+		openLevels = levels;
+		return used + tail.position();
 	}
 	
+	#if MULTIPART_STATS > 0
+		/** See MultipartStats.h. */
+		const MultipartStats &getStats() const {
+			return parser.stats;
+		}
+	#endif
+	
 	const char *getErrorMessage() const {
-		return parser.getErrorMessage();
+		return getError().message;
+	}
+	
+	/**
+	 * See MultipartParser::getError(). Errors of nested bodies are told
+	 * with their offset in the outer body, and so are those found by the
+	 * reader itself: a malformed base64 character, the end of a nested
+	 * body or of base64 data that is cut short, or the end of the headers
+	 * of a part with a nested boundary too long.
+	 */
+	const MultipartError &getError() const {
+		if (failed()) {
+			return readerError;
+		}
+		return parser.getError();
 	}
 };
 
@@ -0,0 +1,106 @@
+#ifndef _MULTIPART_READER_POOL_H_
+#define _MULTIPART_READER_POOL_H_
+
+#include <sys/types.h>
+#include <string_view>
+#include <vector>
+#include "MultipartReader.h"
+
+/**
+ * Readers kept for reuse, so that setting one up for a request allocates
+ * nothing: boundary and lookbehind are stored inline in the parser, and a
+ * reader given back keeps the memory its headers grew to.
+ *
+ *   MultipartReader *reader = MultipartReaderPool::local().acquire(boundary);
+ *   reader->onPartData = ...;
+ *   ...
+ *   MultipartReaderPool::local().release(reader);
+ *
+ * local() is the pool of the calling thread, so nothing is locked. A reader
+ * may be released to another pool than the one it came from.
+ */
+class MultipartReaderPool {
+private:
+	std::vector<MultipartReader *> idle;
+	size_t capacity;
+
+public:
+	static const size_t DEFAULT_CAPACITY = 64;
+
+	MultipartReaderPool(size_t capacity = DEFAULT_CAPACITY) {
+		this->capacity = capacity;
+		idle.reserve(capacity);
+	}
+
+	MultipartReaderPool(const MultipartReaderPool &) = delete;
+	MultipartReaderPool &operator=(const MultipartReaderPool &) = delete;
+
+	~MultipartReaderPool() {
+		for (size_t i = 0; i < idle.size(); i++) {
+			delete idle[i];
+		}
+	}
+
+	/** The pool of the calling thread, destroyed when it exits. */
+	static MultipartReaderPool &local() {
+		static thread_local MultipartReaderPool pool;
+		return pool;
+	}
+
+	/**
+	 * A reader ready to parse a body delimited by boundary, with no
+	 * callbacks set. Only allocates when the pool is empty. Check
+	 * hasError() if the boundary comes from the request: it fails if it is
+	 * too long.
+	 */
+	MultipartReader *acquire(std::string_view boundary) {
+		MultipartReader *reader;
+		if (idle.empty()) {
+			reader = new MultipartReader();
+		} else {
+			reader = idle.back();
+			idle.pop_back();
+		}
+		reader->setBoundary(boundary);
+		return reader;
+	}
+
+	/** Give back a reader from acquire(), which must not be used anymore. */
+	void release(MultipartReader *reader) {
+		if (reader == NULL) {
+			return;
+		}
+		if (idle.size() >= capacity) {
+			delete reader;
+			return;
+		}
+		reader->reset();
+		reader->setMinDataChunk(0);
+		reader->setMaxDepth(0);
+		reader->setTransferDecoding(false);
+		reader->setDigest(MultipartDigest::NONE);
+		reader->setLimits(MultipartLimits());
+		reader->onPartBegin = NULL;
+		reader->onPartData  = NULL;
+		reader->onPartEnd   = NULL;
+		reader->onEnd       = NULL;
+		reader->userData    = NULL;
+		idle.push_back(reader);
+	}
+
+	/** Readers kept beyond capacity are freed when released. */
+	void setCapacity(size_t capacity) {
+		this->capacity = capacity;
+		while (idle.size() > capacity) {
+			delete idle.back();
+			idle.pop_back();
+		}
+	}
+
+	/** Number of idle readers. */
+	size_t size() const {
+		return idle.size();
+	}
+};
+
+#endif /* _MULTIPART_READER_POOL_H_ */
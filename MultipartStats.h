@@ -0,0 +1,93 @@
+#ifndef _MULTIPART_STATS_H_
+#define _MULTIPART_STATS_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cstdio>
+#include "MultipartHandler.h"
+
+/**
+ * Counters of what the parser did with its input, to find out why a body
+ * parses slowly.
+ *
+ * MULTIPART_STATS selects what is counted, at compile time:
+ *   0  nothing, the parser has no stats member (default)
+ *   1  counters
+ *   2  same, plus the time spent in callbacks, which costs two clock
+ *      reads per callback
+ *
+ * The parser clears its stats on reset(), so they cover one body. A body
+ * that stays on the fast path has nearly all of its data skipped; false
+ * candidates (prefixes of the boundary in the data) each cost a state
+ * machine step per matched byte and an extra callback.
+ */
+#ifndef MULTIPART_STATS
+	#define MULTIPART_STATS 0
+#endif
+
+struct MultipartStats {
+	uint64_t bytesSkipped;       // part data passed over by the boundary search
+	uint64_t bytesStepped;       // steps of the state machine, about one per byte
+	uint64_t headerBytes;        // bytes of header lines
+	uint64_t candidates;         // positions where the search stopped
+	uint64_t falseCandidates;    // ... that turned out not to be a boundary
+	uint64_t lookbehindFlushes;  // false candidates begun in a previous buffer
+	uint64_t lookbehindBytes;    // data delivered from the lookbehind buffer
+	uint64_t parts;              // parts ended
+	uint64_t callbacks[MultipartEvent::END + 1];  // per MultipartEvent::Type
+	uint64_t callbackNanoseconds;  // MULTIPART_STATS 2 only
+
+	MultipartStats() {
+		clear();
+	}
+
+	void clear() {
+		bytesSkipped = 0;
+		bytesStepped = 0;
+		headerBytes = 0;
+		candidates = 0;
+		falseCandidates = 0;
+		lookbehindFlushes = 0;
+		lookbehindBytes = 0;
+		parts = 0;
+		for (int i = 0; i <= MultipartEvent::END; i++) {
+			callbacks[i] = 0;
+		}
+		callbackNanoseconds = 0;
+	}
+
+	/** Sum of the stats of several parsers. */
+	MultipartStats &operator+=(const MultipartStats &other) {
+		bytesSkipped += other.bytesSkipped;
+		bytesStepped += other.bytesStepped;
+		headerBytes += other.headerBytes;
+		candidates += other.candidates;
+		falseCandidates += other.falseCandidates;
+		lookbehindFlushes += other.lookbehindFlushes;
+		lookbehindBytes += other.lookbehindBytes;
+		parts += other.parts;
+		for (int i = 0; i <= MultipartEvent::END; i++) {
+			callbacks[i] += other.callbacks[i];
+		}
+		callbackNanoseconds += other.callbackNanoseconds;
+		return *this;
+	}
+
+	void print(FILE *f) const {
+		fprintf(f, "bytes skipped       %llu\n", (unsigned long long) bytesSkipped);
+		fprintf(f, "bytes stepped       %llu\n", (unsigned long long) bytesStepped);
+		fprintf(f, "header bytes        %llu\n", (unsigned long long) headerBytes);
+		fprintf(f, "candidates          %llu\n", (unsigned long long) candidates);
+		fprintf(f, "false candidates    %llu\n", (unsigned long long) falseCandidates);
+		fprintf(f, "lookbehind flushes  %llu\n", (unsigned long long) lookbehindFlushes);
+		fprintf(f, "lookbehind bytes    %llu\n", (unsigned long long) lookbehindBytes);
+		fprintf(f, "parts               %llu\n", (unsigned long long) parts);
+		for (int i = 0; i <= MultipartEvent::END; i++) {
+			fprintf(f, "%-19s %llu\n", MultipartEvent::name((MultipartEvent::Type) i),
+				(unsigned long long) callbacks[i]);
+		}
+		fprintf(f, "callback time (ns)  %llu\n", (unsigned long long) callbackNanoseconds);
+	}
+};
+
+#endif /* _MULTIPART_STATS_H_ */
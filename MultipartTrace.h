@@ -0,0 +1,117 @@
+#ifndef _MULTIPART_TRACE_H_
+#define _MULTIPART_TRACE_H_
+
+#include <sys/types.h>
+#include <cstdio>
+
+/**
+ * Tracing of the parser, for debugging.
+ *
+ * MULTIPART_TRACE_LEVEL selects what the parser reports, at compile time:
+ *   0  nothing, every trace point compiles to nothing (default)
+ *   1  state transitions and errors
+ *   2  same, plus every callback with the span it covers
+ *
+ * Events are handed to the parser's onTrace sink, nothing is printed by the
+ * parser itself. MultipartTraceRing is a ready-made sink keeping the last
+ * events in memory, to be dumped once something went wrong.
+ */
+#ifndef MULTIPART_TRACE_LEVEL
+	#define MULTIPART_TRACE_LEVEL 0
+#endif
+
+struct MultipartTraceEvent {
+	enum Kind {
+		STATE,
+		CALLBACK,
+		ERROR
+	};
+
+	Kind kind;
+	int from;          // STATE: previous parser state
+	int to;            // STATE: new parser state
+	const char *name;  // CALLBACK: callback name, ERROR: error message
+	size_t offset;     // absolute offset in the stream of the byte involved
+	size_t length;     // CALLBACK: length of the span given to the callback
+
+	/** Name of a parser state, in the order of MultipartParser::State. */
+	static const char *stateName(int state) {
+		static const char *names[] = {
+			"ERROR",
+			"START",
+			"START_BOUNDARY",
+			"HEADER_FIELD_START",
+			"HEADER_FIELD",
+			"HEADER_VALUE_START",
+			"HEADER_VALUE",
+			"HEADER_VALUE_ALMOST_DONE",
+			"HEADERS_ALMOST_DONE",
+			"PART_DATA_START",
+			"PART_DATA",
+			"PART_END",
+			"END"
+		};
+		if (state < 0 || state >= (int) (sizeof(names) / sizeof(names[0]))) {
+			return "?";
+		}
+		return names[state];
+	}
+
+	void print(FILE *f) const {
+		switch (kind) {
+		case STATE:
+			fprintf(f, "%10zu  %s -> %s\n", offset, stateName(from), stateName(to));
+			break;
+		case CALLBACK:
+			fprintf(f, "%10zu  %s (%zu bytes)\n", offset, name, length);
+			break;
+		case ERROR:
+			fprintf(f, "%10zu  error: %s\n", offset, name);
+			break;
+		}
+	}
+};
+
+/**
+ * Trace sink remembering the last SIZE events in a ring buffer.
+ * Use it as onTrace with the ring as trace user data.
+ */
+template<size_t SIZE = 64>
+class MultipartTraceRing {
+private:
+	MultipartTraceEvent events[SIZE];
+	size_t count;
+
+public:
+	MultipartTraceRing() {
+		count = 0;
+	}
+
+	static void record(const MultipartTraceEvent &event, void *userData) {
+		MultipartTraceRing *self = (MultipartTraceRing *) userData;
+		self->events[self->count % SIZE] = event;
+		self->count++;
+	}
+
+	void clear() {
+		count = 0;
+	}
+
+	size_t size() const {
+		return count < SIZE ? count : SIZE;
+	}
+
+	/** i-th remembered event, 0 being the oldest. */
+	const MultipartTraceEvent &operator[](size_t i) const {
+		size_t first = count < SIZE ? 0 : count - SIZE;
+		return events[(first + i) % SIZE];
+	}
+
+	void dump(FILE *f) const {
+		for (size_t i = 0; i < size(); i++) {
+			(*this)[i].print(f);
+		}
+	}
+};
+
+#endif /* _MULTIPART_TRACE_H_ */
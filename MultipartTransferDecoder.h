@@ -0,0 +1,482 @@
+#ifndef _MULTIPART_TRANSFER_DECODER_H_
+#define _MULTIPART_TRANSFER_DECODER_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+#include "MultipartCheckpoint.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define MULTIPART_HAVE_X86_SIMD 1
+#endif
+
+/**
+ * Streaming decoder for the Content-Transfer-Encoding of a part (RFC 2045):
+ * base64 and quoted-printable. Data can be cut anywhere, the few characters
+ * of an incomplete group are carried over to the next call.
+ *
+ * Base64 is decoded 16 or 32 characters at a time with SSSE3 or AVX2 when
+ * the CPU has them, using nibble lookup tables to translate and validate
+ * the characters (the technique of Muła and Lemire). Blocks holding line
+ * breaks or padding, and the ends of lines, go through the scalar loop.
+ * Quoted-printable data is mostly literal, so it is copied by runs found
+ * with memchr.
+ *
+ * Malformed base64 (a character out of the alphabet, data after padding,
+ * a lone character at the end) is an error. Quoted-printable is decoded
+ * leniently, as RFC 2045 suggests: an '=' that does not start an escape is
+ * kept as is.
+ */
+class MultipartTransferDecoder {
+public:
+	enum Encoding {
+		IDENTITY,         // 7bit, 8bit, binary, or unknown
+		BASE64,
+		QUOTED_PRINTABLE
+	};
+
+	typedef size_t (*Kernel)(const char *in, size_t len, char *out, size_t *used);
+
+	// decode() output needs this much more room than the input size
+	static const size_t SLACK = 32;
+
+private:
+	static const unsigned char INVALID = 0xff;
+	static const unsigned char SPACE   = 0xfe;  // skipped
+	static const unsigned char PAD     = 0xfd;
+
+	struct Table {
+		unsigned char values[256];
+	};
+
+	static Table buildTable() {
+		static const char alphabet[] =
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		Table table;
+		for (int c = 0; c < 256; c++) {
+			table.values[c] = INVALID;
+		}
+		for (int i = 0; i < 64; i++) {
+			table.values[(unsigned char) alphabet[i]] = i;
+		}
+		table.values['\r'] = table.values['\n'] = SPACE;
+		table.values[' '] = table.values['\t'] = SPACE;
+		table.values['='] = PAD;
+		return table;
+	}
+
+	static const unsigned char *table() {
+		static const Table built = buildTable();
+		return built.values;
+	}
+
+	static int hexValue(char c) {
+		if (c >= '0' && c <= '9') {
+			return c - '0';
+		}
+		if (c >= 'A' && c <= 'F') {
+			return c - 'A' + 10;
+		}
+		if (c >= 'a' && c <= 'f') {
+			return c - 'a' + 10;
+		}
+		return -1;
+	}
+
+	static bool equalsIgnoreCase(std::string_view a, const char *b) {
+		size_t len = strlen(b);
+		if (a.size() != len) {
+			return false;
+		}
+		for (size_t i = 0; i < len; i++) {
+			if ((a[i] | 0x20) != b[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+#ifdef MULTIPART_HAVE_X86_SIMD
+	/*
+	 * Both kernels decode whole blocks of alphabet characters, and stop at
+	 * the first block holding anything else. used is set to the number of
+	 * characters consumed, a multiple of 16 or 32.
+	 */
+	__attribute__((target("ssse3")))
+	static size_t decodeSSSE3(const char *in, size_t len, char *out, size_t *used) {
+		const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+		const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+		const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+		const __m128i mask2F = _mm_set1_epi8(0x2f);
+		const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+			-1, -1, -1, -1);
+		size_t p = 0, o = 0;
+
+		while (p + 16 <= len) {
+			__m128i block = _mm_loadu_si128((const __m128i *) (in + p));
+			__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(block, 4), mask2F);
+			__m128i lo = _mm_shuffle_epi8(lutLo, _mm_and_si128(block, mask2F));
+			__m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) {
+				break;
+			}
+			__m128i roll = _mm_shuffle_epi8(lutRoll,
+				_mm_add_epi8(_mm_cmpeq_epi8(block, mask2F), hiNibbles));
+			__m128i values = _mm_add_epi8(block, roll);
+			// 4 x 6 bits -> 3 bytes, in each 32 bit lane
+			__m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+			merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+			_mm_storeu_si128((__m128i *) (out + o), _mm_shuffle_epi8(merged, pack));
+			p += 16;
+			o += 12;
+		}
+		*used = p;
+		return o;
+	}
+
+	__attribute__((target("avx2")))
+	static size_t decodeAVX2(const char *in, size_t len, char *out, size_t *used) {
+		const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+		const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+		const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+		const __m256i mask2F = _mm256_set1_epi8(0x2f);
+		const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+			-1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+			-1, -1, -1, -1);
+		// the 12 bytes of each 128 bit lane, side by side
+		const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+		size_t p = 0, o = 0;
+
+		while (p + 32 <= len) {
+			__m256i block = _mm256_loadu_si256((const __m256i *) (in + p));
+			__m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(block, 4), mask2F);
+			__m256i lo = _mm256_shuffle_epi8(lutLo, _mm256_and_si256(block, mask2F));
+			__m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+			if (!_mm256_testz_si256(lo, hi)) {
+				break;
+			}
+			__m256i roll = _mm256_shuffle_epi8(lutRoll,
+				_mm256_add_epi8(_mm256_cmpeq_epi8(block, mask2F), hiNibbles));
+			__m256i values = _mm256_add_epi8(block, roll);
+			__m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+			merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+			merged = _mm256_shuffle_epi8(merged, pack);
+			_mm256_storeu_si256((__m256i *) (out + o),
+				_mm256_permutevar8x32_epi32(merged, join));
+			p += 32;
+			o += 24;
+		}
+		size_t rest;
+		o += decodeSSSE3(in + p, len - p, out + o, &rest);
+		*used = p + rest;
+		return o;
+	}
+#endif
+
+	static Kernel selectKernel() {
+		#ifdef MULTIPART_HAVE_X86_SIMD
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2")) {
+				return decodeAVX2;
+			}
+			if (__builtin_cpu_supports("ssse3")) {
+				return decodeSSSE3;
+			}
+		#endif
+		return NULL;
+	}
+
+	Encoding encoding;
+	Kernel kernel;
+	// base64: bits of the incomplete group, how many characters it has, and
+	// whether padding was seen
+	uint32_t bits;
+	unsigned count;
+	bool padded;
+	// quoted-printable: characters of an incomplete escape, from its '='
+	char pending[3];
+	unsigned pendingSize;
+	const char *errorReason;
+	size_t errorPosition;
+
+	size_t fail(const char *message, size_t position) {
+		errorReason = message;
+		errorPosition = position;
+		return 0;
+	}
+
+	// the kernel takes runs of whole groups, the rest is decoded here
+	size_t decodeBase64(const char *in, size_t len, char *out) {
+		const unsigned char *values = table();
+		size_t p = 0, o = 0;
+		// once the kernel stopped, there is no point trying it again before
+		// the end of the line
+		bool vector = kernel != NULL;
+
+		while (p < len) {
+			if (vector && count == 0 && !padded && len - p >= 16) {
+				size_t used;
+				o += kernel(in + p, len - p, out + o, &used);
+				p += used;
+				if (p == len) {
+					break;
+				}
+				vector = false;
+			}
+			unsigned char value = values[(unsigned char) in[p++]];
+			if (value < 64) {
+				if (padded) {
+					return fail("Malformed base64 data: data after padding.", p - 1);
+				}
+				bits = (bits << 6) | value;
+				if (++count == 4) {
+					out[o++] = (char) (bits >> 16);
+					out[o++] = (char) (bits >> 8);
+					out[o++] = (char) bits;
+					bits = 0;
+					count = 0;
+				}
+			} else if (value == PAD) {
+				if (!padded) {
+					if (count < 2) {
+						return fail("Malformed base64 data: misplaced padding.", p - 1);
+					}
+					o += flushBase64(out + o);
+					padded = true;
+				}
+			} else if (value == SPACE) {
+				vector = kernel != NULL;
+			} else {
+				return fail("Malformed base64 data: invalid character.", p - 1);
+			}
+		}
+		return o;
+	}
+
+	// bytes of an incomplete group of 2 or 3 characters
+	size_t flushBase64(char *out) {
+		size_t o = 0;
+		if (count == 2) {
+			out[o++] = (char) (bits >> 4);
+		} else if (count == 3) {
+			out[o++] = (char) (bits >> 10);
+			out[o++] = (char) (bits >> 2);
+		}
+		bits = 0;
+		count = 0;
+		return o;
+	}
+
+	/**
+	 * Decode the escape in esc, of size 1 to 3 and starting with '='.
+	 * Returns its size, or 0 if more characters are needed.
+	 */
+	static size_t decodeEscape(const char *esc, size_t size, char *out, size_t &o) {
+		if (size < 2) {
+			return 0;
+		}
+		if (esc[1] == '\n') {
+			return 2;
+		}
+		if (esc[1] == '\r') {
+			if (size < 3) {
+				return 0;
+			}
+			return esc[2] == '\n' ? 3 : 2;
+		}
+		if (size < 3) {
+			return 0;
+		}
+		int high = hexValue(esc[1]), low = hexValue(esc[2]);
+		if (high >= 0 && low >= 0) {
+			out[o++] = (char) (high * 16 + low);
+			return 3;
+		}
+		// not an escape, the '=' is literal
+		out[o++] = '=';
+		return 1;
+	}
+
+	size_t decodeQuotedPrintable(const char *in, size_t len, char *out) {
+		size_t p = 0, o = 0;
+
+		// complete the escape left incomplete by the previous call
+		while (pendingSize > 0) {
+			size_t size = 1;
+			if (pending[0] != '=') {
+				out[o++] = pending[0];
+			} else if ((size = decodeEscape(pending, pendingSize, out, o)) == 0) {
+				if (p == len) {
+					return o;
+				}
+				pending[pendingSize++] = in[p++];
+				continue;
+			}
+			pendingSize -= size;
+			memmove(pending, pending + size, pendingSize);
+		}
+
+		while (p < len) {
+			const char *equal = (const char *) memchr(in + p, '=', len - p);
+			size_t run = (equal == NULL ? len : equal - in) - p;
+			memcpy(out + o, in + p, run);
+			o += run;
+			p += run;
+			if (p == len) {
+				break;
+			}
+			size_t size = decodeEscape(in + p, std::min(len - p, (size_t) 3), out, o);
+			if (size == 0) {
+				pendingSize = len - p;
+				memcpy(pending, in + p, pendingSize);
+				break;
+			}
+			p += size;
+		}
+		return o;
+	}
+
+public:
+	MultipartTransferDecoder() {
+		static const Kernel selected = selectKernel();
+		kernel = selected;
+		reset(IDENTITY);
+	}
+
+	/** Encoding named by a Content-Transfer-Encoding header value. */
+	static Encoding encodingOf(std::string_view value) {
+		while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+			value.remove_prefix(1);
+		}
+		while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+			value.remove_suffix(1);
+		}
+		if (equalsIgnoreCase(value, "base64")) {
+			return BASE64;
+		}
+		if (equalsIgnoreCase(value, "quoted-printable")) {
+			return QUOTED_PRINTABLE;
+		}
+		return IDENTITY;
+	}
+
+	/** Get ready for the data of a new part. */
+	void reset(Encoding encoding) {
+		this->encoding = encoding;
+		bits = 0;
+		count = 0;
+		padded = false;
+		pendingSize = 0;
+		errorReason = NULL;
+		errorPosition = 0;
+	}
+
+	Encoding getEncoding() const {
+		return encoding;
+	}
+
+	/**
+	 * Decode the next len characters into out, which must have room for
+	 * len + SLACK bytes. Returns the number of bytes decoded; check
+	 * hasError(), after which nothing more is decoded.
+	 */
+	size_t decode(const char *in, size_t len, char *out) {
+		if (errorReason != NULL) {
+			return 0;
+		}
+		switch (encoding) {
+		case BASE64:
+			return decodeBase64(in, len, out);
+		case QUOTED_PRINTABLE:
+			return decodeQuotedPrintable(in, len, out);
+		default:
+			memcpy(out, in, len);
+			return len;
+		}
+	}
+
+	/**
+	 * At the end of the part: the bytes of a group left incomplete, into
+	 * out, which must have room for SLACK bytes. Unpadded base64 is
+	 * accepted.
+	 */
+	size_t finish(char *out) {
+		size_t o = 0;
+		if (errorReason != NULL) {
+			return 0;
+		}
+		if (encoding == BASE64) {
+			if (count == 1) {
+				return fail("Malformed base64 data: truncated.", 0);
+			}
+			o = flushBase64(out);
+		} else if (encoding == QUOTED_PRINTABLE) {
+			// an escape cut by the end of the part: keep what there is
+			memcpy(out, pending, pendingSize);
+			o = pendingSize;
+			pendingSize = 0;
+		}
+		return o;
+	}
+
+	bool hasError() const {
+		return errorReason != NULL;
+	}
+
+	const char *getErrorMessage() const {
+		return errorReason != NULL ? errorReason : "No error.";
+	}
+
+	/**
+	 * Index of the malformed character in the input of the decode() call
+	 * that failed. An error found by finish() is at the end of the data,
+	 * and has none: it is 0.
+	 */
+	size_t getErrorPosition() const {
+		return errorPosition;
+	}
+
+	void serialize(MultipartCheckpoint::Writer &writer) const {
+		writer.number(encoding);
+		writer.number(bits);
+		writer.number(count | (padded << 2));
+		writer.bytes(std::string_view(pending, pendingSize));
+	}
+
+	bool deserialize(MultipartCheckpoint::Reader &reader) {
+		uint64_t savedEncoding = reader.number();
+		uint64_t savedBits = reader.number();
+		uint64_t savedCount = reader.number();
+		std::string_view savedPending = reader.bytes();
+		if (reader.failed() || savedEncoding > QUOTED_PRINTABLE || savedBits > 0xffffff
+		 || savedCount > 7 || savedPending.size() >= sizeof(pending))
+		{
+			return false;
+		}
+		reset((Encoding) savedEncoding);
+		bits = savedBits;
+		count = savedCount & 3;
+		padded = savedCount & 4;
+		pendingSize = savedPending.size();
+		memcpy(pending, savedPending.data(), pendingSize);
+		return true;
+	}
+};
+
+#endif /* _MULTIPART_TRANSFER_DECODER_H_ */
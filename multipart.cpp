@@ -1,164 +1,405 @@
 #include "MultipartParser.h"
 #include "MultipartReader.h"
-#include <sys/stat.h>
-#include <sys/time.h>
+#include "MultipartParallel.h"
 #include <sys/types.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
-#include <unistd.h>
 #include <cstdlib>
 #include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
 
-//#define TEST_PARSER
-#define INPUT_FILE "input3.txt"
-//#define BOUNDARY "abcd"
-#define BOUNDARY "-----------------------------168072824752491622650073"
-#define TIMES 10
-#define SLURP
-#define QUIET
-
+/*
+ * Benchmark suite. Corpora are generated in memory with a fixed seed, so
+ * runs are comparable across machines and commits, and each one is fed to
+ * the parser and the reader with several chunk sizes.
+ *
+ * usage: multipart [-s size_mb] [-w warmup] [-r repeats] [-f filter] [-t threads]
+ *
+ * For every corpus, target and chunk size, it reports the median
+ * throughput with its spread over the repeats, and per MB of input, the
+ * number of callbacks and of allocations.
+ *
+ * The index and parallel targets build a MultipartIndex of the whole body
+ * with parseContiguous(), on one thread and on -t threads (all the cores
+ * by default) with MultipartParallel; they have no chunk size.
+ */
 
 using namespace std;
 
-#ifdef TEST_PARSER
-	static void
-	onPartBegin(const char *buffer, size_t start, size_t end, void *userData) {
-		printf("onPartBegin\n");
+
+// every allocation is counted, to catch those sneaking into the hot path
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+	allocations++;
+	void *p = malloc(size == 0 ? 1 : size);
+	if (p == NULL) {
+		throw bad_alloc();
 	}
+	return p;
+}
 
-	static void
-	onHeaderField(const char *buffer, size_t start, size_t end, void *userData) {
-		printf("onHeaderField: (%s)\n", string(buffer + start, end - start).c_str());
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete[](void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+	free(p);
+}
+
+
+struct Corpus {
+	string name;
+	string boundary;
+	string body;
+	size_t parts;
+};
+
+static string
+makeBoundary(mt19937_64 &rng, size_t size) {
+	static const char chars[] =
+		"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'()+_,-./:=?";
+	string boundary;
+	for (size_t i = 0; i < size; i++) {
+		boundary += chars[rng() % (sizeof(chars) - 1)];
 	}
+	return boundary;
+}
 
-	static void
-	onHeaderValue(const char *buffer, size_t start, size_t end, void *userData) {
-		printf("onHeaderValue: (%s)\n", string(buffer + start, end - start).c_str());
+static void
+beginPart(Corpus &corpus, size_t n, bool file) {
+	corpus.body += "--" + corpus.boundary + "\r\n";
+	corpus.body += "Content-Disposition: form-data; name=\"field" + to_string(n) + "\"";
+	if (file) {
+		corpus.body += "; filename=\"file" + to_string(n) + ".bin\"\r\n";
+		corpus.body += "Content-Type: application/octet-stream";
 	}
+	corpus.body += "\r\n\r\n";
+	corpus.parts++;
+}
 
-	static void
-	onPartData(const char *buffer, size_t start, size_t end, void *userData) {
-		printf("onPartData: (%s)\n", string(buffer + start, end - start).c_str());
+static void
+endPart(Corpus &corpus) {
+	corpus.body += "\r\n";
+}
+
+static void
+endBody(Corpus &corpus) {
+	corpus.body += "--" + corpus.boundary + "--\r\n";
+}
+
+/** A few large parts of random bytes. */
+static Corpus
+randomCorpus(const char *name, size_t size, size_t boundarySize) {
+	mt19937_64 rng(1);
+	Corpus corpus = { name, makeBoundary(rng, boundarySize), "", 0 };
+
+	for (size_t n = 0; n < 4; n++) {
+		beginPart(corpus, n, true);
+		size_t target = corpus.body.size() + size / 4;
+		while (corpus.body.size() < target) {
+			uint64_t r = rng();
+			corpus.body.append((const char *) &r, sizeof(r));
+		}
+		endPart(corpus);
 	}
+	endBody(corpus);
+	return corpus;
+}
+
+/** CSV-like text, short lines ending with CR LF. */
+static Corpus
+textCorpus(const char *name, size_t size, size_t boundarySize) {
+	mt19937_64 rng(2);
+	Corpus corpus = { name, makeBoundary(rng, boundarySize), "", 0 };
+
+	beginPart(corpus, 0, true);
+	while (corpus.body.size() < size) {
+		corpus.body += to_string(rng() % 100000) + "," + to_string(rng() % 1000) + ",ok\r\n";
+	}
+	endPart(corpus);
+	endBody(corpus);
+	return corpus;
+}
 
-	static void
-	onPartEnd(const char *buffer, size_t start, size_t end, void *userData) {
-		printf("onPartEnd\n");
+/** Data full of prefixes of the boundary, each one a false candidate. */
+static Corpus
+nearMissCorpus(const char *name, size_t size, size_t boundarySize) {
+	mt19937_64 rng(3);
+	Corpus corpus = { name, makeBoundary(rng, boundarySize), "", 0 };
+	string delimiter = "\r\n--" + corpus.boundary;
+
+	beginPart(corpus, 0, true);
+	while (corpus.body.size() < size) {
+		corpus.body.append(delimiter, 0, 1 + rng() % (delimiter.size() - 1));
+		// never part of a boundary
+		corpus.body += '#';
 	}
+	endPart(corpus);
+	endBody(corpus);
+	return corpus;
+}
+
+/** Many small form fields, as sent by a large HTML form. */
+static Corpus
+fieldsCorpus(const char *name, size_t size, size_t boundarySize) {
+	mt19937_64 rng(4);
+	Corpus corpus = { name, makeBoundary(rng, boundarySize), "", 0 };
 
-	static void
-	onEnd(const char *buffer, size_t start, size_t end, void *userData) {
-		printf("onEnd\n");
+	while (corpus.body.size() < size) {
+		beginPart(corpus, corpus.parts, false);
+		corpus.body += to_string(rng() % 1000000);
+		endPart(corpus);
 	}
-#else
-	void onPartBegin(const MultipartHeaders &headers, void *userData) {
-		printf("onPartBegin:\n");
-		MultipartHeaders::const_iterator it;
-		MultipartHeaders::const_iterator end = headers.end();
-		for (it = headers.begin(); it != headers.end(); it++) {
-			printf("  %s = %s\n", it->first.c_str(), it->second.c_str());
+	endBody(corpus);
+	return corpus;
+}
+
+
+struct Counters {
+	size_t callbacks;
+	size_t parts;
+	size_t bytes;
+};
+
+/** Handler for the parser, counting everything it is given. */
+class CountingHandler {
+public:
+	Counters *counters;
+
+	void onPartBegin()                        { counters->callbacks++; counters->parts++; }
+	void onHeaderField(std::string_view)      { counters->callbacks++; }
+	void onHeaderValue(std::string_view)      { counters->callbacks++; }
+	void onHeaderEnd()                        { counters->callbacks++; }
+	void onHeadersEnd()                       { counters->callbacks++; }
+	void onPartData(std::string_view data)    { counters->callbacks++; counters->bytes += data.size(); }
+	void onPartEnd()                          { counters->callbacks++; }
+	void onEnd()                              { counters->callbacks++; }
+};
+
+static void
+onReaderPartBegin(const MultipartHeaders &, void *userData) {
+	Counters *counters = (Counters *) userData;
+	counters->callbacks++;
+	counters->parts++;
+}
+
+static void
+onReaderPartData(const char *, size_t size, void *userData) {
+	Counters *counters = (Counters *) userData;
+	counters->callbacks++;
+	counters->bytes += size;
+}
+
+static void
+onReaderEvent(void *userData) {
+	((Counters *) userData)->callbacks++;
+}
+
+template<typename Parser>
+static bool
+feedAll(Parser &parser, const string &body, size_t chunk) {
+	size_t off = 0;
+
+	while (off < body.size() && !parser.stopped()) {
+		size_t len = min(chunk, body.size() - off);
+		size_t fed = 0;
+		do {
+			fed += parser.feed(body.data() + off + fed, len - fed);
+		} while (fed < len && !parser.stopped());
+		off += len;
+	}
+	return parser.succeeded();
+}
+
+/** Parse the whole corpus once, false if it did not parse. */
+static bool
+runParser(const Corpus &corpus, size_t chunk, Counters &counters) {
+	BasicMultipartParser<CountingHandler> parser(corpus.boundary);
+	parser.handler().counters = &counters;
+	return feedAll(parser, corpus.body, chunk);
+}
+
+static bool
+runReader(const Corpus &corpus, size_t chunk, Counters &counters) {
+	MultipartReader reader(corpus.boundary);
+	reader.onPartBegin = onReaderPartBegin;
+	reader.onPartData  = onReaderPartData;
+	reader.onPartEnd   = onReaderEvent;
+	reader.onEnd       = onReaderEvent;
+	reader.userData    = &counters;
+	return feedAll(reader, corpus.body, chunk);
+}
+
+static void
+countIndex(const MultipartIndex &index, Counters &counters) {
+	counters.parts = index.size();
+	for (size_t i = 0; i < index.size(); i++) {
+		counters.bytes += index.data(i).size();
+	}
+}
+
+static bool
+runIndex(const Corpus &corpus, size_t, Counters &counters) {
+	MultipartParser parser(corpus.boundary);
+	MultipartIndex index;
+	bool ok = parser.parseContiguous(corpus.body, index);
+	countIndex(index, counters);
+	return ok;
+}
+
+// -t, 0 for as many as there are cores
+static unsigned parallelThreads = 0;
+
+static bool
+runParallel(const Corpus &corpus, size_t, Counters &counters) {
+	MultipartParser parser(corpus.boundary);
+	MultipartIndex index;
+	bool ok = MultipartParallel::parseContiguous(parser, corpus.body, index, parallelThreads);
+	countIndex(index, counters);
+	return ok;
+}
+
+typedef bool (*Runner)(const Corpus &corpus, size_t chunk, Counters &counters);
+
+struct Options {
+	size_t size;
+	int warmup;
+	int repeats;
+	const char *filter;
+};
+
+static bool
+bench(const Options &options, const Corpus &corpus, const char *target, Runner runner,
+	size_t chunk)
+{
+	char name[128];
+	snprintf(name, sizeof(name), "%s/%s/%s", corpus.name.c_str(), target,
+		chunk >= corpus.body.size() ? "whole" : to_string(chunk).c_str());
+	if (options.filter != NULL && strstr(name, options.filter) == NULL) {
+		return true;
+	}
+
+	Counters counters;
+	for (int i = 0; i < options.warmup; i++) {
+		counters = Counters();
+		if (!runner(corpus, chunk, counters)) {
+			fprintf(stderr, "%s: corpus did not parse\n", name);
+			return false;
 		}
-		printf("  aaa: %s\n", headers["aaa"].c_str());
 	}
-	
-	void onPartData(const char *buffer, size_t size, void *userData) {
-		//printf("onPartData: (%s)\n", string(buffer, size).c_str());
+
+	vector<double> seconds;
+	size_t allocs = 0;
+	for (int i = 0; i < options.repeats; i++) {
+		counters = Counters();
+		size_t before = allocations;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		bool ok = runner(corpus, chunk, counters);
+		chrono::steady_clock::time_point end = chrono::steady_clock::now();
+		allocs += allocations - before;
+		if (!ok || counters.parts != corpus.parts) {
+			fprintf(stderr, "%s: corpus did not parse\n", name);
+			return false;
+		}
+		seconds.push_back(chrono::duration<double>(end - start).count());
 	}
-	
-	void onPartEnd(void *userData) {
-		printf("onPartEnd\n");
+
+	double mb = corpus.body.size() / 1048576.0;
+	sort(seconds.begin(), seconds.end());
+	double median = seconds[seconds.size() / 2];
+	double mean = 0, deviation = 0;
+	for (size_t i = 0; i < seconds.size(); i++) {
+		mean += seconds[i];
 	}
-	
-	void onEnd(void *userData) {
-		printf("onEnd\n");
+	mean /= seconds.size();
+	for (size_t i = 0; i < seconds.size(); i++) {
+		deviation += (seconds[i] - mean) * (seconds[i] - mean);
 	}
-#endif
+	deviation = sqrt(deviation / seconds.size());
+
+	printf("%-34s %9.1f %6.1f%% %9.3f %12.1f %10.2f\n",
+		name,
+		mb / median,
+		100.0 * deviation / mean,
+		median * 1e9 / corpus.body.size(),
+		counters.callbacks / mb,
+		allocs / (double) options.repeats / mb);
+	fflush(stdout);
+	return true;
+}
+
+static void
+usage(const char *program) {
+	fprintf(stderr, "usage: %s [-s size_mb] [-w warmup] [-r repeats] [-f filter] [-t threads]\n",
+		program);
+}
 
 int
-main() {
-	#ifdef TEST_PARSER
-		MultipartParser parser;
-		#ifndef QUIET
-			parser.onPartBegin = onPartBegin;
-			parser.onHeaderField = onHeaderField;
-			parser.onHeaderValue = onHeaderValue;
-			parser.onPartData = onPartData;
-			parser.onPartEnd = onPartEnd;
-			parser.onEnd = onEnd;
-		#endif
-	#else
-		MultipartReader parser;
-		#ifndef QUIET
-			parser.onPartBegin = onPartBegin;
-			parser.onPartData = onPartData;
-			parser.onPartEnd = onPartEnd;
-			parser.onEnd = onEnd;
-		#endif
-	#endif
-	
-	struct timeval stime, etime;
-	struct stat sbuf;
-	
-	stat(INPUT_FILE, &sbuf);
-	
-	#ifdef SLURP
-		size_t bufsize = sbuf.st_size;
-		char *buf = (char *) malloc(bufsize);
-		
-		FILE *f = fopen(INPUT_FILE, "rb");
-		fread(buf, 1, bufsize, f);
-		fclose(f);
-		
-		gettimeofday(&stime, NULL);
-		for (int i = 0; i < TIMES; i++) {
-			#ifndef QUIET
-				printf("------------\n");
-			#endif
-			parser.setBoundary(BOUNDARY);
-			
-			size_t fed = 0;
-			do {
-				size_t ret = parser.feed(buf + fed, bufsize - fed);
-				fed += ret;
-			} while (fed < bufsize && !parser.stopped());
-			#ifndef QUIET
-				printf("%s\n", parser.getErrorMessage());
-			#endif
+main(int argc, char **argv) {
+	Options options = { 8 * 1048576, 1, 5, NULL };
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:w:r:f:t:h")) != -1) {
+		switch (opt) {
+		case 's': options.size = (size_t) (atof(optarg) * 1048576); break;
+		case 'w': options.warmup = atoi(optarg); break;
+		case 'r': options.repeats = atoi(optarg); break;
+		case 'f': options.filter = optarg; break;
+		case 't': parallelThreads = (unsigned) atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
 		}
-		gettimeofday(&etime, NULL);
-	#else
-		size_t bufsize = 1024 * 32;
-		char *buf = (char *) malloc(bufsize);
-		
-		gettimeofday(&stime, NULL);
-		for (int i = 0; i < TIMES; i++) {
-			#ifndef QUIET
-				printf("------------\n");
-			#endif
-			parser.setBoundary(BOUNDARY);
-			
-			FILE *f = fopen(INPUT_FILE, "rb");
-			while (!parser.stopped() && !feof(f)) {
-				size_t len = fread(buf, 1, bufsize, f);
-				size_t fed = 0;
-				do {
-					size_t ret = parser.feed(buf + fed, len - fed);
-					fed += ret;
-				} while (fed < len && !parser.stopped());
+	}
+	if (options.repeats < 1 || options.size == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	vector<Corpus> corpora;
+	corpora.push_back(randomCorpus("random-b70", options.size, 70));
+	corpora.push_back(randomCorpus("random-b1", options.size, 1));
+	corpora.push_back(textCorpus("text-crlf", options.size, 40));
+	corpora.push_back(nearMissCorpus("near-miss-b70", options.size, 70));
+	corpora.push_back(nearMissCorpus("near-miss-b1", options.size, 1));
+	corpora.push_back(fieldsCorpus("tiny-fields", options.size, 40));
+
+	static const size_t chunks[] = { 1, 1024, 32 * 1024, (size_t) -1 };
+
+	printf("%-34s %9s %7s %9s %12s %10s\n",
+		"corpus/target/chunk", "MB/s", "+-", "ns/byte", "callbacks/MB", "allocs/MB");
+	for (size_t c = 0; c < corpora.size(); c++) {
+		for (size_t k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+			if (!bench(options, corpora[c], "parser", runParser, chunks[k])
+			 || !bench(options, corpora[c], "reader", runReader, chunks[k]))
+			{
+				return 1;
 			}
-			#ifndef QUIET
-				printf("%s\n", parser.getErrorMessage());
-			#endif
-			fclose(f);
 		}
-		gettimeofday(&etime, NULL);
-	#endif
-	
-	unsigned long long a = (unsigned long long) stime.tv_sec * 1000000 + stime.tv_usec;
-	unsigned long long b = (unsigned long long) etime.tv_sec * 1000000 + etime.tv_usec;
-	printf("(C++)    Total: %.2fs   Per run: %.2fs   Throughput: %.2f MB/sec\n",
-		(b - a) / 1000000.0,
-		(b - a) / TIMES / 1000000.0,
-		((unsigned long long) sbuf.st_size * TIMES) / ((b - a) / 1000000.0) / 1024.0 / 1024.0);
-	
+		if (!bench(options, corpora[c], "index", runIndex, (size_t) -1)
+		 || !bench(options, corpora[c], "parallel", runParallel, (size_t) -1))
+		{
+			return 1;
+		}
+	}
 	return 0;
 }
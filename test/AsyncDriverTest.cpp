@@ -0,0 +1,221 @@
+#include "TestHelper.h"
+#include "MultipartAsyncDriver.h"
+#include <sys/socket.h>
+#include <thread>
+
+/**
+ * Many streams read on one thread parse as they would alone, with either
+ * backend, and with far fewer buffers than streams: reads that find no
+ * buffer wait for one to be given back.
+ */
+
+typedef MultipartAsyncDriver<TestParser> Driver;
+
+struct Stream {
+	TestBody t;
+	TestParser parser;
+	int fds[2];  // read end, write end
+	int error;
+	bool done;
+};
+
+static void streamDone(int fd, TestParser &parser, int error, void *userData) {
+	Stream *stream = (Stream *) userData;
+	CHECK_EQUAL(fd, stream->fds[0]);
+	CHECK(&parser == &stream->parser);
+	CHECK(!stream->done);
+	stream->error = error;
+	stream->done = true;
+}
+
+static const char *backendName(Driver::Backend backend) {
+	return backend == Driver::IO_URING ? "io_uring" : "epoll";
+}
+
+/** Write the bodies of streams, a piece of each in turn, from another thread. */
+static std::thread writeInTurns(std::vector<Stream> &streams, size_t pieceSize) {
+	return std::thread([&streams, pieceSize]() {
+		std::vector<size_t> written(streams.size(), 0);
+		bool more = true;
+		while (more) {
+			more = false;
+			for (size_t i = 0; i < streams.size(); i++) {
+				const std::string &body = streams[i].t.body;
+				size_t len = std::min(pieceSize, body.size() - written[i]);
+				while (len > 0) {
+					ssize_t ret = write(streams[i].fds[1], body.data() + written[i], len);
+					CHECK(ret > 0);
+					if (ret <= 0) {
+						break;
+					}
+					written[i] += ret;
+					len -= ret;
+				}
+				if (written[i] < body.size()) {
+					more = true;
+				} else if (streams[i].fds[1] != -1) {
+					close(streams[i].fds[1]);
+					streams[i].fds[1] = -1;
+				}
+			}
+		}
+	});
+}
+
+/** 40 streams sharing 4 buffers, over socketpairs or pipes. */
+static void testStreams(Driver::Backend backend, bool socketPairs) {
+	std::mt19937 rng(12);
+	std::vector<Stream> streams(40);
+	Driver driver;
+
+	CHECK(driver.open(backend, 4, 4096));
+	CHECK_EQUAL(driver.backend(), backend);
+	for (size_t i = 0; i < streams.size(); i++) {
+		Stream &stream = streams[i];
+		stream.t = randomBody(rng, i % 4 == 0 ? 100000 : 2000);
+		stream.parser.setBoundary(stream.t.boundary);
+		stream.error = 0;
+		stream.done = false;
+		if (socketPairs) {
+			CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, stream.fds) == 0);
+		} else {
+			CHECK(pipe(stream.fds) == 0);
+		}
+		CHECK(driver.add(stream.fds[0], stream.parser, &stream));
+	}
+	driver.onDone = streamDone;
+	CHECK_EQUAL(driver.pending(), streams.size());
+
+	std::thread writer = writeInTurns(streams, 1000);
+	bool ok = driver.run();
+	writer.join();
+	if (!ok) {
+		fprintf(stderr, "%s: %s\n", backendName(backend), driver.getErrorMessage());
+		testFailures++;
+	}
+	CHECK_EQUAL(driver.pending(), 0);
+
+	size_t bytes = 0;
+	for (size_t i = 0; i < streams.size(); i++) {
+		CHECK(streams[i].done);
+		CHECK_EQUAL(streams[i].error, 0);
+		CHECK(streams[i].parser.succeeded());
+		CHECK(streams[i].parser.parts == streams[i].t.parts);
+		bytes += streams[i].t.body.size();
+		close(streams[i].fds[0]);
+	}
+	// nothing follows the last boundary, so each body was read whole
+	CHECK_EQUAL(driver.bytesRead, bytes);
+	CHECK(driver.syscalls > 0);
+}
+
+/** Regular files cannot be watched by epoll, they are read at once. */
+static void testFiles(Driver::Backend backend) {
+	std::mt19937 rng(13);
+	std::vector<Stream> streams(5);
+	Driver driver;
+
+	CHECK(driver.open(backend, 2, 1024));
+	driver.onDone = streamDone;
+	for (size_t i = 0; i < streams.size(); i++) {
+		Stream &stream = streams[i];
+		char path[] = "/tmp/AsyncDriverTestXXXXXX";
+		stream.t = randomBody(rng, 20000);
+		stream.parser.setBoundary(stream.t.boundary);
+		stream.error = 0;
+		stream.done = false;
+		stream.fds[0] = mkstemp(path);
+		stream.fds[1] = -1;
+		CHECK(stream.fds[0] != -1);
+		unlink(path);
+		CHECK_EQUAL(pwrite(stream.fds[0], stream.t.body.data(), stream.t.body.size(), 0),
+			(ssize_t) stream.t.body.size());
+		CHECK(driver.add(stream.fds[0], stream.parser, &stream));
+	}
+	CHECK(driver.run());
+	for (size_t i = 0; i < streams.size(); i++) {
+		CHECK(streams[i].done);
+		CHECK(streams[i].parser.succeeded());
+		CHECK(streams[i].parser.parts == streams[i].t.parts);
+		close(streams[i].fds[0]);
+	}
+}
+
+struct Chain {
+	Driver *driver;
+	std::vector<Stream> *streams;
+	size_t next;
+};
+
+static void chainDone(int fd, TestParser &parser, int error, void *userData) {
+	Chain *chain = (Chain *) userData;
+	CHECK_EQUAL(error, 0);
+	CHECK(parser.stopped());
+	(void) fd;
+	if (chain->next < chain->streams->size()) {
+		Stream &stream = (*chain->streams)[chain->next++];
+		CHECK(chain->driver->add(stream.fds[0], stream.parser, chain));
+	}
+}
+
+/**
+ * Parsers that stop early are done without reading the rest, and streams
+ * added from onDone take the place of those that ended.
+ */
+static void testStopAndChain(Driver::Backend backend) {
+	std::vector<Stream> streams(10);
+	Driver driver;
+	Chain chain = { &driver, &streams, 1 };
+
+	CHECK(driver.open(backend, 2, 64));
+	driver.onDone = chainDone;
+	for (size_t i = 0; i < streams.size(); i++) {
+		Stream &stream = streams[i];
+		// every other one is malformed and stops the parser at once
+		stream.t.body = i % 2 == 0 ? "--b\r\n\r\ndata\r\n--b--\r\n" : "--c\r\n";
+		stream.parser.setBoundary("b");
+		CHECK(pipe(stream.fds) == 0);
+		// small enough for the pipe, and the write end left open: stopped
+		// parsers are done without waiting for end of file
+		CHECK_EQUAL(write(stream.fds[1], stream.t.body.data(), stream.t.body.size()),
+			(ssize_t) stream.t.body.size());
+	}
+	CHECK(driver.add(streams[0].fds[0], streams[0].parser, &chain));
+	CHECK(driver.run());
+	CHECK_EQUAL(chain.next, streams.size());
+	for (size_t i = 0; i < streams.size(); i++) {
+		CHECK(i % 2 == 0 ? streams[i].parser.succeeded() : streams[i].parser.hasError());
+		close(streams[i].fds[0]);
+		close(streams[i].fds[1]);
+	}
+}
+
+static void testBackend(Driver::Backend backend) {
+	testStreams(backend, true);
+	testStreams(backend, false);
+	testFiles(backend);
+	testStopAndChain(backend);
+}
+
+int main() {
+	Driver driver;
+	TestParser parser;
+	CHECK(!driver.add(0, parser));
+	CHECK(!driver.step());
+
+	testBackend(Driver::EPOLL);
+
+	// io_uring when the kernel has it, otherwise AUTO falls back to epoll
+	if (driver.open(Driver::IO_URING)) {
+		driver.close();
+		testBackend(Driver::IO_URING);
+		CHECK(driver.open(Driver::AUTO));
+		CHECK_EQUAL(driver.backend(), Driver::IO_URING);
+	} else {
+		fprintf(stderr, "AsyncDriverTest: io_uring unavailable (%s), not tested\n",
+			driver.getErrorMessage());
+		CHECK(driver.open(Driver::AUTO));
+		CHECK_EQUAL(driver.backend(), Driver::EPOLL);
+	}
+	return testResult("AsyncDriverTest");
+}
@@ -0,0 +1,218 @@
+#include "TestHelper.h"
+
+/**
+ * A parser, or reader, saved at any byte and restored into another one
+ * goes on as if it had not been interrupted.
+ */
+
+/** Parse t, moving to a new parser through a checkpoint every step bytes. */
+static std::vector<TestPart> parseWithCheckpoints(const TestBody &t, size_t step,
+	size_t minDataChunk)
+{
+	TestParser parser;
+	parser.setBoundary(t.boundary);
+	parser.setMinDataChunk(minDataChunk);
+
+	for (size_t pos = 0; pos < t.body.size() && !parser.stopped(); pos += step) {
+		size_t len = std::min(step, t.body.size() - pos);
+		parser.feed(t.body.data() + pos, len);
+
+		std::string checkpoint;
+		CHECK(parser.serialize(checkpoint));
+		TestParser restored;
+		CHECK_EQUAL(restored.deserialize(checkpoint), checkpoint.size());
+		CHECK(!restored.hasError());
+		// the handler is not part of the checkpoint
+		static_cast<TestRecorder &>(restored) = parser;
+		parser = restored;
+	}
+	CHECK(parser.succeeded());
+	return parser.parts;
+}
+
+static void testParserCheckpoints() {
+	std::mt19937 rng(7);
+
+	for (int n = 0; n < 30; n++) {
+		TestBody t = randomBody(rng, n % 5 == 0 ? 2000 : 200);
+		for (size_t step : { 1, 2, 5, 13, 100 }) {
+			for (size_t minDataChunk : { 0, 64 }) {
+				CHECK(parseWithCheckpoints(t, step, minDataChunk) == t.parts);
+			}
+		}
+	}
+}
+
+/** Cut in the middle of a part, in a boundary candidate and in headers. */
+static void testReaderCheckpoints() {
+	std::string body =
+		"--b\r\n"
+		"Content-Disposition: form-data; name=\"one\"\r\n"
+		"\r\n"
+		"first\r\n-\r\n--\r\n--c\r\n--b-\r\n"
+		"--b\r\n"
+		"Content-Disposition: form-data; name=\"two\"\r\n"
+		"Content-Transfer-Encoding: base64\r\n"
+		"\r\n"
+		"c2Vjb25k\r\n"
+		"IGRhdGE=\r\n"
+		"--b--\r\n";
+
+	for (size_t cut = 0; cut <= body.size(); cut++) {
+		MultipartReader first("b");
+		TestReaderLog log;
+		first.setTransferDecoding(true);
+		log.attach(first);
+		first.feed(body.data(), cut);
+
+		std::string checkpoint;
+		CHECK(first.serialize(checkpoint));
+		MultipartReader second;
+		second.setTransferDecoding(true);
+		CHECK_EQUAL(second.deserialize(checkpoint), checkpoint.size());
+		log.attach(second);
+		if (cut < body.size()) {
+			second.feed(body.data() + cut, body.size() - cut);
+		}
+		CHECK(second.succeeded());
+		CHECK(log.ended);
+		CHECK_EQUAL(log.parts.size(), 2);
+		if (log.parts.size() == 2) {
+			CHECK(log.parts[0].name == "one");
+			CHECK(log.parts[0].data == "first\r\n-\r\n--\r\n--c\r\n--b-");
+			CHECK(log.parts[1].name == "two");
+			CHECK(log.parts[1].data == "second data");
+		}
+	}
+}
+
+/**
+ * A checkpoint of a parser for boundary "b" in state, with the given
+ * index and flags, as serialize() lays it out.
+ */
+static std::string craftCheckpoint(MultipartParser::State state, uint64_t flags,
+	uint64_t index)
+{
+	std::string out;
+	MultipartCheckpoint::Writer writer(out);
+	writer.number(MultipartCheckpoint::MAGIC);
+	writer.bytes("b");
+	writer.number(state);
+	writer.number(flags);
+	writer.number(index);
+	writer.bytes(state == MultipartParser::PART_DATA ? std::string(index, '-') : "");
+	writer.number(0);  // marks
+	writer.number(0);  // minDataChunk
+	writer.bytes("");  // coalesced
+	writer.number(0);  // bodyOffset
+	writer.number(0);  // partCount
+	writer.number(0);  // headerCount
+	writer.number(0);  // partDataStart
+	return out;
+}
+
+static bool acceptsCheckpoint(MultipartParser::State state, uint64_t flags, uint64_t index,
+	uint64_t maxHeaderLineSize = MultipartLimits::UNLIMITED)
+{
+	std::string checkpoint = craftCheckpoint(state, flags, index);
+	MultipartParser parser;
+	MultipartLimits limits;
+	limits.maxHeaderLineSize = maxHeaderLineSize;
+	parser.setLimits(limits);
+	if (parser.deserialize(checkpoint) == checkpoint.size()) {
+		// whatever comes next is read safely
+		std::string next = "\r\n--b\r\n\r\n--b--\r\n";
+		parser.feed(next.data(), next.size());
+		return true;
+	}
+	CHECK_EQUAL(parser.getError().code, MultipartError::BAD_CHECKPOINT);
+	return false;
+}
+
+/** Indexes out of reach of the state they are saved with are refused. */
+static void testBadIndexes() {
+	// "\r\n--b"
+	const uint64_t boundarySize = 5;
+	const uint64_t PART_BOUNDARY = 1, LAST_BOUNDARY = 2;
+
+	CHECK(acceptsCheckpoint(MultipartParser::START, 0, 0));
+	CHECK(!acceptsCheckpoint(MultipartParser::START, 0, 1));
+	CHECK(acceptsCheckpoint(MultipartParser::START_BOUNDARY, 0, boundarySize - 1));
+	CHECK(!acceptsCheckpoint(MultipartParser::START_BOUNDARY, 0, boundarySize));
+	CHECK(!acceptsCheckpoint(MultipartParser::START_BOUNDARY, 0, (uint64_t) 1 << 40));
+	CHECK(!acceptsCheckpoint(MultipartParser::START_BOUNDARY, 0, (uint64_t) -1));
+
+	CHECK(acceptsCheckpoint(MultipartParser::HEADER_FIELD, 0, 1000));
+	CHECK(acceptsCheckpoint(MultipartParser::HEADER_VALUE, 0, 100, 100));
+	CHECK(!acceptsCheckpoint(MultipartParser::HEADER_VALUE, 0, 101, 100));
+	CHECK(!acceptsCheckpoint(MultipartParser::HEADERS_ALMOST_DONE, 0, 101, 100));
+	CHECK(!acceptsCheckpoint(MultipartParser::PART_DATA_START, 0, 1));
+
+	CHECK(acceptsCheckpoint(MultipartParser::PART_DATA, 0, boundarySize));
+	CHECK(acceptsCheckpoint(MultipartParser::PART_DATA, PART_BOUNDARY, boundarySize + 1));
+	CHECK(acceptsCheckpoint(MultipartParser::PART_DATA, LAST_BOUNDARY, boundarySize + 1));
+	CHECK(acceptsCheckpoint(MultipartParser::PART_DATA, LAST_BOUNDARY, boundarySize + 3));
+	CHECK(!acceptsCheckpoint(MultipartParser::PART_DATA, LAST_BOUNDARY, boundarySize + 4));
+	CHECK(!acceptsCheckpoint(MultipartParser::PART_DATA, LAST_BOUNDARY, boundarySize + 8));
+	// flags that do not go with the index
+	CHECK(!acceptsCheckpoint(MultipartParser::PART_DATA, PART_BOUNDARY, 2));
+	CHECK(!acceptsCheckpoint(MultipartParser::PART_DATA, 0, boundarySize + 1));
+	CHECK(!acceptsCheckpoint(MultipartParser::PART_DATA, PART_BOUNDARY | LAST_BOUNDARY,
+		boundarySize + 1));
+	CHECK(!acceptsCheckpoint(MultipartParser::PART_DATA, PART_BOUNDARY, boundarySize + 2));
+
+	CHECK(acceptsCheckpoint(MultipartParser::END, LAST_BOUNDARY, boundarySize + 1));
+	CHECK(!acceptsCheckpoint(MultipartParser::END, 0, (uint64_t) 1 << 40));
+}
+
+/** A candidate that fails after its CR leaves nothing for the next one. */
+static void testFailedCandidates() {
+	std::string body = "--b\r\n\r\nx\r\n--b\rY\r\n--b-Z\r\n--b--\r\n";
+
+	for (size_t chunkSize : { 0, 1, 2 }) {
+		TestParser parser;
+		parser.setBoundary("b");
+		feedInChunks(parser, body, chunkSize);
+		CHECK(parser.succeeded());
+		CHECK_EQUAL(parser.parts.size(), 1);
+		CHECK(parser.parts.size() == 1 && parser.parts[0].data == "x\r\n--b\rY\r\n--b-Z");
+	}
+}
+
+static void testBadCheckpoints() {
+	std::string body = "--b\r\nA: v\r\n\r\nsome data\r\n--";
+	MultipartReader reader("b");
+	reader.feed(body.data(), body.size());
+	std::string checkpoint;
+	CHECK(reader.serialize(checkpoint));
+
+	// every truncation is refused
+	for (size_t size = 0; size < checkpoint.size(); size++) {
+		MultipartReader restored;
+		CHECK_EQUAL(restored.deserialize(checkpoint.substr(0, size)), 0);
+		CHECK_EQUAL(restored.getError().code, MultipartError::BAD_CHECKPOINT);
+		CHECK(restored.hasError());
+	}
+
+	std::string corrupted = checkpoint;
+	corrupted[0] ^= 1;
+	MultipartReader restored;
+	CHECK_EQUAL(restored.deserialize(corrupted), 0);
+	CHECK_EQUAL(restored.getError().code, MultipartError::BAD_CHECKPOINT);
+
+	// a failed parser has nothing to save
+	MultipartParser parser("b");
+	parser.feed("--c", 3);
+	std::string nothing;
+	CHECK(!parser.serialize(nothing));
+	CHECK(nothing.empty());
+}
+
+int main() {
+	testParserCheckpoints();
+	testReaderCheckpoints();
+	testBadCheckpoints();
+	testBadIndexes();
+	testFailedCandidates();
+	return testResult("CheckpointTest");
+}
@@ -0,0 +1,88 @@
+#include "TestHelper.h"
+
+/**
+ * However a body is cut into buffers, and whichever boundary search the
+ * parser uses, the same parts must come out.
+ */
+
+static std::vector<TestPart> parse(const TestBody &t, size_t chunkSize, bool simd) {
+	TestParser parser;
+
+	parser.setBoundary(t.boundary);
+	if (!simd) {
+		parser.scanKernel = NULL;
+	}
+	feedInChunks(parser, t.body, chunkSize);
+	CHECK(parser.succeeded());
+	CHECK(parser.ended);
+	return parser.parts;
+}
+
+static void testChunkSizes() {
+	std::mt19937 rng(1);
+
+	for (int n = 0; n < 30; n++) {
+		TestBody t = randomBody(rng, n % 2 == 0 ? 300 : 5000);
+		for (bool simd : { true, false }) {
+			CHECK(parse(t, 0, simd) == t.parts);
+			for (size_t chunkSize = 1; chunkSize <= 80; chunkSize++) {
+				CHECK(parse(t, chunkSize, simd) == t.parts);
+			}
+			for (size_t chunkSize = 81; chunkSize < t.body.size(); chunkSize = chunkSize * 3 / 2) {
+				CHECK(parse(t, chunkSize, simd) == t.parts);
+			}
+		}
+	}
+}
+
+static void testRandomSplits() {
+	std::mt19937 rng(2);
+
+	for (int n = 0; n < 200; n++) {
+		TestBody t = randomBody(rng, 5000);
+		TestParser parser;
+		parser.setBoundary(t.boundary);
+		if (n % 2 == 1) {
+			parser.scanKernel = NULL;
+		}
+		for (size_t pos = 0; pos < t.body.size(); ) {
+			size_t len = std::min<size_t>(1 + rng() % 200, t.body.size() - pos);
+			// the final CR LF is epilogue, which a stopped parser leaves
+			CHECK(parser.feed(t.body.data() + pos, len) == len || parser.succeeded());
+			pos += len;
+		}
+		CHECK(parser.succeeded());
+		CHECK(parser.parts == t.parts);
+	}
+}
+
+/** A delimiter cut by the end of a buffer, at every position of it. */
+static void testDelimiterAcrossBuffers() {
+	std::string boundary = "AaB03x";
+	std::string body = "--AaB03x\r\n\r\nsome data\r\n--AaB03x\r\n\r\nmore\r\n--AaB03x--\r\n";
+
+	for (size_t cut = 1; cut < body.size(); cut++) {
+		for (bool simd : { true, false }) {
+			TestParser parser;
+			parser.setBoundary(boundary);
+			if (!simd) {
+				parser.scanKernel = NULL;
+			}
+			CHECK(parser.feed(body.data(), cut) == cut || parser.succeeded());
+			parser.feed(body.data() + cut, body.size() - cut);
+			CHECK(parser.succeeded());
+			CHECK_EQUAL(parser.parts.size(), 2);
+			if (parser.parts.size() == 2) {
+				CHECK(parser.parts[0].data == "some data");
+				CHECK(parser.parts[1].data == "more");
+			}
+		}
+	}
+}
+
+int main() {
+	testChunkSizes();
+	testRandomSplits();
+	testDelimiterAcrossBuffers();
+	return testResult("ChunkingTest");
+}
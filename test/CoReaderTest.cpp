@@ -0,0 +1,308 @@
+#include "TestHelper.h"
+#include "MultipartCoReader.h"
+#include <exception>
+
+/**
+ * A coroutine pulling parts and chunks sees the body as it was sent,
+ * whether the producer is plain code or another coroutine, is resumed only
+ * when there is something for it, and holds the producer back while it is
+ * busy elsewhere. Errors end its loops.
+ */
+
+/** Just enough of a coroutine type: starts at once, kept until destroyed. */
+struct Task {
+	struct promise_type {
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return std::suspend_never();
+		}
+		std::suspend_always final_suspend() noexcept {
+			return std::suspend_always();
+		}
+		void return_void() { }
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+
+	std::coroutine_handle<promise_type> handle;
+
+	explicit Task(std::coroutine_handle<promise_type> handle): handle(handle) { }
+	Task(const Task &) = delete;
+	~Task() {
+		handle.destroy();
+	}
+
+	bool done() const {
+		return handle.done();
+	}
+};
+
+/** Suspends the awaiting coroutine until the test resumes it by hand. */
+struct Gate {
+	std::coroutine_handle<> waiting;
+
+	bool await_ready() {
+		return false;
+	}
+	void await_suspend(std::coroutine_handle<> handle) {
+		waiting = handle;
+	}
+	void await_resume() { }
+
+	void open() {
+		std::coroutine_handle<> handle = waiting;
+		waiting = nullptr;
+		handle.resume();
+	}
+};
+
+struct Consumer {
+	std::vector<TestPart> parts;
+	std::vector<bool> ended;    // whether nextChunk() returned false
+	size_t chunks;              // received, all parts together
+	Gate *gate;                 // awaited after each chunk, if set
+	size_t skipFrom;            // parts from this one are skipped unread
+	bool finished;
+};
+
+static Task consume(MultipartCoReader &reader, Consumer &consumer) {
+	while (const MultipartHeaders *headers = co_await reader.nextPart()) {
+		consumer.parts.push_back(TestPart());
+		for (MultipartHeaders::const_iterator it = headers->begin(); it != headers->end(); it++) {
+			consumer.parts.back().headers.push_back(std::make_pair(
+				std::string(it->first), std::string(it->second)));
+		}
+		consumer.ended.push_back(false);
+		if (consumer.parts.size() > consumer.skipFrom) {
+			continue;
+		}
+		std::string_view chunk;
+		while (co_await reader.nextChunk(chunk)) {
+			CHECK(!chunk.empty());
+			consumer.parts.back().data.append(chunk.data(), chunk.size());
+			consumer.chunks++;
+			if (consumer.gate != NULL) {
+				co_await *consumer.gate;
+			}
+		}
+		consumer.ended.back() = true;
+	}
+	consumer.finished = true;
+}
+
+static void initConsumer(Consumer &consumer) {
+	consumer.chunks = 0;
+	consumer.gate = NULL;
+	consumer.skipFrom = (size_t) -1;
+	consumer.finished = false;
+}
+
+/** Headers as the consumer gathered them, compared with those sent. */
+static bool sameParts(const std::vector<TestPart> &received, const std::vector<TestPart> &sent,
+	bool withData = true)
+{
+	if (received.size() != sent.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < sent.size(); i++) {
+		if (received[i].headers.size() != sent[i].headers.size()
+		 || (withData && received[i].data != sent[i].data))
+		{
+			return false;
+		}
+		for (size_t h = 0; h < sent[i].headers.size(); h++) {
+			if (received[i].headers[h].second != sent[i].headers[h].second) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/** Fed by plain code, buffer by buffer, each free again once feed() returns. */
+static void testFed() {
+	std::mt19937 rng(14);
+
+	for (int n = 0; n < 50; n++) {
+		TestBody t = randomBody(rng, n % 5 == 0 ? 20000 : 300);
+		for (size_t chunkSize : { (size_t) 1, (size_t) 7, (size_t) 1000, t.body.size() }) {
+			MultipartCoReader reader(t.boundary);
+			Consumer consumer;
+			initConsumer(consumer);
+			Task task = consume(reader, consumer);
+			CHECK(!task.done());
+
+			for (size_t pos = 0; pos < t.body.size() && !reader.stopped(); pos += chunkSize) {
+				CHECK(reader.needsInput());
+				// a copy, so that keeping a view of it would be caught
+				std::string buffer = t.body.substr(pos, chunkSize);
+				CHECK(reader.feed(buffer.data(), buffer.size()));
+			}
+			CHECK(task.done());
+			CHECK(consumer.finished);
+			CHECK(reader.succeeded());
+			CHECK(sameParts(consumer.parts, t.parts));
+			CHECK(std::find(consumer.ended.begin(), consumer.ended.end(), false)
+				== consumer.ended.end());
+		}
+	}
+}
+
+/**
+ * The consumer awaits something else after each chunk: the buffer stays
+ * in use, and no more input is taken, until it asks for more.
+ */
+static void testBackpressure() {
+	std::mt19937 rng(15);
+	TestBody t = randomBody(rng, 3000);
+	MultipartCoReader reader(t.boundary);
+	Consumer consumer;
+	Gate gate;
+	initConsumer(consumer);
+	consumer.gate = &gate;
+	Task task = consume(reader, consumer);
+
+	size_t pos = 0, chunkSize = 100;
+	while (!task.done()) {
+		if (gate.waiting) {
+			// still busy with the last chunk
+			CHECK(!reader.needsInput());
+			gate.open();
+		} else {
+			CHECK(reader.needsInput());
+			CHECK(pos < t.body.size());
+			if (pos >= t.body.size()) {
+				break;
+			}
+			size_t len = std::min(chunkSize, t.body.size() - pos);
+			// kept while the consumer has a chunk of it, free otherwise
+			bool free = reader.feed(t.body.data() + pos, len);
+			CHECK_EQUAL(free, !gate.waiting);
+			pos += len;
+		}
+	}
+	CHECK(reader.succeeded());
+	CHECK(sameParts(consumer.parts, t.parts));
+	CHECK(consumer.chunks > 0);
+}
+
+static Task produce(MultipartCoReader &reader, const std::string &body, size_t chunkSize) {
+	for (size_t pos = 0; pos < body.size(); pos += chunkSize) {
+		// the previous buffer is done with once write() completes
+		CHECK(reader.needsInput() || reader.stopped());
+		co_await reader.write(body.data() + pos, std::min(chunkSize, body.size() - pos));
+	}
+	reader.close();
+}
+
+/** Fed by another coroutine, resumed whenever the consumer wants more. */
+static void testProducer() {
+	std::mt19937 rng(16);
+
+	for (int n = 0; n < 20; n++) {
+		TestBody t = randomBody(rng, 5000);
+		for (bool gated : { false, true }) {
+			MultipartCoReader reader(t.boundary);
+			Consumer consumer;
+			Gate gate;
+			initConsumer(consumer);
+			if (gated) {
+				consumer.gate = &gate;
+			}
+			Task consumerTask = consume(reader, consumer);
+			Task producerTask = produce(reader, t.body, 64);
+			// the producer waits with the consumer
+			while (gate.waiting) {
+				CHECK(!producerTask.done());
+				gate.open();
+			}
+			CHECK(consumerTask.done());
+			CHECK(producerTask.done());
+			CHECK(reader.succeeded());
+			CHECK(sameParts(consumer.parts, t.parts));
+		}
+	}
+}
+
+/** Parts the consumer does not read are skipped by nextPart(). */
+static void testSkipped() {
+	std::mt19937 rng(17);
+	TestBody t = randomBody(rng, 2000);
+	MultipartCoReader reader(t.boundary);
+	Consumer consumer;
+	initConsumer(consumer);
+	consumer.skipFrom = 0;
+	Task task = consume(reader, consumer);
+
+	for (size_t pos = 0; pos < t.body.size(); pos += 10) {
+		CHECK(reader.feed(t.body.data() + pos, std::min((size_t) 10, t.body.size() - pos)));
+	}
+	CHECK(task.done());
+	CHECK(reader.succeeded());
+	CHECK(sameParts(consumer.parts, t.parts, false));
+}
+
+/** Malformed and truncated bodies end the loops of the consumer. */
+static void testErrors() {
+	const char *bodies[] = {
+		"--c\r\n",
+		"--b\r\nA1: v\r\n\r\n",
+		"--b\r\n\r\nsome data\r\n--b\r\nA1",
+	};
+
+	for (const char *body : bodies) {
+		for (size_t chunkSize : { 1, 4, 100 }) {
+			std::string input = body;
+			MultipartCoReader reader("b");
+			Consumer consumer;
+			initConsumer(consumer);
+			Task task = consume(reader, consumer);
+			for (size_t pos = 0; pos < input.size() && !reader.stopped(); pos += chunkSize) {
+				reader.feed(input.data() + pos, std::min(chunkSize, input.size() - pos));
+			}
+			CHECK(task.done());
+			CHECK(reader.hasError());
+			CHECK(!reader.succeeded());
+			CHECK(!reader.needsInput());
+			CHECK(strcmp(reader.getErrorMessage(), "No error.") != 0);
+		}
+	}
+
+	// the part before the error was all seen, the one with bad headers
+	// never begins
+	std::string input = bodies[2];
+	MultipartCoReader reader("b");
+	Consumer consumer;
+	initConsumer(consumer);
+	Task task = consume(reader, consumer);
+	reader.feed(input.data(), input.size());
+	CHECK_EQUAL(consumer.parts.size(), 1);
+	CHECK(consumer.parts.size() == 1 && consumer.parts[0].data == "some data");
+	CHECK(consumer.ended.size() == 1 && consumer.ended[0]);
+
+	// cut short: nothing is wrong until close()
+	input = "--b\r\n\r\nsome da";
+	MultipartCoReader truncated("b");
+	Consumer waiting;
+	initConsumer(waiting);
+	Task waitingTask = consume(truncated, waiting);
+	CHECK(truncated.feed(input.data(), input.size()));
+	CHECK(!waitingTask.done());
+	truncated.close();
+	CHECK(waitingTask.done());
+	CHECK(!truncated.succeeded());
+	CHECK(!truncated.needsInput());
+	CHECK(waiting.parts.size() == 1 && waiting.parts[0].data == "some da");
+}
+
+int main() {
+	testFed();
+	testBackpressure();
+	testProducer();
+	testSkipped();
+	testErrors();
+	return testResult("CoReaderTest");
+}
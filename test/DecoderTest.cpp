@@ -0,0 +1,205 @@
+#include "TestHelper.h"
+
+/**
+ * Base64 and quoted-printable decode the same however the data is cut,
+ * and malformed base64 fails at the character that is wrong.
+ */
+
+static std::string base64(const std::string &data, size_t lineSize, bool pad) {
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	size_t line = 0;
+
+	for (size_t i = 0; i < data.size(); i += 3) {
+		uint32_t bits = (unsigned char) data[i] << 16;
+		size_t n = std::min((size_t) 3, data.size() - i);
+		if (n > 1) {
+			bits |= (unsigned char) data[i + 1] << 8;
+		}
+		if (n > 2) {
+			bits |= (unsigned char) data[i + 2];
+		}
+		for (size_t k = 0; k < 4; k++) {
+			if (k <= n) {
+				out += alphabet[(bits >> (18 - 6 * k)) & 63];
+			} else if (pad) {
+				out += '=';
+			}
+		}
+		if (lineSize > 0 && (line += 4) >= lineSize) {
+			out += "\r\n";
+			line = 0;
+		}
+	}
+	return out;
+}
+
+/** Decode in pieces of step characters, false if it failed. */
+static bool decode(MultipartTransferDecoder::Encoding encoding, const std::string &in,
+	size_t step, std::string &out)
+{
+	MultipartTransferDecoder decoder;
+	std::string buffer(step + MultipartTransferDecoder::SLACK, '\0');
+
+	decoder.reset(encoding);
+	out.clear();
+	for (size_t pos = 0; pos < in.size(); pos += step) {
+		size_t len = std::min(step, in.size() - pos);
+		out.append(buffer.data(), decoder.decode(in.data() + pos, len, &buffer[0]));
+		if (decoder.hasError()) {
+			return false;
+		}
+	}
+	out.append(buffer.data(), decoder.finish(&buffer[0]));
+	return !decoder.hasError();
+}
+
+static void testBase64() {
+	std::mt19937 rng(8);
+
+	for (int n = 0; n < 200; n++) {
+		std::string data;
+		for (size_t size = rng() % (n < 100 ? 40 : 3000); size > 0; size--) {
+			data += (char) rng();
+		}
+		std::string encoded = base64(data, n % 3 == 0 ? 0 : 76, n % 2 == 0);
+		for (size_t step : { (size_t) 1, (size_t) 3, (size_t) 17, (size_t) 64, encoded.size() + 1 }) {
+			std::string decoded;
+			CHECK(decode(MultipartTransferDecoder::BASE64, encoded, step, decoded));
+			CHECK(decoded == data);
+		}
+	}
+
+	std::string decoded;
+	CHECK(decode(MultipartTransferDecoder::BASE64, " QU\tJD\r\nRA=\n= \r\n", 1, decoded));
+	CHECK(decoded == "ABCD");
+	CHECK(decode(MultipartTransferDecoder::BASE64, "", 1, decoded));
+	CHECK(decoded.empty());
+}
+
+static void checkMalformed(const std::string &in, size_t position) {
+	MultipartTransferDecoder decoder;
+	std::string buffer(in.size() + MultipartTransferDecoder::SLACK, '\0');
+
+	decoder.reset(MultipartTransferDecoder::BASE64);
+	decoder.decode(in.data(), in.size(), &buffer[0]);
+	CHECK(decoder.hasError());
+	CHECK_EQUAL(decoder.getErrorPosition(), position);
+	CHECK(strcmp(decoder.getErrorMessage(), "No error.") != 0);
+	// nothing more once failed
+	CHECK_EQUAL(decoder.decode("QUJD", 4, &buffer[0]), 0);
+	CHECK_EQUAL(decoder.finish(&buffer[0]), 0);
+
+	for (size_t step : { 1, 2, 5 }) {
+		std::string decoded;
+		CHECK(!decode(MultipartTransferDecoder::BASE64, in, step, decoded));
+	}
+}
+
+static void testMalformedBase64() {
+	std::string run(64, 'A');
+
+	checkMalformed("QU!D", 2);
+	checkMalformed(run + "QUJD" + run + "-" + run, 2 * run.size() + 4);
+	checkMalformed(run + "\r\n" + run + "\x80", 2 * run.size() + 2);
+	checkMalformed("QUI=QUJD", 4);
+	checkMalformed("QUI=\r\n  Q", 8);
+	checkMalformed("=", 0);
+	checkMalformed("QUJDQ=", 5);
+
+	std::string decoded;
+	CHECK(!decode(MultipartTransferDecoder::BASE64, "QUJDQ", 1, decoded));
+	CHECK(!decode(MultipartTransferDecoder::BASE64, "QUJDQ\r\n", 7, decoded));
+	// unpadded is fine
+	CHECK(decode(MultipartTransferDecoder::BASE64, "QUJDQQ", 2, decoded));
+	CHECK(decoded == "ABCA");
+}
+
+static void testQuotedPrintable() {
+	struct {
+		const char *in;
+		const char *out;
+	} cases[] = {
+		{ "plain text", "plain text" },
+		{ "caf=C3=A9 =3d=3D", "caf\xc3\xa9 ==" },
+		{ "soft=\r\nbreak=\nhere", "softbreakhere" },
+		{ "hard\r\nbreak", "hard\r\nbreak" },
+		{ "not =G1 an escape, =4", "not =G1 an escape, =4" },
+		{ "cut =", "cut =" },
+		// an escape cut by the end of the data is kept
+		{ "=\r", "=\r" },
+		{ "a=\rb", "ab" },
+		{ "==41", "=A" }
+	};
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		for (size_t step : { 1, 2, 3, 100 }) {
+			std::string decoded;
+			CHECK(decode(MultipartTransferDecoder::QUOTED_PRINTABLE, cases[i].in, step, decoded));
+			if (decoded != cases[i].out) {
+				fprintf(stderr, "\"%s\" by %zu: \"%s\"\n", cases[i].in, step, decoded.c_str());
+				testFailures++;
+			}
+		}
+	}
+}
+
+static void testEncodingNames() {
+	CHECK_EQUAL(MultipartTransferDecoder::encodingOf("base64"), MultipartTransferDecoder::BASE64);
+	CHECK_EQUAL(MultipartTransferDecoder::encodingOf(" BASE64\t"), MultipartTransferDecoder::BASE64);
+	CHECK_EQUAL(MultipartTransferDecoder::encodingOf("Quoted-Printable"),
+		MultipartTransferDecoder::QUOTED_PRINTABLE);
+	CHECK_EQUAL(MultipartTransferDecoder::encodingOf("7bit"), MultipartTransferDecoder::IDENTITY);
+	CHECK_EQUAL(MultipartTransferDecoder::encodingOf("base64x"), MultipartTransferDecoder::IDENTITY);
+	CHECK_EQUAL(MultipartTransferDecoder::encodingOf(""), MultipartTransferDecoder::IDENTITY);
+}
+
+/** Through the reader, when asked for, and only then. */
+static void testReader() {
+	std::string data(100000, '\0');
+	std::mt19937 rng(9);
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = (char) rng();
+	}
+	std::string encoded = base64(data, 76, true);
+	std::string input =
+		"--b\r\n"
+		"Content-Transfer-Encoding: base64\r\n"
+		"\r\n" + encoded + "\r\n"
+		"--b\r\n"
+		"Content-Transfer-Encoding: quoted-printable\r\n"
+		"\r\n"
+		"a=3Db=\r\nc\r\n"
+		"--b\r\n"
+		"Content-Transfer-Encoding: 8bit\r\n"
+		"\r\n"
+		"a=3Db\r\n"
+		"--b--\r\n";
+
+	for (bool enabled : { true, false }) {
+		for (size_t chunkSize : { 0, 1, 1000 }) {
+			MultipartReader reader("b");
+			TestReaderLog log;
+			reader.setTransferDecoding(enabled);
+			log.attach(reader);
+			feedInChunks(reader, input, chunkSize);
+			CHECK(reader.succeeded());
+			CHECK_EQUAL(log.parts.size(), 3);
+			if (log.parts.size() == 3) {
+				CHECK(log.parts[0].data == (enabled ? data : encoded));
+				CHECK(log.parts[1].data == (enabled ? "a=bc" : "a=3Db=\r\nc"));
+				CHECK(log.parts[2].data == "a=3Db");
+			}
+		}
+	}
+}
+
+int main() {
+	testBase64();
+	testMalformedBase64();
+	testQuotedPrintable();
+	testEncodingNames();
+	testReader();
+	return testResult("DecoderTest");
+}
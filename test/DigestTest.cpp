@@ -0,0 +1,142 @@
+#include "TestHelper.h"
+
+/** Digest of data, fed in pieces of step bytes. */
+static MultipartDigest digestOf(MultipartDigest::Algorithm algorithm, const std::string &data,
+	size_t step)
+{
+	MultipartDigest digest;
+	digest.reset(algorithm);
+	for (size_t pos = 0; pos < data.size(); pos += step) {
+		digest.update(data.data() + pos, std::min(step, data.size() - pos));
+	}
+	digest.finish();
+	return digest;
+}
+
+static void checkVector(MultipartDigest::Algorithm algorithm, const std::string &data,
+	const char *expected)
+{
+	for (size_t step : { (size_t) 1, (size_t) 3, (size_t) 63, (size_t) 64, (size_t) 65, data.size() + 1 }) {
+		MultipartDigest digest = digestOf(algorithm, data, step);
+		if (digest.hex() != expected) {
+			fprintf(stderr, "algorithm %d, %zu bytes by %zu: %s, expected %s\n", algorithm,
+				data.size(), step, digest.hex().c_str(), expected);
+			testFailures++;
+		}
+		CHECK_EQUAL(digest.length(), data.size());
+	}
+}
+
+static void testKnownVectors() {
+	checkVector(MultipartDigest::CRC32C, "", "00000000");
+	checkVector(MultipartDigest::CRC32C, "123456789", "e3069283");
+	checkVector(MultipartDigest::CRC32C, std::string(32, '\0'), "8a9136aa");
+
+	checkVector(MultipartDigest::SHA256, "",
+		"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+	checkVector(MultipartDigest::SHA256, "abc",
+		"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	checkVector(MultipartDigest::SHA256, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+	checkVector(MultipartDigest::SHA256, std::string(1000000, 'a'),
+		"cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+	checkVector(MultipartDigest::XXH64, "", "ef46db3751d8e999");
+	checkVector(MultipartDigest::XXH64, "abc", "44bc2cf5ad770999");
+
+	MultipartDigest crc = digestOf(MultipartDigest::CRC32C, "123456789", 4);
+	CHECK_EQUAL(crc.size(), 4);
+	CHECK_EQUAL(crc.value(), 0xe3069283);
+	MultipartDigest none = digestOf(MultipartDigest::NONE, "abc", 1);
+	CHECK_EQUAL(none.size(), 0);
+	CHECK(none.hex().empty());
+}
+
+static const char nestedBody[] =
+	"--outer\r\n"
+	"Content-Disposition: form-data; name=\"a\"\r\n"
+	"\r\n"
+	"abc\r\n"
+	"--outer\r\n"
+	"Content-Disposition: form-data; name=\"files\"\r\n"
+	"Content-Type: multipart/mixed; boundary=inner\r\n"
+	"\r\n"
+	"--inner\r\n"
+	"Content-Disposition: file; filename=\"one.txt\"\r\n"
+	"\r\n"
+	"123456789\r\n"
+	"--inner\r\n"
+	"Content-Disposition: file; filename=\"two.txt\"\r\n"
+	"\r\n"
+	"abc\r\n"
+	"--inner--\r\n"
+	"--outer\r\n"
+	"Content-Disposition: form-data; name=\"b\"\r\n"
+	"\r\n"
+	"\r\n"
+	"--outer--\r\n";
+
+static void checkNestedDigests(const TestReaderLog &log) {
+	CHECK(log.ended);
+	CHECK_EQUAL(log.parts.size(), 5);
+	if (log.parts.size() != 5) {
+		return;
+	}
+	CHECK(log.parts[0].digest == "44bc2cf5ad770999");
+	// descended into: no digest, not even that of its last part
+	CHECK_EQUAL(log.parts[1].depth, 0);
+	CHECK(log.parts[1].ended);
+	CHECK_EQUAL(log.parts[1].digestAlgorithm, MultipartDigest::NONE);
+	CHECK(log.parts[1].digest.empty());
+	CHECK_EQUAL(log.parts[2].depth, 1);
+	CHECK(log.parts[2].data == "123456789");
+	CHECK_EQUAL(log.parts[2].digestAlgorithm, MultipartDigest::XXH64);
+	CHECK(log.parts[2].digest == digestOf(MultipartDigest::XXH64, "123456789", 9).hex());
+	CHECK(log.parts[3].digest == "44bc2cf5ad770999");
+	CHECK(log.parts[4].digest == "ef46db3751d8e999");
+}
+
+static void testReaderDigests() {
+	std::string body = nestedBody;
+	MultipartReader reader("outer");
+	TestReaderLog log;
+
+	reader.setMaxDepth(1);
+	reader.setDigest(MultipartDigest::XXH64);
+	log.attach(reader);
+	reader.feed(body.data(), body.size());
+	CHECK(reader.succeeded());
+	checkNestedDigests(log);
+}
+
+/** The same digests when the reader is checkpointed and restored at any byte. */
+static void testDigestsAcrossCheckpoints() {
+	std::string body = nestedBody;
+
+	for (size_t cut = 1; cut < body.size(); cut++) {
+		MultipartReader first("outer");
+		TestReaderLog log;
+		first.setMaxDepth(1);
+		first.setDigest(MultipartDigest::XXH64);
+		log.attach(first);
+		CHECK(first.feed(body.data(), cut) == cut || first.succeeded());
+
+		std::string checkpoint;
+		CHECK(first.serialize(checkpoint));
+		MultipartReader second;
+		second.setMaxDepth(1);
+		second.setDigest(MultipartDigest::XXH64);
+		CHECK_EQUAL(second.deserialize(checkpoint), checkpoint.size());
+		log.attach(second);
+		second.feed(body.data() + cut, body.size() - cut);
+		CHECK(second.succeeded());
+		checkNestedDigests(log);
+	}
+}
+
+int main() {
+	testKnownVectors();
+	testReaderDigests();
+	testDigestsAcrossCheckpoints();
+	return testResult("DigestTest");
+}
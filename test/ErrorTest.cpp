@@ -0,0 +1,145 @@
+#include "TestHelper.h"
+
+/**
+ * Every error is told with its code and the offset of the byte it was
+ * found at, whatever the size of the buffers the body came in.
+ */
+
+static const std::string head = "--b\r\n";
+static const std::string base64Head =
+	"--b\r\n"
+	"Content-Transfer-Encoding: base64\r\n"
+	"\r\n";
+
+static std::string repeat(const char *s, size_t times) {
+	std::string out;
+	for (size_t i = 0; i < times; i++) {
+		out += s;
+	}
+	return out;
+}
+
+static std::string nestedHead(const std::string &boundary) {
+	return "--b\r\n"
+		"Content-Type: multipart/mixed; boundary=" + boundary + "\r\n"
+		"\r\n";
+}
+
+static void checkError(const std::string &body, MultipartError::Code code, uint64_t offset) {
+	for (size_t chunkSize : { (size_t) 1, (size_t) 3, (size_t) 0 }) {
+		MultipartReader reader("b");
+		TestReaderLog log;
+		reader.setTransferDecoding(true);
+		reader.setMaxDepth(2);
+		log.attach(reader);
+		feedInChunks(reader, body, chunkSize);
+
+		const MultipartError &error = reader.getError();
+		if (error.code != code || error.offset != offset) {
+			fprintf(stderr, "in chunks of %zu, expected %s at %llu, got:\n  ", chunkSize,
+				MultipartError::describe(code), (unsigned long long) offset);
+			error.print(stderr);
+			testFailures++;
+		}
+		CHECK(reader.hasError());
+		CHECK(reader.stopped());
+		CHECK(!reader.isPaused());
+		if (error.contextSize > 0) {
+			CHECK(error.contextOffset < error.contextSize);
+			CHECK(error.offset < body.size() && error.context[error.contextOffset] == body[error.offset]);
+		}
+	}
+}
+
+static void testParserErrors() {
+	checkError("--c\r\n", MultipartError::BOUNDARY_MISMATCH, 2);
+	checkError("--bX\r\n", MultipartError::BOUNDARY_CR_EXPECTED, 3);
+	checkError("--b\rX", MultipartError::BOUNDARY_LF_EXPECTED, 4);
+	checkError(head + ": v\r\n", MultipartError::EMPTY_HEADER_NAME, 5);
+	checkError(head + "A1: v\r\n", MultipartError::BAD_HEADER_NAME, 6);
+	checkError(head + "A: v\rX", MultipartError::HEADER_LF_EXPECTED, 10);
+	checkError(head + "A: v\r\n\rX", MultipartError::HEADERS_LF_EXPECTED, 12);
+}
+
+static void testDecodingErrors() {
+	// long enough to go through the vectorized decoder first
+	std::string body = base64Head + repeat("QUJD", 40) + "!" + repeat("QUJD", 40) + "\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_TRANSFER_ENCODING, body.find('!'));
+
+	body = base64Head + repeat("QUJD", 40) + "\r\n" + repeat("QUJD", 10) + "\x01QUJD\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_TRANSFER_ENCODING, body.find('\x01'));
+
+	body = base64Head + "QUI=QUJD\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_TRANSFER_ENCODING, base64Head.size() + 4);
+
+	body = base64Head + "Q===\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_TRANSFER_ENCODING, base64Head.size() + 1);
+
+	// cut short: found at the end of the data
+	body = base64Head + repeat("QUJD", 20) + "Q\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_TRANSFER_ENCODING, body.find("\r\n--b--"));
+
+	// in the second part
+	body = base64Head + "QUJD\r\n" + base64Head + "QU JD\tQUJD*\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_TRANSFER_ENCODING, body.find('*'));
+}
+
+static void testNestedErrors() {
+	std::string inner = "--in\r\n"
+		"Content-Transfer-Encoding: base64\r\n"
+		"\r\n"
+		"QUJDQUJD%\r\n"
+		"--in--\r\n";
+	std::string body = nestedHead("in") + inner + "\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_TRANSFER_ENCODING, body.find('%'));
+
+	// two levels deep
+	std::string deep = "--in\r\n"
+		"Content-Type: multipart/mixed; boundary=deep\r\n"
+		"\r\n"
+		"--deep\r\n";
+	body = nestedHead("in") + deep + "A1: x\r\n\r\n--deep--\r\n--in--\r\n\r\n--b--\r\n";
+	checkError(body, MultipartError::BAD_HEADER_NAME, body.find("A1") + 1);
+
+	body = nestedHead("in") + deep + "\r\ndata\r\n--deeX\r\n--in--\r\n\r\n--b--\r\n";
+	checkError(body, MultipartError::NESTED_BODY_UNTERMINATED, body.find("\r\n--in--"));
+
+	body = nestedHead("in") + "--out\r\n\r\n--b--\r\n";
+	checkError(body, MultipartError::BOUNDARY_MISMATCH, nestedHead("in").size() + 2);
+
+	// the outer part ends before the nested body does
+	body = nestedHead("in") + "--in\r\n\r\nunterminated\r\n--b--\r\n";
+	checkError(body, MultipartError::NESTED_BODY_UNTERMINATED, body.find("\r\n--b--"));
+
+	std::string longBoundary(MultipartParser::MAX_BOUNDARY_SIZE + 1, 'x');
+	body = nestedHead(longBoundary) + "\r\n--b--\r\n";
+	checkError(body, MultipartError::NESTED_BOUNDARY_TOO_LONG, nestedHead(longBoundary).size() - 1);
+}
+
+/** A reader restored from a checkpoint still knows where its part data began. */
+static void testErrorAfterCheckpoint() {
+	std::string body = base64Head + repeat("QUJD", 10) + "#QUJD\r\n--b--\r\n";
+
+	for (size_t cut = 1; cut < body.find('#'); cut++) {
+		MultipartReader first("b");
+		first.setTransferDecoding(true);
+		CHECK_EQUAL(first.feed(body.data(), cut), cut);
+		std::string checkpoint;
+		CHECK(first.serialize(checkpoint));
+
+		MultipartReader second;
+		second.setTransferDecoding(true);
+		CHECK_EQUAL(second.deserialize(checkpoint), checkpoint.size());
+		second.feed(body.data() + cut, body.size() - cut);
+		CHECK_EQUAL(second.getError().code, MultipartError::BAD_TRANSFER_ENCODING);
+		CHECK_EQUAL(second.getError().offset, body.find('#'));
+	}
+}
+
+int main() {
+	testParserErrors();
+	testDecodingErrors();
+	testNestedErrors();
+	testErrorAfterCheckpoint();
+	return testResult("ErrorTest");
+}
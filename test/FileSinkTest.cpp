@@ -0,0 +1,270 @@
+#include "TestHelper.h"
+#include "MultipartFileSink.h"
+#include <fcntl.h>
+#include <thread>
+
+/**
+ * Each part lands in the descriptor opened for it, whether the body is
+ * mapped or streamed and whichever way the data is moved, and every
+ * descriptor opened is closed, failures included.
+ */
+
+/** What the sink opened and closed, and where the data of each part went. */
+struct SinkLog {
+	std::vector<std::string> names;
+	std::vector<int> fds;       // in the order they were opened, -1 if skipped
+	std::vector<int> closed;
+	int (*open)(const std::string &name);
+
+	static int partOpen(const MultipartHeaders &headers, void *userData) {
+		SinkLog *self = (SinkLog *) userData;
+		self->names.push_back(std::string(headers.name()));
+		self->fds.push_back(self->open(self->names.back()));
+		return self->fds.back();
+	}
+
+	static void partClose(int fd, void *userData) {
+		((SinkLog *) userData)->closed.push_back(fd);
+	}
+
+	void attach(MultipartFileSink &sink) {
+		sink.onPartOpen  = partOpen;
+		sink.onPartClose = partClose;
+		sink.userData    = this;
+	}
+
+	size_t opened() const {
+		size_t n = 0;
+		for (size_t i = 0; i < fds.size(); i++) {
+			n += fds[i] != -1;
+		}
+		return n;
+	}
+};
+
+static int temporaryFile(int flags = 0) {
+	char path[] = "/tmp/FileSinkTestXXXXXX";
+	int fd = mkostemp(path, flags);
+	CHECK(fd != -1);
+	unlink(path);
+	return fd;
+}
+
+static std::string contents(int fd) {
+	std::string out;
+	char buffer[4096];
+	ssize_t len;
+	off_t offset = 0;
+	while ((len = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+		out.append(buffer, len);
+		offset += len;
+	}
+	return out;
+}
+
+/** body, as a regular file (mapped) or through a pipe (streamed). */
+static int input(const std::string &body, bool mapped, std::thread &writer) {
+	if (mapped) {
+		int fd = temporaryFile();
+		CHECK_EQUAL(write(fd, body.data(), body.size()), (ssize_t) body.size());
+		return fd;
+	}
+	int fds[2];
+	CHECK(pipe(fds) == 0);
+	writer = std::thread([body, fds]() {
+		size_t pos = 0;
+		while (pos < body.size()) {
+			ssize_t ret = write(fds[1], body.data() + pos, body.size() - pos);
+			if (ret <= 0) {
+				break;
+			}
+			pos += ret;
+		}
+		close(fds[1]);
+	});
+	return fds[0];
+}
+
+static bool run(MultipartFileSink &sink, const std::string &body, const std::string &boundary,
+	bool mapped)
+{
+	std::thread writer;
+	int fd = input(body, mapped, writer);
+	bool ok = sink.run(fd, boundary);
+	// unblock the writer if the sink stopped reading early
+	close(fd);
+	if (writer.joinable()) {
+		writer.join();
+	}
+	return ok;
+}
+
+static int openFile(const std::string &name) {
+	return name == "skipped" ? -1 : temporaryFile();
+}
+
+static int openAppending(const std::string &) {
+	return temporaryFile(O_APPEND);
+}
+
+static void testParts(int (*open)(const std::string &), bool mapped) {
+	std::mt19937 rng(10);
+
+	for (int n = 0; n < 10; n++) {
+		TestBody t = randomBody(rng, n % 2 == 0 ? 300000 : 300);
+		MultipartFileSink sink;
+		SinkLog log;
+		log.open = open;
+		log.attach(sink);
+		CHECK(run(sink, t.body, t.boundary, mapped));
+		CHECK_EQUAL(sink.getSystemError(), 0);
+		CHECK_EQUAL(log.fds.size(), t.parts.size());
+		CHECK(log.closed == log.fds);
+		for (size_t i = 0; i < log.fds.size() && i < t.parts.size(); i++) {
+			CHECK(contents(log.fds[i]) == t.parts[i].data);
+			close(log.fds[i]);
+		}
+		if (mapped && open == openAppending) {
+			// neither copy_file_range() nor sendfile() take O_APPEND outputs
+			CHECK_EQUAL(sink.bytesCopiedByKernel, 0);
+		} else if (mapped) {
+			CHECK_EQUAL(sink.bytesCopiedByUser, 0);
+		} else {
+			CHECK_EQUAL(sink.bytesCopiedByKernel, 0);
+		}
+	}
+}
+
+// read ends of the pipes openPipe() made, in order
+static std::vector<int> pipeOutputs;
+
+static int openPipe(const std::string &) {
+	int fds[2];
+	CHECK(pipe(fds) == 0);
+	pipeOutputs.push_back(fds[0]);
+	return fds[1];
+}
+
+/** Mapped bodies go to pipes by sendfile(), small enough not to block. */
+static void testPipeOutputs() {
+	std::mt19937 rng(11);
+
+	for (int n = 0; n < 10; n++) {
+		TestBody t = randomBody(rng, 3000);
+		MultipartFileSink sink;
+		SinkLog log;
+		log.open = openPipe;
+		log.attach(sink);
+		pipeOutputs.clear();
+		CHECK(run(sink, t.body, t.boundary, true));
+		CHECK(log.closed == log.fds);
+		CHECK_EQUAL(sink.bytesCopiedByUser, 0);
+		for (size_t i = 0; i < pipeOutputs.size() && i < t.parts.size(); i++) {
+			close(log.fds[i]);
+			std::string data;
+			char buffer[4096];
+			ssize_t len;
+			while ((len = read(pipeOutputs[i], buffer, sizeof(buffer))) > 0) {
+				data.append(buffer, len);
+			}
+			CHECK(data == t.parts[i].data);
+			close(pipeOutputs[i]);
+		}
+	}
+}
+
+static const std::string threeParts =
+	"--b\r\n"
+	"Content-Disposition: form-data; name=\"first\"\r\n"
+	"\r\n"
+	"1\r\n"
+	"--b\r\n"
+	"Content-Disposition: form-data; name=\"skipped\"\r\n"
+	"\r\n"
+	"2\r\n"
+	"--b\r\n"
+	"Content-Disposition: form-data; name=\"third\"\r\n"
+	"\r\n"
+	"3\r\n"
+	"--b--\r\n";
+
+static void testSkipped(bool mapped) {
+	MultipartFileSink sink;
+	SinkLog log;
+	log.open = openFile;
+	log.attach(sink);
+	CHECK(run(sink, threeParts, "b", mapped));
+	CHECK_EQUAL(log.fds.size(), 3);
+	CHECK_EQUAL(log.closed.size(), 2);
+	if (log.fds.size() == 3) {
+		CHECK_EQUAL(log.fds[1], -1);
+		CHECK(contents(log.fds[0]) == "1");
+		CHECK(contents(log.fds[2]) == "3");
+		close(log.fds[0]);
+		close(log.fds[2]);
+	}
+}
+
+static int openFullSecond(const std::string &name) {
+	return name == "skipped" ? ::open("/dev/full", O_WRONLY) : temporaryFile();
+}
+
+/** A write fails: what was opened is closed, and nothing is opened after. */
+static void testWriteFailure(bool mapped) {
+	MultipartFileSink sink;
+	SinkLog log;
+	log.open = openFullSecond;
+	log.attach(sink);
+	CHECK(!run(sink, threeParts, "b", mapped));
+	CHECK_EQUAL(sink.getSystemError(), ENOSPC);
+	CHECK_EQUAL(log.fds.size(), 2);
+	CHECK(log.closed == log.fds);
+	for (size_t i = 0; i < log.fds.size(); i++) {
+		close(log.fds[i]);
+	}
+
+	// the same sink goes on with another body
+	log = SinkLog();
+	log.open = openFile;
+	log.attach(sink);
+	CHECK(run(sink, threeParts, "b", mapped));
+	CHECK_EQUAL(sink.getSystemError(), 0);
+	CHECK(strcmp(sink.getErrorMessage(), "No error.") == 0);
+	for (size_t i = 0; i < log.fds.size(); i++) {
+		if (log.fds[i] != -1) {
+			close(log.fds[i]);
+		}
+	}
+}
+
+static void testMalformed(bool mapped) {
+	MultipartFileSink sink;
+	SinkLog log;
+	log.open = openFile;
+	log.attach(sink);
+	std::string body = threeParts.substr(0, threeParts.find("3\r\n"));
+	CHECK(!run(sink, body, "b", mapped));
+	CHECK_EQUAL(sink.getSystemError(), 0);
+	CHECK(strcmp(sink.getErrorMessage(), "No error.") != 0);
+	// the part cut short is closed all the same when streamed, never
+	// opened when mapped
+	CHECK_EQUAL(log.opened(), mapped ? 0 : 2);
+	CHECK(log.closed.size() == log.opened());
+	for (size_t i = 0; i < log.fds.size(); i++) {
+		if (log.fds[i] != -1) {
+			close(log.fds[i]);
+		}
+	}
+}
+
+int main() {
+	for (bool mapped : { true, false }) {
+		testParts(openFile, mapped);
+		testParts(openAppending, mapped);
+		testSkipped(mapped);
+		testWriteFailure(mapped);
+		testMalformed(mapped);
+	}
+	testPipeOutputs();
+	return testResult("FileSinkTest");
+}
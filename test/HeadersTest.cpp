@@ -0,0 +1,89 @@
+#include "TestHelper.h"
+
+/**
+ * Well-known headers are recognized whatever their case, and however
+ * their name is cut by the buffers, and nothing else is taken for them.
+ */
+
+static const char body[] =
+	"--b\r\n"
+	"content-DISPOSITION: form-data; name=\"field\"; filename=\"a.txt\"\r\n"
+	"Content-Typo: not/it\r\n"
+	"Content-Type-Extra: not/it\r\n"
+	"Content-Typ: not/it\r\n"
+	"X-Content-Type: not/it\r\n"
+	"CONTENT-TYPE: text/plain\r\n"
+	"Content-Type: text/second\r\n"
+	"content-transfer-encoding: 8bit\r\n"
+	"Content-Length: 4\r\n"
+	"Content-Id: <id>\r\n"
+	"\r\n"
+	"data\r\n"
+	"--b--\r\n";
+
+static void checkHeaders(const MultipartHeaders &headers) {
+	CHECK_EQUAL(headers.size(), 10);
+	CHECK(headers[MultipartHeaders::CONTENT_DISPOSITION]
+		== "form-data; name=\"field\"; filename=\"a.txt\"");
+	CHECK(headers[MultipartHeaders::CONTENT_TYPE] == "text/plain");
+	CHECK(headers[MultipartHeaders::CONTENT_TRANSFER_ENCODING] == "8bit");
+	CHECK(headers[MultipartHeaders::CONTENT_LENGTH] == "4");
+	CHECK(headers[MultipartHeaders::CONTENT_ID] == "<id>");
+
+	CHECK(headers["content-type"] == "text/plain");
+	CHECK(headers["Content-Typo"] == "not/it");
+	CHECK(headers["Content-Type-Extra"] == "not/it");
+	CHECK(headers["x-content-type"] == "not/it");
+	CHECK(headers["Missing"].empty());
+	CHECK(headers.find(MultipartHeaders::CONTENT_TYPE) == headers.find("Content-Type"));
+	CHECK(headers.find("Missing") == headers.end());
+
+	CHECK(headers.disposition() == "form-data");
+	CHECK(headers.hasName());
+	CHECK(headers.name() == "field");
+	CHECK(headers.hasFilename());
+	CHECK(headers.filename() == "a.txt");
+}
+
+static void partBegin(const MultipartHeaders &headers, void *userData) {
+	checkHeaders(headers);
+	(*(int *) userData)++;
+}
+
+static void testStreamed() {
+	std::string input = body;
+
+	for (size_t chunkSize = 0; chunkSize < 40; chunkSize++) {
+		MultipartReader reader("b");
+		int parts = 0;
+		reader.onPartBegin = partBegin;
+		reader.userData = &parts;
+		feedInChunks(reader, input, chunkSize);
+		CHECK(reader.succeeded());
+		CHECK_EQUAL(parts, 1);
+	}
+}
+
+static void testAssigned() {
+	MultipartIndex index;
+	MultipartParser parser("b");
+	MultipartHeaders headers;
+
+	CHECK(parser.parseContiguous(body, index));
+	headers.assign(index.headers(0));
+	checkHeaders(headers);
+
+	headers.assign("Content-Disposition: attachment\r\n");
+	CHECK_EQUAL(headers.size(), 1);
+	CHECK(headers.disposition() == "attachment");
+	CHECK(!headers.hasName());
+	CHECK(!headers.hasFilename());
+	CHECK(headers[MultipartHeaders::CONTENT_TYPE].empty());
+	CHECK(headers.find(MultipartHeaders::CONTENT_TYPE) == headers.end());
+}
+
+int main() {
+	testStreamed();
+	testAssigned();
+	return testResult("HeadersTest");
+}
@@ -0,0 +1,150 @@
+#include "TestHelper.h"
+#include "MultipartParallel.h"
+#include "MappedMultipartFile.h"
+
+/**
+ * parseContiguous() finds the same parts as feed(), on one thread or
+ * several, or in a mapped file, and fails where feed() does.
+ */
+
+static void checkIndex(const TestBody &t, const MultipartIndex &index) {
+	CHECK_EQUAL(index.size(), t.parts.size());
+	for (size_t i = 0; i < index.size() && i < t.parts.size(); i++) {
+		CHECK(index.data(i) == t.parts[i].data);
+		for (size_t h = 0; h < t.parts[i].headers.size(); h++) {
+			CHECK(index.header(i, t.parts[i].headers[h].first) == t.parts[i].headers[h].second);
+		}
+	}
+}
+
+static void testSameAsStreaming() {
+	std::mt19937 rng(4);
+
+	for (int n = 0; n < 300; n++) {
+		TestBody t = randomBody(rng, n % 3 == 0 ? 20000 : 300);
+		TestParser parser;
+		parser.setBoundary(t.boundary);
+		MultipartIndex index;
+		CHECK(parser.parseContiguous(t.body, index));
+		checkIndex(t, index);
+
+		feedInChunks(parser, t.body, 0);
+		CHECK(parser.succeeded());
+		CHECK(parser.parts == t.parts);
+	}
+}
+
+static void testParallel() {
+	std::mt19937 rng(5);
+	TestBody t;
+
+	// enough parts of enough data for several threads, with the data of
+	// random bodies that have other boundaries
+	t.boundary = "parallel-0123456789";
+	t.body = "--" + t.boundary;
+	while (t.body.size() < 8 * 1024 * 1024) {
+		TestBody other = randomBody(rng, 500000);
+		for (size_t i = 0; i < other.parts.size(); i++) {
+			t.parts.push_back(TestPart());
+			t.parts.back().data = other.parts[i].data;
+			t.body += "\r\n\r\n" + other.parts[i].data + "\r\n--" + t.boundary;
+		}
+	}
+	t.body += "--\r\n";
+	TestParser parser;
+	parser.setBoundary(t.boundary);
+	for (unsigned threads : { 1, 2, 3, 8 }) {
+		MultipartIndex index;
+		CHECK(MultipartParallel::parseContiguous(parser, t.body, index, threads));
+		checkIndex(t, index);
+	}
+}
+
+static void testMalformed() {
+	const char *bodies[] = {
+		"--b\r\n\r\nno end",
+		"--b\r\n\r\nno end\r\n--b",
+		"--b\r\nA: v\r\nno empty line",
+		"--c\r\n\r\n\r\n--b--\r\n",
+		"--bX\r\n\r\n\r\n--b--\r\n"
+	};
+
+	for (const char *body : bodies) {
+		TestParser parser;
+		parser.setBoundary("b");
+		MultipartIndex index;
+		CHECK(!parser.parseContiguous(body, index));
+		CHECK(strcmp(index.getErrorMessage(), "No error.") != 0);
+
+		feedInChunks(parser, body, 0);
+		CHECK(!parser.succeeded());
+	}
+}
+
+/** A temporary file holding contents, open for reading. */
+static int temporaryFile(const std::string &contents) {
+	char path[] = "/tmp/IndexTestXXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd != -1);
+	unlink(path);
+	CHECK_EQUAL(write(fd, contents.data(), contents.size()), (ssize_t) contents.size());
+	return fd;
+}
+
+static void testMappedFile() {
+	std::mt19937 rng(6);
+
+	for (int n = 0; n < 20; n++) {
+		TestBody t = randomBody(rng, 100000);
+		int fd = temporaryFile(t.body);
+		MappedMultipartFile file;
+		CHECK(file.open(fd, t.boundary));
+		close(fd);
+		CHECK(file.succeeded());
+		CHECK(file.contents() == t.body);
+		checkIndex(t, file.parts());
+		for (size_t i = 0; i < file.size(); i++) {
+			file.release(i);
+			CHECK(file.data(i) == t.parts[i].data);
+		}
+	}
+
+	int fd = temporaryFile("--b\r\n"
+		"Content-Disposition: form-data; name=\"first\"\r\n"
+		"\r\n"
+		"1\r\n"
+		"--b\r\n"
+		"Content-Disposition: form-data; name*=UTF-8''s%C3%A9cond\r\n"
+		"\r\n"
+		"2\r\n"
+		"--b--\r\n");
+	MappedMultipartFile file;
+	CHECK(file.open(fd, "b"));
+	close(fd);
+	CHECK(file.field("first") == "1");
+	CHECK(file.field("s\xc3\xa9" "cond") == "2");
+	CHECK(file.field("third").empty());
+
+	fd = temporaryFile("");
+	CHECK(!file.open(fd, "b"));
+	close(fd);
+	fd = temporaryFile("--b\r\n\r\nno end");
+	CHECK(!file.open(fd, "b"));
+	CHECK(!file.succeeded());
+	close(fd);
+
+	int pipeFds[2];
+	CHECK(pipe(pipeFds) == 0);
+	CHECK(!file.open(pipeFds[0], "b"));
+	CHECK_EQUAL(file.getSystemError(), 0);
+	close(pipeFds[0]);
+	close(pipeFds[1]);
+}
+
+int main() {
+	testSameAsStreaming();
+	testParallel();
+	testMalformed();
+	testMappedFile();
+	return testResult("IndexTest");
+}
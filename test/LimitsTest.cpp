@@ -0,0 +1,229 @@
+#include "TestHelper.h"
+
+/**
+ * A body going beyond a limit fails at the byte that does, with the code
+ * of that limit, and a body just within every limit goes through.
+ */
+
+static const std::string head = "--b\r\n";
+
+static std::string repeat(const char *s, size_t times) {
+	std::string out;
+	for (size_t i = 0; i < times; i++) {
+		out += s;
+	}
+	return out;
+}
+
+static std::string nestedHead(const std::string &boundary) {
+	return "--b\r\n"
+		"Content-Type: multipart/mixed; boundary=" + boundary + "\r\n"
+		"\r\n";
+}
+
+/** Parse body with reader, one level of nesting, its events into log. */
+static void parse(MultipartReader &reader, const std::string &body,
+	const MultipartLimits &limits, size_t chunkSize, TestReaderLog &log)
+{
+	reader.setBoundary("b");
+	reader.setMaxDepth(1);
+	reader.setLimits(limits);
+	log.attach(reader);
+	feedInChunks(reader, body, chunkSize);
+}
+
+static void checkExceeded(const std::string &body, const MultipartLimits &limits,
+	MultipartLimits::Kind kind, MultipartError::Code code, uint64_t offset)
+{
+	for (size_t chunkSize : { (size_t) 1, (size_t) 3, (size_t) 0 }) {
+		MultipartReader reader;
+		TestReaderLog log;
+		parse(reader, body, limits, chunkSize, log);
+		const MultipartError &error = reader.getError();
+		if (error.code != code || error.offset != offset) {
+			fprintf(stderr, "in chunks of %zu, expected %s at %llu, got:\n  ", chunkSize,
+				MultipartError::describe(code), (unsigned long long) offset);
+			error.print(stderr);
+			testFailures++;
+		}
+		CHECK(reader.hasError());
+		CHECK_EQUAL(reader.getLimitExceeded(), kind);
+		CHECK_EQUAL(error.limit(), kind);
+		CHECK(!log.ended);
+		if (error.contextSize > 0) {
+			CHECK(error.offset < body.size() && error.context[error.contextOffset] == body[error.offset]);
+		}
+		// nothing beyond the limits was handed over, one nested body at most
+		size_t parts[2] = { 0, 0 };
+		for (size_t i = 0; i < log.parts.size(); i++) {
+			parts[log.parts[i].depth]++;
+			CHECK(log.parts[i].data.size() <= limits.maxPartSize);
+		}
+		CHECK(parts[0] <= limits.maxParts);
+		CHECK(parts[1] <= limits.maxParts);
+	}
+}
+
+static void checkWithin(const std::string &body, const MultipartLimits &limits) {
+	for (size_t chunkSize : { (size_t) 1, (size_t) 3, (size_t) 0 }) {
+		MultipartReader reader;
+		TestReaderLog log;
+		parse(reader, body, limits, chunkSize, log);
+		if (!reader.succeeded()) {
+			fprintf(stderr, "in chunks of %zu, unexpected:\n  ", chunkSize);
+			reader.getError().print(stderr);
+			testFailures++;
+		}
+		CHECK_EQUAL(reader.getLimitExceeded(), MultipartLimits::NONE);
+		CHECK(log.ended);
+	}
+}
+
+static void testHeaderLine() {
+	MultipartLimits limits;
+	std::string body = head + "Ab:  cd\r\n\r\ndata\r\n--b--\r\n";
+
+	limits.maxHeaderLineSize = 7;
+	checkWithin(body, limits);
+	// in the value, in the spaces before it and in the name
+	limits.maxHeaderLineSize = 6;
+	checkExceeded(body, limits, MultipartLimits::HEADER_LINE,
+		MultipartError::HEADER_LINE_LIMIT, head.size() + 6);
+	limits.maxHeaderLineSize = 4;
+	checkExceeded(body, limits, MultipartLimits::HEADER_LINE,
+		MultipartError::HEADER_LINE_LIMIT, head.size() + 4);
+	limits.maxHeaderLineSize = 1;
+	checkExceeded(body, limits, MultipartLimits::HEADER_LINE,
+		MultipartError::HEADER_LINE_LIMIT, head.size() + 1);
+
+	// each line on its own
+	limits.maxHeaderLineSize = 4;
+	checkWithin(head + "A: b\r\nC: d\r\n\r\n\r\n--b--\r\n", limits);
+}
+
+static void testHeaders() {
+	MultipartLimits limits;
+	std::string part = head + "A: 1\r\nB: 2\r\n\r\ndata\r\n";
+	std::string body = part + part + "--b--\r\n";
+
+	limits.maxHeadersPerPart = 2;
+	checkWithin(body, limits);
+	limits.maxHeadersPerPart = 1;
+	checkExceeded(body, limits, MultipartLimits::HEADERS,
+		MultipartError::HEADERS_LIMIT, body.find("B:"));
+	limits.maxHeadersPerPart = 0;
+	checkExceeded(body, limits, MultipartLimits::HEADERS,
+		MultipartError::HEADERS_LIMIT, body.find("A:"));
+	checkWithin(head + "\r\ndata\r\n--b--\r\n", limits);
+}
+
+static void testParts() {
+	MultipartLimits limits;
+	std::string body = head + "\r\n1\r\n" + head + "\r\n2\r\n" + head + "\r\n3\r\n--b--\r\n";
+
+	limits.maxParts = 3;
+	checkWithin(body, limits);
+	limits.maxParts = 2;
+	checkExceeded(body, limits, MultipartLimits::PARTS,
+		MultipartError::PARTS_LIMIT, body.rfind(head) + head.size() - 1);
+	// the first part is begun on the first boundary
+	limits.maxParts = 0;
+	checkExceeded(body, limits, MultipartLimits::PARTS,
+		MultipartError::PARTS_LIMIT, head.size() - 1);
+}
+
+static void testPartSize() {
+	MultipartLimits limits;
+	std::string part = head + "A: v\r\n\r\n";
+	std::string body = part + "0123456789\r\n" + part + "01234\r\n--b--\r\n";
+	uint64_t dataStart = part.size();
+
+	limits.maxPartSize = 10;
+	checkWithin(body, limits);
+	limits.maxPartSize = 9;
+	checkExceeded(body, limits, MultipartLimits::PART_SIZE,
+		MultipartError::PART_SIZE_LIMIT, dataStart + 9);
+	limits.maxPartSize = 0;
+	checkExceeded(body, limits, MultipartLimits::PART_SIZE,
+		MultipartError::PART_SIZE_LIMIT, dataStart);
+
+	// what looked like a boundary is data once it turns out not to be, the
+	// limit is still told at the byte beyond it
+	body = part + "01\r\n--bX\r\n--b--\r\n";
+	limits.maxPartSize = 8;
+	checkWithin(body, limits);
+	limits.maxPartSize = 3;
+	checkExceeded(body, limits, MultipartLimits::PART_SIZE,
+		MultipartError::PART_SIZE_LIMIT, dataStart + 3);
+
+	// large parts, most of the data skipped in one go
+	body = part + std::string(100000, 'x') + "\r\n--b--\r\n";
+	limits.maxPartSize = 100000;
+	checkWithin(body, limits);
+	limits.maxPartSize = 65536;
+	checkExceeded(body, limits, MultipartLimits::PART_SIZE,
+		MultipartError::PART_SIZE_LIMIT, dataStart + 65536);
+}
+
+static void testBodySize() {
+	MultipartLimits limits;
+	std::string body = head + "\r\n" + repeat("data", 100) + "\r\n--b--\r\n";
+
+	limits.maxBodySize = body.size();
+	checkWithin(body, limits);
+	limits.maxBodySize = 100;
+	checkExceeded(body, limits, MultipartLimits::BODY_SIZE,
+		MultipartError::BODY_SIZE_LIMIT, 100);
+	limits.maxBodySize = 2;
+	checkExceeded(body, limits, MultipartLimits::BODY_SIZE,
+		MultipartError::BODY_SIZE_LIMIT, 2);
+
+	// the epilogue does not count
+	limits.maxBodySize = body.size();
+	checkWithin(body + "epilogue", limits);
+}
+
+/** Nested bodies are held to the same limits, each on its own. */
+static void testNested() {
+	MultipartLimits limits;
+	std::string longLine = "B: " + repeat("2", 60);
+	std::string inner = "--in\r\n\r\n1\r\n--in\r\nA: 1\r\n" + longLine + "\r\n\r\n22\r\n--in--\r\n";
+	std::string body = nestedHead("in") + inner + "\r\n" + head + "\r\n3\r\n--b--\r\n";
+
+	limits.maxParts = 2;
+	limits.maxHeadersPerPart = 2;
+	checkWithin(body, limits);
+
+	limits.maxParts = 1;
+	checkExceeded(body, limits, MultipartLimits::PARTS,
+		MultipartError::PARTS_LIMIT, body.find("--in\r\nA") + 5);
+	limits.maxParts = 2;
+	limits.maxHeadersPerPart = 1;
+	checkExceeded(body, limits, MultipartLimits::HEADERS,
+		MultipartError::HEADERS_LIMIT, body.find("B:"));
+	limits.maxHeadersPerPart = 2;
+	// longer than the lines of the part holding the nested body
+	limits.maxHeaderLineSize = longLine.size();
+	checkWithin(body, limits);
+	limits.maxHeaderLineSize = longLine.size() - 1;
+	checkExceeded(body, limits, MultipartLimits::HEADER_LINE,
+		MultipartError::HEADER_LINE_LIMIT, body.find(longLine) + longLine.size() - 1);
+
+	// the nested body is data of the part holding it
+	limits = MultipartLimits();
+	limits.maxPartSize = inner.size();
+	checkWithin(body, limits);
+	limits.maxPartSize = inner.size() - 1;
+	checkExceeded(body, limits, MultipartLimits::PART_SIZE,
+		MultipartError::PART_SIZE_LIMIT, nestedHead("in").size() + inner.size() - 1);
+}
+
+int main() {
+	testHeaderLine();
+	testHeaders();
+	testParts();
+	testPartSize();
+	testBodySize();
+	testNested();
+	return testResult("LimitsTest");
+}
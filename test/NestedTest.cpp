@@ -0,0 +1,162 @@
+#include "TestHelper.h"
+
+/**
+ * Parts of multipart parts are reported between the onPartBegin and
+ * onPartEnd of the part holding them, as deep as asked, and a nested body
+ * must be terminated before the part holding it ends.
+ */
+
+static const char body[] =
+	"--outer\r\n"
+	"Content-Disposition: form-data; name=\"before\"\r\n"
+	"\r\n"
+	"1\r\n"
+	"--outer\r\n"
+	"Content-Disposition: form-data; name=\"mixed\"\r\n"
+	"Content-Type: multipart/mixed; boundary=\"mid\"\r\n"
+	"\r\n"
+	"--mid\r\n"
+	"Content-Disposition: attachment; name=\"leaf\"\r\n"
+	"\r\n"
+	"2\r\n--mi\r\n--oute\r\n"
+	"--mid\r\n"
+	"Content-Disposition: attachment; name=\"deeper\"\r\n"
+	"Content-Type: MULTIPART/alternative; boundary=in\r\n"
+	"\r\n"
+	"--in\r\n"
+	"Content-Disposition: inline; name=\"text\"\r\n"
+	"\r\n"
+	"3\r\n"
+	"--in\r\n"
+	"Content-Disposition: inline; name=\"html\"\r\n"
+	"\r\n"
+	"<p>4</p>\r\n"
+	"--in--\r\n"
+	"--mid--\r\n"
+	"\r\n"
+	"--outer\r\n"
+	"Content-Disposition: form-data; name=\"no-boundary\"\r\n"
+	"Content-Type: multipart/mixed\r\n"
+	"\r\n"
+	"5\r\n"
+	"--outer--\r\n";
+
+static std::string describe(const TestReaderLog &log) {
+	std::string out;
+	for (size_t i = 0; i < log.parts.size(); i++) {
+		const TestReaderLog::Part &part = log.parts[i];
+		out += std::to_string(part.depth) + part.name;
+		if (!part.data.empty() && part.data.size() < 20) {
+			out += "=" + part.data;
+		}
+		out += part.ended ? ";" : "...;";
+	}
+	return out;
+}
+
+static std::string parse(size_t maxDepth, size_t chunkSize) {
+	MultipartReader reader("outer");
+	TestReaderLog log;
+
+	reader.setMaxDepth(maxDepth);
+	log.attach(reader);
+	feedInChunks(reader, body, chunkSize);
+	CHECK(reader.succeeded());
+	CHECK(log.ended);
+	CHECK(log.open.empty());
+	return describe(log);
+}
+
+static void testDepths() {
+	for (size_t chunkSize : { 0, 1, 2, 7, 64 }) {
+		CHECK(parse(0, chunkSize) == "0before=1;0mixed;0no-boundary=5;");
+		CHECK(parse(1, chunkSize) == "0before=1;0mixed;1leaf=2\r\n--mi\r\n--oute;1deeper;"
+			"0no-boundary=5;");
+		CHECK(parse(2, chunkSize) == "0before=1;0mixed;1leaf=2\r\n--mi\r\n--oute;1deeper;"
+			"2text=3;2html=<p>4</p>;0no-boundary=5;");
+		CHECK(parse(3, chunkSize) == parse(2, chunkSize));
+	}
+}
+
+static void checkUnterminated(const std::string &input, size_t maxDepth, uint64_t offset) {
+	for (size_t chunkSize : { 0, 1, 5 }) {
+		MultipartReader reader("outer");
+		TestReaderLog log;
+		reader.setMaxDepth(maxDepth);
+		log.attach(reader);
+		feedInChunks(reader, input, chunkSize);
+		CHECK(reader.hasError());
+		CHECK_EQUAL(reader.getError().code, MultipartError::NESTED_BODY_UNTERMINATED);
+		CHECK_EQUAL(reader.getError().offset, offset);
+		// the part holding it does not end
+		CHECK(!log.parts.empty() && !log.parts[0].ended);
+		CHECK(!log.ended);
+	}
+}
+
+static void testUnterminated() {
+	std::string head =
+		"--outer\r\n"
+		"Content-Type: multipart/mixed; boundary=mid\r\n"
+		"\r\n";
+	std::string input = head + "--mid\r\n\r\ndata\r\n--outer--\r\n";
+	checkUnterminated(input, 1, input.find("\r\n--outer--"));
+
+	// the closing delimiter is cut short
+	input = head + "--mid\r\n\r\ndata\r\n--mid-\r\n--outer--\r\n";
+	checkUnterminated(input, 1, input.find("\r\n--outer--"));
+
+	// nothing at all
+	input = head + "\r\n--outer--\r\n";
+	checkUnterminated(input, 1, head.size());
+
+	// two levels deep, the inner one unterminated
+	input = head + "--mid\r\n"
+		"Content-Type: multipart/mixed; boundary=in\r\n"
+		"\r\n"
+		"--in\r\n\r\ndata\r\n"
+		"--mid--\r\n"
+		"\r\n--outer--\r\n";
+	checkUnterminated(input, 2, input.find("\r\n--mid--"));
+
+	// the input ends in a nested body: not an error, not a success
+	input = head + "--mid\r\n\r\ndata";
+	MultipartReader reader("outer");
+	reader.setMaxDepth(1);
+	reader.feed(input.data(), input.size());
+	CHECK(!reader.hasError());
+	CHECK(!reader.succeeded());
+}
+
+static void testMoves() {
+	std::string input = body;
+	size_t half = input.size() / 2;
+	MultipartReader first("outer");
+	TestReaderLog log;
+
+	first.setMaxDepth(2);
+	log.attach(first);
+	first.feed(input.data(), half);
+
+	MultipartReader second(std::move(first));
+	log.attach(second);
+	second.feed(input.data() + half, input.size() - half);
+	CHECK(second.succeeded());
+	CHECK(describe(log) == "0before=1;0mixed;1leaf=2\r\n--mi\r\n--oute;1deeper;"
+		"2text=3;2html=<p>4</p>;0no-boundary=5;");
+
+	// what was moved from does not descend anymore
+	TestReaderLog other;
+	first.setBoundary("outer");
+	other.attach(first);
+	first.feed(input.data(), input.size());
+	CHECK(first.succeeded());
+	CHECK(describe(other) == "0before=1;0mixed;0no-boundary=5;");
+}
+
+int main() {
+	testDepths();
+	testUnterminated();
+	testMoves();
+	return testResult("NestedTest");
+}
@@ -0,0 +1,106 @@
+#include "TestHelper.h"
+
+/** Pauses the parser on every event it records. */
+struct PausingRecorder: public TestRecorder {
+	size_t pauses;
+
+	PausingRecorder() {
+		pauses = 0;
+	}
+
+	bool onPartBegin() {
+		TestRecorder::onPartBegin();
+		return pause();
+	}
+
+	bool onHeaderField(std::string_view data) {
+		TestRecorder::onHeaderField(data);
+		return pause();
+	}
+
+	bool onHeaderValue(std::string_view data) {
+		TestRecorder::onHeaderValue(data);
+		return pause();
+	}
+
+	bool onPartData(std::string_view data) {
+		TestRecorder::onPartData(data);
+		return pause();
+	}
+
+	bool pause() {
+		pauses++;
+		return false;
+	}
+};
+
+typedef BasicMultipartParser<PausingRecorder> PausingParser;
+
+/**
+ * A boundary candidate begun in a buffer and failing at the first byte of
+ * the next: the held back bytes are delivered and pause the parser before
+ * anything of the new buffer is consumed.
+ */
+static void testPauseBeforeFirstByte() {
+	std::string first = "--AaB03x\r\n\r\nab\r\n--Aa";
+	std::string second = "Xcd\r\n--AaB03x--\r\n";
+	PausingParser parser;
+
+	parser.setBoundary("AaB03x");
+	for (size_t fed = 0; fed < first.size(); ) {
+		fed += parser.feed(first.data() + fed, first.size() - fed);
+		parser.resume();
+	}
+	CHECK(!parser.isPaused());
+	CHECK(parser.parts.back().data == "ab");
+
+	CHECK_EQUAL(parser.feed(second.data(), second.size()), 0);
+	CHECK(parser.isPaused());
+	CHECK(!parser.hasError());
+	CHECK(parser.parts.back().data == "ab\r\n--Aa");
+	parser.resume();
+	CHECK(!parser.isPaused());
+
+	size_t fed = 0;
+	while (fed < second.size() && !parser.stopped()) {
+		size_t n = parser.feed(second.data() + fed, second.size() - fed);
+		CHECK(n > 0 || parser.isPaused());
+		fed += n;
+		parser.resume();
+	}
+	CHECK(parser.succeeded());
+	CHECK_EQUAL(parser.parts.size(), 1);
+	CHECK(parser.parts.back().data == "ab\r\n--AaXcd");
+}
+
+/**
+ * Paused on every event, in buffers of any size, the parser returns 0
+ * only while paused, and loses nothing.
+ */
+static void testPauseEverywhere() {
+	std::mt19937 rng(3);
+
+	for (int n = 0; n < 50; n++) {
+		TestBody t = randomBody(rng, 2000);
+		for (size_t chunkSize : { 1, 2, 7, 64, 1000 }) {
+			PausingParser parser;
+			parser.setBoundary(t.boundary);
+			for (size_t pos = 0; pos < t.body.size() && !parser.stopped(); ) {
+				size_t len = std::min(chunkSize, t.body.size() - pos);
+				size_t fed = parser.feed(t.body.data() + pos, len);
+				CHECK(fed > 0 || parser.isPaused() || parser.stopped());
+				CHECK(fed == len || parser.isPaused() || parser.stopped());
+				pos += fed;
+			}
+			CHECK(parser.succeeded());
+			CHECK(parser.parts == t.parts);
+			CHECK(parser.pauses > 0);
+		}
+	}
+}
+
+int main() {
+	testPauseBeforeFirstByte();
+	testPauseEverywhere();
+	return testResult("PauseTest");
+}
@@ -0,0 +1,195 @@
+#include "TestHelper.h"
+#include "MultipartReaderPool.h"
+#include <new>
+#include <thread>
+
+/**
+ * A reader given back to the pool comes out of it again as new, without
+ * allocating, boundaries up to the 70 characters stored inline included;
+ * longer ones are refused.
+ */
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+	allocations++;
+	void *p = malloc(size == 0 ? 1 : size);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+static const std::string nestedBody =
+	"--b\r\n"
+	"Content-Type: multipart/mixed; boundary=in\r\n"
+	"Content-Transfer-Encoding: base64\r\n"
+	"\r\n"
+	"--in\r\n"
+	"\r\n"
+	"QUJD\r\n"
+	"--in--\r\n"
+	"\r\n--b--\r\n";
+
+static std::string formBody(const std::string &boundary) {
+	return "--" + boundary + "\r\n"
+		"Content-Disposition: form-data; name=\"field\"\r\n"
+		"X-Header: value\r\n"
+		"\r\n"
+		"data\r\n"
+		"--" + boundary + "--\r\n";
+}
+
+static void testReuse() {
+	MultipartReaderPool pool;
+	CHECK_EQUAL(pool.size(), 0);
+	pool.release(NULL);
+	CHECK_EQUAL(pool.size(), 0);
+
+	// set up every way it can be, and left in the middle of a body
+	MultipartReader *reader = pool.acquire("b");
+	TestReaderLog log;
+	log.attach(*reader);
+	reader->setMaxDepth(2);
+	reader->setTransferDecoding(true);
+	reader->setDigest(MultipartDigest::SHA256);
+	reader->setMinDataChunk(1000);
+	MultipartLimits limits;
+	limits.maxParts = 0;
+	reader->setLimits(limits);
+	reader->feed(nestedBody.data(), 20);
+	pool.release(reader);
+	CHECK_EQUAL(pool.size(), 1);
+
+	// the same one, with nothing of the above
+	MultipartReader *again = pool.acquire("b");
+	CHECK(again == reader);
+	CHECK_EQUAL(pool.size(), 0);
+	CHECK(again->onPartBegin == NULL && again->onPartData == NULL);
+	CHECK(again->onPartEnd == NULL && again->onEnd == NULL && again->userData == NULL);
+	CHECK(!again->hasError());
+	TestReaderLog other;
+	other.attach(*again);
+	again->feed(nestedBody.data(), nestedBody.size());
+	CHECK(again->succeeded());
+	CHECK_EQUAL(again->getLimitExceeded(), MultipartLimits::NONE);
+	// not descended into, nor decoded, nor digested
+	CHECK_EQUAL(other.parts.size(), 1);
+	CHECK(other.parts.size() == 1 && other.parts[0].data == nestedBody.substr(
+		nestedBody.find("--in\r\n"), nestedBody.find("\r\n--b--") - nestedBody.find("--in\r\n")));
+	CHECK(other.parts.size() == 1 && other.parts[0].digestAlgorithm == MultipartDigest::NONE);
+	pool.release(again);
+
+	// and one that failed
+	reader = pool.acquire("b");
+	reader->feed("--c", 3);
+	CHECK(reader->hasError());
+	pool.release(reader);
+	reader = pool.acquire("b");
+	CHECK(!reader->hasError());
+	std::string body = formBody("b");
+	reader->feed(body.data(), body.size());
+	CHECK(reader->succeeded());
+	pool.release(reader);
+}
+
+/** Once warm, acquiring, parsing and releasing allocates nothing. */
+static void testNoAllocations() {
+	MultipartReaderPool pool;
+	std::string boundary(MultipartParser::MAX_BOUNDARY_SIZE, 'x');
+	std::string body = formBody(boundary);
+	std::string shortBody = formBody("b");
+
+	for (int round = 0; round < 3; round++) {
+		size_t before = allocations;
+		for (int i = 0; i < 10; i++) {
+			MultipartReader *reader = pool.acquire(i % 2 == 0
+				? std::string_view(boundary) : std::string_view("b"));
+			const std::string &input = i % 2 == 0 ? body : shortBody;
+			reader->feed(input.data(), input.size());
+			CHECK(reader->succeeded());
+			pool.release(reader);
+		}
+		if (round > 0) {
+			CHECK_EQUAL(allocations - before, 0);
+		}
+	}
+}
+
+/** The longest boundary RFC 2046 allows, inline, and one character more. */
+static void testBoundarySizes() {
+	MultipartReaderPool pool;
+	std::string longest(MultipartParser::MAX_BOUNDARY_SIZE, 'y');
+
+	for (size_t chunkSize : { 0, 1, 7 }) {
+		MultipartReader *reader = pool.acquire(longest);
+		CHECK(!reader->hasError());
+		TestReaderLog log;
+		log.attach(*reader);
+		feedInChunks(*reader, formBody(longest), chunkSize);
+		CHECK(reader->succeeded());
+		CHECK(log.parts.size() == 1 && log.parts[0].data == "data");
+		pool.release(reader);
+	}
+
+	MultipartReader *reader = pool.acquire(longest + "y");
+	CHECK(reader->hasError());
+	CHECK_EQUAL(reader->getError().code, MultipartError::BOUNDARY_TOO_LONG);
+	pool.release(reader);
+	// and no harm done
+	reader = pool.acquire("b");
+	CHECK(!reader->hasError());
+	pool.release(reader);
+}
+
+static void testCapacity() {
+	MultipartReaderPool pool(2);
+	MultipartReader *readers[3];
+	for (size_t i = 0; i < 3; i++) {
+		readers[i] = pool.acquire("b");
+	}
+	for (size_t i = 0; i < 3; i++) {
+		pool.release(readers[i]);
+	}
+	CHECK_EQUAL(pool.size(), 2);
+	pool.setCapacity(1);
+	CHECK_EQUAL(pool.size(), 1);
+	pool.setCapacity(0);
+	CHECK_EQUAL(pool.size(), 0);
+}
+
+/** Each thread has its pool, and readers may go from one to another. */
+static void testLocal() {
+	MultipartReaderPool *mainPool = &MultipartReaderPool::local();
+	MultipartReader *reader = mainPool->acquire("b");
+	MultipartReaderPool *threadPool = NULL;
+
+	std::thread thread([&threadPool, reader]() {
+		threadPool = &MultipartReaderPool::local();
+		threadPool->release(reader);
+		CHECK_EQUAL(threadPool->size(), 1);
+		CHECK(threadPool->acquire("b") == reader);
+		threadPool->release(reader);
+	});
+	thread.join();
+	CHECK(threadPool != mainPool);
+	CHECK(&MultipartReaderPool::local() == mainPool);
+	CHECK_EQUAL(mainPool->size(), 0);
+}
+
+int main() {
+	testReuse();
+	testNoAllocations();
+	testBoundarySizes();
+	testCapacity();
+	testLocal();
+	return testResult("ReaderPoolTest");
+}
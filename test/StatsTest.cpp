@@ -0,0 +1,156 @@
+#include "TestHelper.h"
+#include "MultipartReader.h"
+#include <type_traits>
+
+/**
+ * Built twice: with MULTIPART_STATS on, the counters of a known body are
+ * what the parser did with it, fed whole or byte by byte; with it off, the
+ * parser and reader have no stats at all.
+ */
+
+template<typename T, typename = void>
+struct HasStats: std::false_type { };
+
+template<typename T>
+struct HasStats<T, std::void_t<decltype(&T::stats)>>: std::true_type { };
+
+template<typename T, typename = void>
+struct HasGetStats: std::false_type { };
+
+template<typename T>
+struct HasGetStats<T, std::void_t<decltype(&T::getStats)>>: std::true_type { };
+
+static_assert(HasStats<TestParser>::value == (MULTIPART_STATS > 0),
+	"the parser has stats exactly when MULTIPART_STATS is on");
+static_assert(HasStats<MultipartParser>::value == (MULTIPART_STATS > 0),
+	"the parser has stats exactly when MULTIPART_STATS is on");
+static_assert(HasGetStats<MultipartReader>::value == (MULTIPART_STATS > 0),
+	"the reader has getStats() exactly when MULTIPART_STATS is on");
+
+#if MULTIPART_STATS > 0
+
+// two parts, the second with "\r\n-X" in its data: a boundary that is not
+static const std::string body =
+	"--b\r\n"
+	"A: v\r\n"
+	"\r\n"
+	"0123456789"
+	"\r\n--b\r\n"
+	"\r\n"
+	"xx\r\n-X"
+	"\r\n--b--\r\n";
+
+/** valueCallbacks: values cut at the end of a buffer come in pieces. */
+static void checkEvents(const MultipartStats &stats, uint64_t valueCallbacks = 1) {
+	CHECK_EQUAL(stats.parts, 2);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::PART_BEGIN], 2);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::HEADER_FIELD], 1);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::HEADER_VALUE], valueCallbacks);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::HEADER_END], 1);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::HEADERS_END], 2);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::PART_END], 2);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::END], 1);
+	// "A: v\r\n\r\n" and "\r\n"
+	CHECK_EQUAL(stats.headerBytes, 10);
+}
+
+/** In one buffer the search goes straight to each real boundary. */
+static void testWhole() {
+	TestParser parser("b");
+	feedInChunks(parser, body, 0);
+	CHECK(parser.succeeded());
+	const MultipartStats &stats = parser.stats;
+
+	checkEvents(stats);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::PART_DATA], 2);
+	CHECK_EQUAL(stats.candidates, 2);
+	CHECK_EQUAL(stats.falseCandidates, 0);
+	CHECK_EQUAL(stats.lookbehindFlushes, 0);
+	CHECK_EQUAL(stats.lookbehindBytes, 0);
+	// "0123456789" and "xx\r\n-X"
+	CHECK_EQUAL(stats.bytesSkipped, 16);
+	// every other byte but the "\n" after the end
+	CHECK_EQUAL(stats.bytesStepped, body.size() - 1 - stats.bytesSkipped);
+	#if MULTIPART_STATS == 1
+		CHECK_EQUAL(stats.callbackNanoseconds, 0);
+	#endif
+
+	// a new body starts from zero
+	parser.setBoundary("b");
+	CHECK_EQUAL(stats.bytesStepped, 0);
+	CHECK_EQUAL(stats.parts, 0);
+	CHECK_EQUAL(stats.callbacks[MultipartEvent::END], 0);
+}
+
+/**
+ * Byte by byte, each CR of the data is a candidate, and "\r\n-" has to be
+ * handed back from the lookbehind once "X" arrives.
+ */
+static void testByteByByte() {
+	TestParser parser("b");
+	feedInChunks(parser, body, 1);
+	CHECK(parser.succeeded());
+	const MultipartStats &stats = parser.stats;
+
+	// "v", then nothing more of it before CR
+	checkEvents(stats, 2);
+	CHECK_EQUAL(stats.candidates, 3);
+	CHECK_EQUAL(stats.falseCandidates, 1);
+	CHECK_EQUAL(stats.lookbehindFlushes, 1);
+	CHECK_EQUAL(stats.lookbehindBytes, 3);
+	// the data but "\r\n-", matched: "X" ends the candidate, then is
+	// searched from again
+	CHECK_EQUAL(stats.bytesSkipped, 13);
+	// one step per buffer up to the end, and the second one for "X"
+	CHECK_EQUAL(stats.bytesStepped, body.size() - 2 + 1);
+}
+
+static void testSum() {
+	TestParser whole("b"), bytes("b");
+	feedInChunks(whole, body, 0);
+	feedInChunks(bytes, body, 1);
+
+	MultipartStats sum;
+	sum += whole.stats;
+	sum += bytes.stats;
+	CHECK_EQUAL(sum.parts, 4);
+	CHECK_EQUAL(sum.candidates, 5);
+	CHECK_EQUAL(sum.bytesStepped, whole.stats.bytesStepped + bytes.stats.bytesStepped);
+	CHECK_EQUAL(sum.callbacks[MultipartEvent::PART_DATA],
+		whole.stats.callbacks[MultipartEvent::PART_DATA]
+		+ bytes.stats.callbacks[MultipartEvent::PART_DATA]);
+	sum.clear();
+	CHECK_EQUAL(sum.parts, 0);
+	CHECK_EQUAL(sum.callbacks[MultipartEvent::END], 0);
+}
+
+/** The reader counts what its parser does. */
+static void testReader() {
+	MultipartReader reader("b");
+	TestReaderLog log;
+	log.attach(reader);
+	feedInChunks(reader, body, 0);
+	CHECK(reader.succeeded());
+
+	const MultipartStats &stats = reader.getStats();
+	checkEvents(stats);
+	CHECK_EQUAL(stats.candidates, 2);
+	CHECK_EQUAL(stats.bytesSkipped, 16);
+	reader.reset();
+	CHECK_EQUAL(reader.getStats().parts, 0);
+}
+
+#endif
+
+int main() {
+	#if MULTIPART_STATS > 0
+		testWhole();
+		testByteByByte();
+		testSum();
+		testReader();
+		return testResult(MULTIPART_STATS > 1 ? "StatsTest (MULTIPART_STATS 2)" : "StatsTest");
+	#else
+		// the static_asserts above are the test
+		return testResult("StatsTest (MULTIPART_STATS off)");
+	#endif
+}
@@ -0,0 +1,237 @@
+#ifndef _TEST_HELPER_H_
+#define _TEST_HELPER_H_
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include "MultipartParser.h"
+#include "MultipartReader.h"
+
+/**
+ * Just enough for the tests of test/: CHECK() reports a failed condition
+ * and goes on, and main() returns testResult().
+ */
+static int testFailures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			testFailures++; \
+		} \
+	} while (0)
+
+#define CHECK_EQUAL(actual, expected) \
+	do { \
+		if (!((actual) == (expected))) { \
+			fprintf(stderr, "%s:%d: CHECK_EQUAL(%s, %s) failed: %llu != %llu\n", \
+				__FILE__, __LINE__, #actual, #expected, \
+				(unsigned long long) (actual), (unsigned long long) (expected)); \
+			testFailures++; \
+		} \
+	} while (0)
+
+static inline int testResult(const char *name) {
+	if (testFailures > 0) {
+		fprintf(stderr, "%s: %d failures\n", name, testFailures);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+/** A part as it is expected, or as it was seen by a handler. */
+struct TestPart {
+	std::vector<std::pair<std::string, std::string> > headers;
+	std::string data;
+
+	bool operator==(const TestPart &other) const {
+		return headers == other.headers && data == other.data;
+	}
+};
+
+/** A body and the parts it is made of. */
+struct TestBody {
+	std::string boundary;
+	std::string body;
+	std::vector<TestPart> parts;
+};
+
+/**
+ * A random body whose part data is full of what looks like the boundary
+ * without being it: CR LF, "\r\n--", prefixes of the delimiter, and the
+ * delimiter followed by anything but CR LF or "--".
+ */
+static inline TestBody randomBody(std::mt19937 &rng, size_t maxDataSize) {
+	static const char boundaryChars[] = "-0123456789abcdefXYZ'()+_,./:=?";
+	TestBody t;
+	size_t boundarySize = 1 + rng() % MultipartParser::MAX_BOUNDARY_SIZE;
+
+	for (size_t i = 0; i < boundarySize; i++) {
+		t.boundary += boundaryChars[rng() % (sizeof(boundaryChars) - 1)];
+	}
+	std::string delimiter = "\r\n--" + t.boundary;
+	size_t partCount = 1 + rng() % 5;
+
+	t.body = "--" + t.boundary + "\r\n";
+	for (size_t p = 0; p < partCount; p++) {
+		TestPart part;
+		size_t headerCount = rng() % 4;
+		for (size_t h = 0; h < headerCount; h++) {
+			std::string name = std::string("X-Header-") + (char) ('a' + h);
+			std::string value = "value " + std::to_string(rng() % 1000);
+			part.headers.push_back(std::make_pair(name, value));
+			t.body += name + ": " + value + "\r\n";
+		}
+		t.body += "\r\n";
+
+		size_t dataSize = maxDataSize > 0 ? rng() % maxDataSize : 0;
+		while (part.data.size() < dataSize) {
+			switch (rng() % 8) {
+			case 0: part.data += "\r\n"; break;
+			case 1: part.data += "\r\n--"; break;
+			case 2: part.data += delimiter.substr(0, rng() % delimiter.size()); break;
+			case 3: part.data += delimiter + "-x"; break;
+			case 4: part.data += delimiter + "x"; break;
+			default:
+				for (size_t n = rng() % 64; n > 0; n--) {
+					part.data += (char) rng();
+				}
+			}
+		}
+		t.body += part.data;
+		t.body += delimiter + (p + 1 == partCount ? "--\r\n" : "\r\n");
+		t.parts.push_back(part);
+	}
+	return t;
+}
+
+/** Handler gathering the parts as the parser reports them. */
+struct TestRecorder {
+	std::vector<TestPart> parts;
+	bool ended;
+	bool inValue;
+
+	TestRecorder() {
+		ended = false;
+		inValue = false;
+	}
+
+	void onPartBegin() {
+		parts.push_back(TestPart());
+	}
+
+	void onHeaderField(std::string_view data) {
+		if (inValue || parts.back().headers.empty()) {
+			parts.back().headers.push_back(std::make_pair(std::string(), std::string()));
+			inValue = false;
+		}
+		parts.back().headers.back().first.append(data);
+	}
+
+	void onHeaderValue(std::string_view data) {
+		parts.back().headers.back().second.append(data);
+		inValue = true;
+	}
+
+	void onHeaderEnd() {
+		inValue = true;
+	}
+
+	void onPartData(std::string_view data) {
+		parts.back().data.append(data);
+	}
+
+	void onEnd() {
+		ended = true;
+	}
+};
+
+typedef BasicMultipartParser<TestRecorder> TestParser;
+
+/**
+ * Gathers what a MultipartReader reports: the parts in the order they
+ * begin, nested ones after the part holding them.
+ */
+struct TestReaderLog {
+	struct Part {
+		size_t depth;
+		std::string name;
+		std::string data;
+		MultipartDigest::Algorithm digestAlgorithm;
+		std::string digest;
+		bool ended;
+	};
+
+	MultipartReader *reader;
+	std::vector<Part> parts;
+	std::vector<size_t> open;  // parts begun and not ended yet
+	bool ended;
+
+	TestReaderLog() {
+		reader = NULL;
+		ended = false;
+	}
+
+	/** Start, or go on, logging the events of reader. */
+	void attach(MultipartReader &reader) {
+		this->reader = &reader;
+		reader.onPartBegin = partBegin;
+		reader.onPartData  = partData;
+		reader.onPartEnd   = partEnd;
+		reader.onEnd       = end;
+		reader.userData    = this;
+	}
+
+	static void partBegin(const MultipartHeaders &headers, void *userData) {
+		TestReaderLog *self = (TestReaderLog *) userData;
+		Part part;
+		part.depth = self->reader->depth();
+		part.name = std::string(headers.name());
+		part.digestAlgorithm = MultipartDigest::NONE;
+		part.ended = false;
+		self->open.push_back(self->parts.size());
+		self->parts.push_back(part);
+	}
+
+	static void partData(const char *buffer, size_t size, void *userData) {
+		TestReaderLog *self = (TestReaderLog *) userData;
+		self->parts[self->open.back()].data.append(buffer, size);
+	}
+
+	static void partEnd(void *userData) {
+		TestReaderLog *self = (TestReaderLog *) userData;
+		Part &part = self->parts[self->open.back()];
+		part.digestAlgorithm = self->reader->getDigest().getAlgorithm();
+		part.digest = self->reader->getDigest().hex();
+		part.ended = true;
+		self->open.pop_back();
+	}
+
+	static void end(void *userData) {
+		((TestReaderLog *) userData)->ended = true;
+	}
+};
+
+/**
+ * Feed body to parser in chunks of chunkSize bytes (all of it at once if
+ * 0), each chunk fed again from where the parser paused.
+ */
+template<typename Parser>
+static inline void feedInChunks(Parser &parser, std::string_view body, size_t chunkSize) {
+	if (chunkSize == 0) {
+		chunkSize = body.size();
+	}
+	for (size_t pos = 0; pos < body.size() && !parser.stopped(); ) {
+		size_t len = std::min(chunkSize, body.size() - pos);
+		size_t fed = 0;
+		while (fed < len && !parser.stopped()) {
+			fed += parser.feed(body.data() + pos + fed, len - fed);
+		}
+		pos += len;
+	}
+}
+
+#endif /* _TEST_HELPER_H_ */